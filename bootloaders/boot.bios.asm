@@ -53,7 +53,7 @@ write_msg:
 @@:
 	pop si ax
 	ret
-; Load sector DS:SI to buffer BX:0
+; Load [dap.sector_count] sectors (only one using CHS) from sector DS:SI to buffer BX:0
 load_sector:
 	push ax bx cx dx si di es
 	mov di, dap.sector
@@ -73,7 +73,6 @@ load_sector:
 .load_sector_lba:
 	mov [dap.size], 16
 	mov [dap.reserved], 0
-	mov [dap.sector_count], 1
 	mov [dap.segment], bx
 	mov [dap.offset], 0
 	mov si, dap
@@ -175,6 +174,7 @@ boot:
 	mov si, boot_msg
 	call write_msg
 	; Load addional bootloader code
+	mov [dap.sector_count], 1
 	mov si, extra_boot_loader_sector
 	mov bx, extra_boot_code_base shr 4
 	xor cx, cx
@@ -204,12 +204,12 @@ db 0x55, 0xAA
 ; Addional bootloader code
 extra_boot_code_base:
 ; Addional bootloader data
-extra_boot_code_size dw 1
+extra_boot_code_size dw 2
 ok_msg db "OK",13,10,0
 load_msg_prefix db 'Loading "',0
 load_msg_suffix db '"...',0
 secondary_boot_file_name db "boot.bin",0
-load_block_tmp_index dq ?
+load_sectors_tmp_index dq ?
 virtual at 0x9000
 secondary_boot:
 	.magic dw ?
@@ -222,26 +222,12 @@ secondary_boot:
 	.disk_id dw ?
 	.low_memory_size dw ?
 end virtual
-; Load ListFS block with index DS:SI to buffer BX:0 (BX will be pointer to end of file data)
+; Load ListFS block with index DS:SI to buffer BX:0
 load_block:
-	push ax bx cx si di
-	mov di, load_block_tmp_index
-	mov cx, 8 / 2
-	rep movsw
-	mov si, load_block_tmp_index
-	xor cx, cx
-@@:
-	call load_sector
-	xor ax, ax
-	add word[load_block_tmp_index], 1
-	adc word[load_block_tmp_index + 2], ax
-	adc word[load_block_tmp_index + 4], ax
-	adc word[load_block_tmp_index + 6], ax
-	add bx, 512 shr 4
-	add cx, 512
-	cmp cx, [fs_block_size]
-	jb @b
-	pop di si cx bx ax
+	push bx cx
+	mov cx, 1
+	call load_blocks
+	pop cx bx
 	ret
 ; Put DS:SI string length to CX
 strlen:
@@ -321,39 +307,16 @@ load_file:
 	mov si, f_info.data
 	jmp .search
 .load_data:
-	mov si, f_info.data
-.load_block_list:
-	mov ax, word[si]
-	and ax, word[si + 2]
-	and ax, word[si + 4]
-	and ax, word[si + 6]
-	cmp ax, 0xFFFF
-	je .file_end
-	mov bx, f_info shr 4
-	call load_block
-	mov si, f_info + 8
-.load_block:
 	pop bx
-	call load_block
-	mov ax, [fs_block_size]
-	shr ax, 4
-	add bx, ax
-	cmp bx, [low_memory_size]
-	jae out_of_memory
-	push bx
-	add si, 8
-	mov ax, si
-	add ax, 8
-	cmp ax, [fs_block_size]
-	jb .load_block
-	jmp .load_block_list
-.file_end:
+	call load_file_data
 	mov si, ok_msg
 	call write_msg
-	pop bx bp di si cx ax
+	pop bp di si cx ax
 	ret
 ; Addional bootloader entry point
 extra_boot_entry:
+	; Check volume and block size
+	call check_volume
 	; Load secondary boot loader
 	mov si, secondary_boot_file_name
 	mov bx, secondary_boot shr 4
@@ -379,4 +342,173 @@ extra_boot_entry:
 	jmp [secondary_boot.entry_point]
 ; Free space and signature
 rb 1022 - ($ - $$)
-extra_boot_sig db 0xAA, 0x55
\ No newline at end of file
+extra_boot_sig db 0xAA, 0x55
+; Load CX sectors from sector DS:SI to buffer BX:0 (BX will be pointer to end of data)
+load_sectors:
+	push ax cx si di
+	mov di, load_sectors_tmp_index
+	push cx
+	mov cx, 8 / 2
+	rep movsw
+	pop cx
+	mov si, load_sectors_tmp_index
+.next:
+	jcxz .exit
+	; CHS reads go one sector at a time
+	mov ax, 1
+	cmp [disk_heads], 0
+	jne .transfer
+	; LBA reads are limited to 127 sectors and must not cross 64 KiB DMA boundary
+	mov ax, bx
+	and ax, 0x0FFF
+	neg ax
+	add ax, 0x1000
+	shr ax, 5
+	cmp ax, 127
+	jbe @f
+	mov ax, 127
+@@:
+	cmp ax, cx
+	jbe .transfer
+	mov ax, cx
+.transfer:
+	mov [dap.sector_count], ax
+	call load_sector
+	mov [dap.sector_count], 1
+	sub cx, ax
+	add word[si], ax
+	adc word[si + 2], 0
+	adc word[si + 4], 0
+	adc word[si + 6], 0
+	shl ax, 9 - 4
+	add bx, ax
+	jmp .next
+.exit:
+	pop di si cx ax
+	ret
+; Check that blocks of volume can be loaded and count sectors per block
+check_volume:
+	push ax
+	; "LISB" volumes keep log2 of block sizes from 64 KiB, such blocks don't fit below bootloader
+	cmp word[fs_magic], 0x494C
+	jne .not_listfs
+	cmp word[fs_magic + 2], 0x4253
+	je .wrong_block_size
+	cmp word[fs_magic + 2], 0x5453
+	jne .not_listfs
+	; Blocks are read as whole sectors, block lists are loaded to f_info
+	mov ax, [fs_block_size]
+	test ax, 511
+	jnz .wrong_block_size
+	cmp ax, 0x7C00 - f_info
+	ja .wrong_block_size
+	shr ax, 9
+	mov [sectors_per_block], ax
+	pop ax
+	ret
+.not_listfs:
+	call error
+	db "NOT LISTFS",0
+.wrong_block_size:
+	call error
+	db "UNSUPPORTED BLOCK SIZE",0
+sectors_per_block dw 1
+load_blocks_tmp_index dq ?
+; Load CX ListFS blocks from block DS:SI to buffer BX:0 (BX will be pointer to end of data)
+load_blocks:
+	push ax cx dx si di bp
+	mov bp, [sectors_per_block]
+	mov ax, bp
+	mul cx
+	push ax
+	; First sector is block index times sectors per block
+	mov di, load_blocks_tmp_index
+	xor cx, cx
+@@:
+	lodsw
+	mul bp
+	add ax, cx
+	adc dx, 0
+	stosw
+	mov cx, dx
+	cmp di, load_blocks_tmp_index + 8
+	jb @b
+	pop cx
+	mov si, load_blocks_tmp_index
+	call load_sectors
+	pop bp di si dx cx ax
+	ret
+; Load data of file f_info to buffer BX:0 (BX will be pointer to end of file data)
+load_file_data:
+	push ax cx dx si di
+	mov si, f_info.data
+.load_block_list:
+	mov ax, word[si]
+	and ax, word[si + 2]
+	and ax, word[si + 4]
+	and ax, word[si + 6]
+	cmp ax, 0xFFFF
+	je .exit
+	push bx
+	mov bx, f_info shr 4
+	call load_block
+	pop bx
+	mov si, f_info + 8
+.load_run:
+	; Last entry of list is index of next list
+	mov ax, si
+	sub ax, f_info - 16
+	cmp ax, [fs_block_size]
+	ja .load_block_list
+	mov ax, word[si]
+	and ax, word[si + 2]
+	and ax, word[si + 4]
+	and ax, word[si + 6]
+	cmp ax, 0xFFFF
+	je .exit
+	; Collect run of consecutive blocks
+	mov di, si
+	mov cx, 1
+.extend_run:
+	mov ax, di
+	sub ax, f_info - 24
+	cmp ax, [fs_block_size]
+	ja .load_run_data
+	cmp cx, 127
+	jae .load_run_data
+	mov ax, word[di]
+	mov dx, word[di + 2]
+	add ax, 1
+	adc dx, 0
+	cmp ax, word[di + 8]
+	jne .load_run_data
+	cmp dx, word[di + 10]
+	jne .load_run_data
+	mov ax, word[di + 4]
+	cmp ax, word[di + 12]
+	jne .load_run_data
+	mov ax, word[di + 6]
+	cmp ax, word[di + 14]
+	jne .load_run_data
+	add di, 8
+	inc cx
+	jmp .extend_run
+.load_run_data:
+	; Check that run fits in low memory
+	mov ax, [fs_block_size]
+	shr ax, 4
+	mul cx
+	test dx, dx
+	jnz out_of_memory
+	add ax, bx
+	jc out_of_memory
+	cmp ax, [low_memory_size]
+	ja out_of_memory
+	call load_blocks
+	lea si, [di + 8]
+	jmp .load_run
+.exit:
+	pop di si dx cx ax
+	ret
+; Free space
+rb 1536 - ($ - $$)
\ No newline at end of file
@@ -28,13 +28,21 @@
 #include "listfs.h"
 #include "liblistfs.h"
 
-typedef struct {
+/* Files open on a volume, so that every node is open at most once per volume */
+struct _ListFS_FileInfo {
 	ListFS_BlockIndex node;
 	ListFS_OpennedFile *file;
-} FileInfo;
+};
 
-FileInfo *file_info = NULL;
-size_t file_info_count;
+ListFS_OpennedFile *listfs_find_open_file(ListFS *this, ListFS_BlockIndex node) {
+	size_t i;
+	for (i = 0; i < this->file_info_count; i++) {
+		if (this->file_info[i].node == node) {
+			return this->file_info[i].file;
+		}
+	}
+	return NULL;
+}
 
 /* Some utility functions */
 
@@ -46,10 +54,105 @@ uint64_t max(uint64_t a, uint64_t b) {
 	return (a > b) ? a : b;
 }
 
-uint64_t bytes_to_blocks(uint64_t bytes, uint16_t block_size) {
+uint64_t bytes_to_blocks(uint64_t bytes, uint32_t block_size) {
 	return (bytes + block_size - 1) / block_size;
 }
 
+bool listfs_valid_block_size(uint32_t block_size) {
+	if (block_size < LISTFS_MIN_BLOCK_SIZE) return false;
+	if (block_size <= UINT16_MAX) return true;
+	return (block_size <= LISTFS_MAX_BLOCK_SIZE) && !(block_size & (block_size - 1));
+}
+
+/* Blocks of 64 KiB and larger are stored as log2 of size, which is always less than LISTFS_MIN_BLOCK_SIZE */
+uint16_t listfs_encode_block_size(uint32_t block_size) {
+	if (block_size <= UINT16_MAX) return block_size;
+	uint16_t shift = 0;
+	while ((1U << shift) < block_size) {
+		shift++;
+	}
+	return shift;
+}
+
+/* Returns 0 for values that are no block size at all, only sizes above UINT16_MAX are stored as log2 */
+uint32_t listfs_decode_block_size(uint16_t block_size) {
+	if (block_size >= LISTFS_MIN_BLOCK_SIZE) return block_size;
+	return ((block_size > 15) && (block_size < 32)) ? (1U << block_size) : 0;
+}
+
+struct _ListFS_FreeList {
+	ListFS_BlockIndex *blocks;
+	size_t count;
+	size_t capacity;
+};
+
+void listfs_free_list_add(ListFS_FreeList *list, ListFS_BlockIndex block) {
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 64;
+		list->blocks = realloc(list->blocks, list->capacity * sizeof(ListFS_BlockIndex));
+	}
+	list->blocks[list->count] = block;
+	list->count++;
+}
+
+uint64_t listfs_checksum(uint64_t hash, void *data, size_t length) {
+	uint8_t *bytes = data;
+	while (length--) {
+		hash ^= *bytes++;
+		hash *= 0x100000001B3ULL;
+	}
+	return hash;
+}
+
+#define LISTFS_CHECKSUM_INIT 0xCBF29CE484222325ULL
+
+/* Buffer pool functions */
+
+/*
+	Block-sized buffers of metadata paths are borrowed from a per-volume pool. Returned buffers are kept on
+	a stack linked through their first bytes, so once warmed up the pool holds as many buffers as were ever
+	borrowed at the same time and no further heap allocations are made. Read-only volumes are used from
+	several threads without external locking, so the stack is lock-free: its head is swapped with a double
+	width compare-and-swap together with a tag, which keeps a pop from succeeding on a head that was popped
+	and pushed back in between (ABA). Buffers are only freed by listfs_close, so a racing pop may read the
+	link of a buffer that is in use, but then its swap fails and it retries.
+*/
+
+void *listfs_get_buffer(ListFS *this) {
+	ListFS_BufferPool head, next;
+	__atomic_load(&this->buffer_pool, &head, __ATOMIC_ACQUIRE);
+	while (head.top) {
+		next.top = __atomic_load_n((void**)head.top, __ATOMIC_RELAXED);
+		next.tag = head.tag + 1;
+		if (__atomic_compare_exchange(&this->buffer_pool, &head, &next, true, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE)) break;
+	}
+	void *buffer = head.top;
+	if (!buffer) {
+		/* Largest power of two dividing block size, up to a page */
+		size_t alignment = min(this->block_size & -this->block_size, 4096);
+		if (posix_memalign(&buffer, max(alignment, sizeof(void*)), this->block_size)) return NULL;
+	}
+	return buffer;
+}
+
+void listfs_put_buffer(ListFS *this, void *buffer) {
+	if (!buffer) return;
+	ListFS_BufferPool head, next = {buffer, 0};
+	__atomic_load(&this->buffer_pool, &head, __ATOMIC_RELAXED);
+	do {
+		__atomic_store_n((void**)buffer, head.top, __ATOMIC_RELAXED);
+		next.tag = head.tag + 1;
+	} while (!__atomic_compare_exchange(&this->buffer_pool, &head, &next, true, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+void listfs_free_pool(ListFS *this) {
+	while (this->buffer_pool.top) {
+		void *next = *(void**)this->buffer_pool.top;
+		free(this->buffer_pool.top);
+		this->buffer_pool.top = next;
+	}
+}
+
 /* I/O functions */
 
 void listfs_log(ListFS *this, char *fmt, ...) {
@@ -62,19 +165,140 @@ void listfs_log(ListFS *this, char *fmt, ...) {
 	}
 }
 
+bool listfs_journal_active(ListFS *this) {
+	return this->ext_header && (this->ext_header->journal_size > 0);
+}
+
+ListFS_BlockIndex listfs_ext_header_block(ListFS *this) {
+	return this->header->map_base + this->header->map_size;
+}
+
+size_t listfs_transaction_slot(ListFS_Transaction *transaction, ListFS_BlockIndex index) {
+	size_t slot = (index * 0x9E3779B97F4A7C15ULL) & (transaction->hash_size - 1);
+	while (transaction->hash[slot] && (transaction->blocks[transaction->hash[slot] - 1] != index)) {
+		slot = (slot + 1) & (transaction->hash_size - 1);
+	}
+	return slot;
+}
+
+void *listfs_transaction_find(ListFS *this, ListFS_BlockIndex index) {
+	ListFS_Transaction *transaction = &this->transaction;
+	if (transaction->count == 0) return NULL;
+	size_t entry = transaction->hash[listfs_transaction_slot(transaction, index)];
+	return entry ? (transaction->data + (entry - 1) * this->block_size) : NULL;
+}
+
+void listfs_transaction_add(ListFS *this, ListFS_BlockIndex index, void *buffer) {
+	ListFS_Transaction *transaction = &this->transaction;
+	void *data = listfs_transaction_find(this, index);
+	if (data) {
+		memcpy(data, buffer, this->block_size);
+		return;
+	}
+	if (transaction->count == transaction->capacity) {
+		transaction->capacity = transaction->capacity ? transaction->capacity * 2 : 64;
+		transaction->blocks = realloc(transaction->blocks, transaction->capacity * sizeof(ListFS_BlockIndex));
+		transaction->data = realloc(transaction->data, transaction->capacity * this->block_size);
+		free(transaction->hash);
+		transaction->hash_size = transaction->capacity * 2;
+		transaction->hash = calloc(transaction->hash_size, sizeof(size_t));
+		size_t i;
+		for (i = 0; i < transaction->count; i++) {
+			transaction->hash[listfs_transaction_slot(transaction, transaction->blocks[i])] = i + 1;
+		}
+	}
+	transaction->blocks[transaction->count] = index;
+	memcpy(transaction->data + transaction->count * this->block_size, buffer, this->block_size);
+	transaction->count++;
+	transaction->hash[listfs_transaction_slot(transaction, index)] = transaction->count;
+}
+
+void listfs_transaction_clear(ListFS *this) {
+	ListFS_Transaction *transaction = &this->transaction;
+	if (transaction->hash) {
+		memset(transaction->hash, 0, transaction->hash_size * sizeof(size_t));
+	}
+	transaction->count = 0;
+}
+
+ListFS_BlockCount listfs_journal_blocks_needed(ListFS *this, ListFS_BlockCount count) {
+	size_t per_descriptor = (this->block_size - sizeof(ListFS_JournalBlock)) / sizeof(ListFS_BlockIndex);
+	return count + (count + per_descriptor - 1) / per_descriptor + 1;
+}
+
+bool listfs_commit_transaction(ListFS *this);
+
+#define LISTFS_JOURNAL_OP_BLOCKS 32
+
+/*
+	Makes room in the journal for count more blocks before an operation dirties them (LISTFS_JOURNAL_OP_BLOCKS
+	covers node operations, free lists reserve their bitmap blocks). If the transaction can't take them, it
+	is committed first, so it ends between operations. Returns false if they don't fit even an empty
+	journal: the operation is then split by the reservations of every single block it dirties.
+*/
+bool listfs_journal_reserve(ListFS *this, ListFS_BlockCount count) {
+	if (!listfs_journal_active(this) || this->committing) return true;
+	/* Volume header is added to every transaction */
+	if (listfs_journal_blocks_needed(this, this->transaction.count + this->map_dirty_count + 1 + count) <=
+			this->ext_header->journal_size) return true;
+	listfs_log(this, "[%s] Journal is full, committing before %llu more blocks\n", __func__, count);
+	listfs_commit_transaction(this);
+	return listfs_journal_blocks_needed(this, this->transaction.count + this->map_dirty_count + 1 + count) <=
+		this->ext_header->journal_size;
+}
+
 void listfs_read_block(ListFS *this, ListFS_BlockIndex index, void *buffer) {
 	if (!this) return;
 	listfs_log(this, "[%s] index = %llu\n", __func__, index);
+	void *data = listfs_transaction_find(this, index);
+	if (data) {
+		memcpy(buffer, data, this->block_size);
+		return;
+	}
 	this->read_block_func(this, index, buffer);
 }
 
 void listfs_read_blocks(ListFS *this, ListFS_BlockIndex index, void *buffer, size_t count) {
 	if (!this) return;
 	listfs_log(this, "[%s] index = %llu, count = %i\n", __func__, index, count);
+	if (this->read_blocks_func) {
+		this->read_blocks_func(this, index, buffer, count);
+		/* Blocks of the current transaction are newer than their home locations */
+		while (count) {
+			void *data = listfs_transaction_find(this, index);
+			if (data) {
+				memcpy(buffer, data, this->block_size);
+			}
+			index++;
+			buffer += this->block_size;
+			count--;
+		}
+		return;
+	}
 	while (count) {
 		listfs_read_block(this, index, buffer);
 		index++;
-		buffer += this->header->block_size;
+		buffer += this->block_size;
+		count--;
+	}
+}
+
+bool listfs_check_writable(ListFS *this, const char *func) {
+	if (!this->read_only) return true;
+	listfs_log(this, "[%s] Volume is read-only!\n", func);
+	return false;
+}
+
+void listfs_write_raw_blocks(ListFS *this, ListFS_BlockIndex index, void *buffer, size_t count) {
+	if (!listfs_check_writable(this, __func__)) return;
+	if (this->write_blocks_func) {
+		this->write_blocks_func(this, index, buffer, count);
+		return;
+	}
+	while (count) {
+		this->write_block_func(this, index, buffer);
+		index++;
+		buffer += this->block_size;
 		count--;
 	}
 }
@@ -82,32 +306,147 @@ void listfs_read_blocks(ListFS *this, ListFS_BlockIndex index, void *buffer, siz
 void listfs_write_block(ListFS *this, ListFS_BlockIndex index, void *buffer) {
 	if (!this) return;
 	listfs_log(this, "[%s] index = %llu\n", __func__, index);
+	if (!listfs_check_writable(this, __func__)) return;
+	if (listfs_journal_active(this) && !this->committing) {
+		if (!listfs_transaction_find(this, index)) {
+			listfs_journal_reserve(this, 1);
+		}
+		listfs_transaction_add(this, index, buffer);
+		return;
+	}
+	this->write_block_func(this, index, buffer);
+}
+
+void listfs_write_data_block(ListFS *this, ListFS_BlockIndex index, void *buffer) {
+	if (!this) return;
+	listfs_log(this, "[%s] index = %llu\n", __func__, index);
+	if (!listfs_check_writable(this, __func__)) return;
+	void *data = listfs_transaction_find(this, index);
+	if (data) {
+		memcpy(data, buffer, this->block_size);
+		return;
+	}
 	this->write_block_func(this, index, buffer);
 }
 
 void listfs_write_blocks(ListFS *this, ListFS_BlockIndex index, void *buffer, size_t count) {
 	if (!this) return;
 	listfs_log(this, "[%s] index = %llu, count = %i\n", __func__, index, count);
+	if (!listfs_journal_active(this) || this->committing) {
+		listfs_write_raw_blocks(this, index, buffer, count);
+		return;
+	}
 	while (count) {
 		listfs_write_block(this, index, buffer);
 		index++;
-		buffer += this->header->block_size;
+		buffer += this->block_size;
 		count--;
 	}
 }
 
+void listfs_flush(ListFS *this) {
+	if (this->flush_func) {
+		this->flush_func(this);
+	}
+}
+
 /* Bitmap functions */
 
+void listfs_init_groups(ListFS *this) {
+	if (!this) return;
+	this->group_size = this->block_size * 8;
+	this->group_count = bytes_to_blocks(this->header->size, this->group_size);
+	this->groups = calloc(this->group_count, sizeof(ListFS_AllocGroup));
+	size_t g;
+	for (g = 0; g < this->group_count; g++) {
+		ListFS_BlockIndex start = g * this->group_size;
+		ListFS_BlockIndex end = min(start + this->group_size, this->header->size);
+		ListFS_BlockCount used = 0;
+		size_t i = start / 8, last = bytes_to_blocks(end, 8);
+		for (; i + sizeof(uint64_t) <= last; i += sizeof(uint64_t)) {
+			uint64_t word;
+			memcpy(&word, this->map + i, sizeof(word));
+			used += __builtin_popcountll(word);
+		}
+		for (; i < last; i++) {
+			used += __builtin_popcount(this->map[i]);
+		}
+		this->groups[g].cursor = start;
+		this->groups[g].free_blocks = end - start - used;
+	}
+	listfs_log(this, "[%s] group_count = %u, group_size = %llu\n", __func__, this->group_count, this->group_size);
+}
+
+void listfs_update_groups(ListFS *this, ListFS_BlockIndex index, ListFS_BlockCount count, bool used) {
+	if (!this->groups) return;
+	ListFS_BlockIndex end = index + count;
+	while (index < end) {
+		ListFS_AllocGroup *group = &this->groups[index / this->group_size];
+		ListFS_BlockIndex group_end = min((index / this->group_size + 1) * this->group_size, end);
+		if (used) {
+			group->free_blocks -= group_end - index;
+			if ((group->cursor >= index) && (group->cursor < group_end)) {
+				group->cursor = group_end;
+			}
+		} else {
+			group->free_blocks += group_end - index;
+			if (group->cursor > index) {
+				group->cursor = index;
+			}
+		}
+		index = group_end;
+	}
+}
+
+void listfs_mark_map_dirty(ListFS *this, ListFS_BlockIndex index, size_t count) {
+	if (!this->map_dirty || (count == 0)) return;
+	size_t first = index / 8 / this->block_size, last = (index + count - 1) / 8 / this->block_size, i;
+	for (i = first; i <= last; i++) {
+		if (!(this->map_dirty[i / 8] & (1 << (i % 8)))) {
+			listfs_journal_reserve(this, 1);
+			this->map_dirty[i / 8] |= 1 << (i % 8);
+			this->map_dirty_count++;
+		}
+	}
+}
+
+void listfs_write_map(ListFS *this) {
+	if (!this->map_dirty) return;
+	/* Only dirty bitmap blocks are written, coalesced into runs */
+	size_t map_size = this->header->map_size, i = 0;
+	while (i < map_size) {
+		if ((i % 8 == 0) && (this->map_dirty[i / 8] == 0)) {
+			i += 8;
+			continue;
+		}
+		if (!(this->map_dirty[i / 8] & (1 << (i % 8)))) {
+			i++;
+			continue;
+		}
+		size_t start = i;
+		while ((i < map_size) && (this->map_dirty[i / 8] & (1 << (i % 8)))) {
+			i++;
+		}
+		listfs_write_raw_blocks(this, this->header->map_base + start, this->map + start * this->block_size, i - start);
+	}
+	memset(this->map_dirty, 0, bytes_to_blocks(map_size, 8));
+	this->map_dirty_count = 0;
+}
+
 void listfs_get_blocks(ListFS *this, ListFS_BlockIndex index, size_t count) {
 	if (!this) return;
 	listfs_log(this, "[%s] index = %llu, count = %u\n", __func__, index, count);
+	if (!listfs_check_writable(this, __func__) || !listfs_load_map(this)) return;
+	listfs_mark_map_dirty(this, index, count);
 	this->header->used_blocks += count;
+	listfs_update_groups(this, index, count, true);
 	size_t i = index / 8;
 	uint8_t j = index % 8;
 	if (j) {
 		for (j = index % 8; j < 8; j++) {
 			this->map[i] |= 1 << j;
 			count--;
+			if (count == 0) break;
 		}
 		i++;
 	}
@@ -124,7 +463,19 @@ void listfs_get_blocks(ListFS *this, ListFS_BlockIndex index, size_t count) {
 void listfs_free_blocks(ListFS *this, ListFS_BlockIndex index, size_t count) {
 	if (!this) return;
 	listfs_log(this, "[%s] index = %llu, count = %u\n", __func__, index, count);
+	if (!listfs_check_writable(this, __func__) || !listfs_load_map(this)) return;
+	listfs_mark_map_dirty(this, index, count);
+	if (listfs_journal_active(this) && !this->committing) {
+		/* Blocks stay allocated until the transaction that frees them is committed */
+		while (count) {
+			listfs_free_list_add(this->deferred_frees, index);
+			index++;
+			count--;
+		}
+		return;
+	}
 	this->header->used_blocks -= count;
+	listfs_update_groups(this, index, count, false);
 	size_t i = index / 8;
 	uint8_t j = index % 8;
 	if (j) {
@@ -145,203 +496,1501 @@ void listfs_free_blocks(ListFS *this, ListFS_BlockIndex index, size_t count) {
 	}
 }
 
-ListFS_BlockIndex listfs_alloc_block(ListFS *this) {
-	if (!this) return;
-	listfs_log(this, "[%s]\n", __func__);
-	size_t start_byte = this->last_allocated_block / 8;
-	size_t end_byte = bytes_to_blocks(this->header->size, 8);
-	size_t byte = start_byte;
-	while (this->map[byte] == 0xFF) {
-		byte++;
-		if (byte == end_byte) {
-			byte = 0;
-		}
-		if (byte == start_byte) {
-			listfs_log(this, "[%s] Free block not found\n", __func__);
-			return -1;
-		}
-	}
-	uint8_t bit;
-	for (bit = 0; bit < 8; bit++) {
-		if ((this->map[byte] & (1 << bit)) == 0) {
-			break;
-		}
+/* Reference count functions */
+
+/*
+	Data blocks shared by cloned files have a nonzero reference count (count of owners besides the first).
+	Counts are kept in chunks of one block each, which are allocated by the first shared block they cover
+	and read on first use, so volumes with few clones need neither a large contiguous table on disk nor
+	a copy of it in memory. Shared blocks are copied on the first write through a file and freeing a shared
+	block only drops one reference.
+*/
+
+size_t listfs_refcount_chunk_size(ListFS *this) {
+	return this->block_size / sizeof(uint16_t);
+}
+
+size_t listfs_refcount_chunk_count(ListFS *this) {
+	return bytes_to_blocks(this->header->size, listfs_refcount_chunk_size(this));
+}
+
+uint16_t *listfs_load_refcount_chunk(ListFS *this, size_t chunk) {
+	if (!this->refcounts[chunk] && (this->refcount_chunks[chunk] != -1)) {
+		this->refcounts[chunk] = malloc(this->block_size);
+		listfs_read_block(this, this->refcount_chunks[chunk], this->refcounts[chunk]);
 	}
-	this->map[byte] |= 1 << bit;
-	this->last_allocated_block = byte * 8 + bit;
-	listfs_log(this, "[%s] Found free block %llu\n", __func__, this->last_allocated_block);
-	this->header->used_blocks++;
-	return this->last_allocated_block;
+	return this->refcounts[chunk];
 }
 
-/* Node functions */
+uint16_t listfs_get_refcount(ListFS *this, ListFS_BlockIndex block) {
+	if (!this->refcount_chunks || (block >= this->header->size)) return 0;
+	size_t chunk_size = listfs_refcount_chunk_size(this);
+	uint16_t *chunk = listfs_load_refcount_chunk(this, block / chunk_size);
+	return chunk ? chunk[block % chunk_size] : 0;
+}
 
-ListFS_NodeHeader *listfs_fetch_node(ListFS *this, ListFS_BlockIndex node) {
-	if (!this) return NULL;
-	if (node == -1) return NULL;
-	listfs_log(this, "[%s] node = %llu\n", __func__, node);
-	ListFS_NodeHeader *header = malloc(this->header->block_size);
-	listfs_read_block(this, node, header);
-	return header;
+bool listfs_block_shared(ListFS *this, ListFS_BlockIndex block) {
+	return listfs_get_refcount(this, block) != 0;
 }
 
-void listfs_insert_node(ListFS *this, ListFS_BlockIndex node, ListFS_BlockIndex parent) {
-	if (!this) return;
-	if (node == -1) return;
-	listfs_log(this, "[%s] node = %llu, parent = %llu\n", __func__, node, parent);
-	ListFS_NodeHeader *header = listfs_fetch_node(this, node);
-	header->parent = parent;
-	header->prev = -1;
-	ListFS_NodeHeader *tmp_header = calloc(this->header->block_size, 1);
-	if (parent == -1) {
-		header->next = this->header->root_dir;
-		this->header->root_dir = node;
-	} else {
-		listfs_read_block(this, parent, tmp_header);
-		header->next = tmp_header->data;
-		tmp_header->data = node;
-		listfs_write_block(this, parent, tmp_header);
+/* Fails only if the chunk for a new count can't be allocated */
+bool listfs_set_refcount(ListFS *this, ListFS_BlockIndex block, uint16_t count) {
+	size_t chunk_size = listfs_refcount_chunk_size(this);
+	size_t i = block / chunk_size;
+	if (!listfs_load_refcount_chunk(this, i)) {
+		if (!count) return true;
+		ListFS_BlockIndex chunk = listfs_alloc_block_near(this, this->ext_header->refcount_base);
+		if (chunk == -1) {
+			listfs_log(this, "[%s] No space for reference count chunk!\n", __func__);
+			return false;
+		}
+		this->refcounts[i] = calloc(1, this->block_size);
+		this->refcount_chunks[i] = chunk;
+		size_t dir_block = i * sizeof(ListFS_BlockIndex) / this->block_size;
+		listfs_write_block(this, this->ext_header->refcount_base + dir_block,
+			(uint8_t*)this->refcount_chunks + dir_block * this->block_size);
 	}
-	if (header->next != -1) {
-		listfs_read_block(this, header->next, tmp_header);
-		tmp_header->prev = node;
-		listfs_write_block(this, header->next, tmp_header);
+	this->refcounts[i][block % chunk_size] = count;
+	if (!this->refcount_dirty[i]) {
+		this->refcount_dirty[i] = 1;
+		this->refcount_dirty_count++;
 	}
-	listfs_write_block(this, node, header);
-	free(tmp_header);
-	free(header);
+	return true;
 }
 
-void listfs_remove_node(ListFS *this, ListFS_BlockIndex node) {
-	if (!this) return;
-	if (node == -1) return;
-	listfs_log(this, "[%s] node = %llu\n", __func__, node);
-	ListFS_NodeHeader *header = listfs_fetch_node(this, node);
-	ListFS_BlockIndex next = header->next, prev = header->prev, parent = header->parent;
-	if (next != -1) {
-		listfs_read_block(this, next, header);
-		header->prev = prev;
-		listfs_write_block(this, next, header);
-	}
-	if (prev != -1) {
-		listfs_read_block(this, prev, header);
-		header->next = next;
-		listfs_write_block(this, prev, header);
-	} else {
-		if (parent != -1) {
-			listfs_read_block(this, parent, header);
-			header->data = next;
-			listfs_write_block(this, parent, header);
-		} else {
-			this->header->root_dir = next;
+void listfs_flush_refcounts(ListFS *this) {
+	if (!this->refcount_dirty_count) return;
+	size_t i, count = listfs_refcount_chunk_count(this);
+	for (i = 0; i < count; i++) {
+		if (this->refcount_dirty[i]) {
+			this->refcount_dirty[i] = 0;
+			listfs_write_block(this, this->refcount_chunks[i], this->refcounts[i]);
 		}
 	}
-	free(header);
-}
-
-ListFS_BlockIndex listfs_create_node(ListFS *this, uint8_t *name, uint32_t flags, ListFS_BlockIndex parent) {
-	if (!this) return;
-	listfs_log(this, "[%s] name = '%s', flags = %llu, parent = %llu\n", __func__, name, flags, parent);
-	ListFS_BlockIndex header_block = listfs_alloc_block(this);
-	if (header_block == -1) return -1;
-	ListFS_NodeHeader *header = calloc(this->header->block_size, 1);
-	header->magic = LISTFS_NODE_MAGIC;
-	strncpy(header->name, name, sizeof(header->name));
-	header->flags = flags;
-	header->data = -1;
-#ifndef DISABLE_TIME
-	header->create_time = time(NULL);
-	header->modify_time = header->create_time;
-	header->access_time = header->create_time;
-#endif
-	listfs_write_block(this, header_block, header);
-	listfs_insert_node(this, header_block, parent);
-	return header_block;
+	this->refcount_dirty_count = 0;
 }
 
-bool listfs_delete_node(ListFS *this, ListFS_BlockIndex node) {
-	if (!this) return false;
-	if (node == -1) return false;
-	listfs_log(this, "[%s] node = %llu\n", __func__, node);
-	ListFS_NodeHeader *header = listfs_fetch_node(this, node);
-	if (header->data != -1) {
-		listfs_log(this, "[%s] Node has data!\n", __func__);
-		free(header);
-		return false;
+/* Reads the chunk directory, chunks themselves are read on first use unless all of them are asked for */
+bool listfs_load_refcounts(ListFS *this, bool all) {
+	if (!this->ext_header || !(this->ext_header->flags & LISTFS_EXT_FLAG_REFCOUNTS)) return true;
+	size_t i, count = listfs_refcount_chunk_count(this);
+	if (!this->refcount_chunks) {
+		this->refcount_chunks = malloc(this->ext_header->refcount_size * this->block_size);
+		this->refcounts = calloc(count, sizeof(uint16_t*));
+		this->refcount_dirty = calloc(count, 1);
+		if (!this->refcount_chunks || !this->refcounts || !this->refcount_dirty) return false;
+		listfs_read_blocks(this, this->ext_header->refcount_base, this->refcount_chunks, this->ext_header->refcount_size);
+	}
+	for (i = 0; all && (i < count); i++) {
+		listfs_load_refcount_chunk(this, i);
 	}
-	listfs_remove_node(this, node);
-	listfs_free_blocks(this, node, 1);
-	free(header);
 	return true;
 }
 
-void listfs_move_node(ListFS *this, ListFS_BlockIndex node, ListFS_BlockIndex new_parent) {
-	if (!this) return;
-	if (node == -1) return;
-	listfs_log(this, "[%s] node = %llu, new_parent = %llu\n", __func__, node, new_parent);
-	listfs_remove_node(this, node);
-	listfs_insert_node(this, node, new_parent);
+void listfs_issue_discard(ListFS *this, ListFS_BlockIndex index, ListFS_BlockCount count) {
+	if (!this->discard_func) return;
+	listfs_log(this, "[%s] index = %llu, count = %llu\n", __func__, index, count);
+	this->discard_func(this, index, count);
 }
 
-void listfs_foreach_node(ListFS *this, ListFS_BlockIndex node, bool (*callback)(ListFS*, ListFS_BlockIndex, ListFS_NodeHeader*, void*), void *data) {
+void listfs_discard_blocks(ListFS *this, ListFS_BlockIndex index, ListFS_BlockCount count) {
 	if (!this) return;
-	listfs_log(this, "[%s] first node = %llu\n", __func__, node);
-	ListFS_NodeHeader *header = calloc(this->header->block_size, 1);
-	while (node != -1) {
-		listfs_read_block(this, node, header);
-		if (callback) {
-			if (!callback(this, node, header, data)) break;
+	if (listfs_journal_active(this) && !this->committing) return; /* listfs_commit discards deferred frees */
+	listfs_issue_discard(this, index, count);
+}
+
+ListFS_BlockIndex listfs_find_free_block(ListFS *this, ListFS_BlockIndex start, ListFS_BlockIndex end) {
+	ListFS_BlockIndex block = start;
+	while (block < end) {
+		if ((block % 8 == 0) && (this->map[block / 8] == 0xFF)) {
+			block += 8;
+		} else if ((this->map[block / 8] & (1 << (block % 8))) == 0) {
+			return block;
+		} else {
+			block++;
 		}
-		node = header->next;
-		listfs_log(this, "[%s] next node = %llu\n", __func__, node);
 	}
-	free(header);
+	return -1;
 }
 
-void listfs_foreach_subnode(ListFS *this, ListFS_BlockIndex node, bool (*callback)(ListFS*, ListFS_BlockIndex, ListFS_NodeHeader*, void*), void *data) {
-	if (!this) return;
-	listfs_log(this, "[%s] parent node = %llu\n", __func__, node);
-	if (node != -1) {
-		ListFS_NodeHeader *header = listfs_fetch_node(this, node);
-		listfs_read_block(this, node, header);
-		listfs_foreach_node(this, header->data, callback, data);
-		free(header);
+ListFS_BlockIndex listfs_alloc_block_near(ListFS *this, ListFS_BlockIndex hint) {
+	if (!this) return -1;
+	listfs_log(this, "[%s] hint = %llu\n", __func__, hint);
+	if (!listfs_check_writable(this, __func__) || !listfs_load_map(this)) return -1;
+	if (hint >= this->header->size) {
+		hint = 0;
+	}
+	size_t first_group = hint / this->group_size;
+	size_t i;
+	for (i = 0; i <= this->group_count; i++) {
+		size_t g = (first_group + i) % this->group_count;
+		ListFS_AllocGroup *group = &this->groups[g];
+		if (group->free_blocks == 0) continue;
+		ListFS_BlockIndex start = group->cursor;
+		if ((i == 0) && (hint > start)) {
+			start = hint;
+		}
+		ListFS_BlockIndex block = listfs_find_free_block(this, start, min((g + 1) * this->group_size, this->header->size));
+		if (block != -1) {
+			listfs_get_blocks(this, block, 1);
+			this->last_allocated_block = block;
+			listfs_log(this, "[%s] Found free block %llu\n", __func__, block);
+			return block;
+		}
 	}
+	listfs_log(this, "[%s] Free block not found\n", __func__);
+	return -1;
 }
 
-typedef struct {
-	ListFS_BlockIndex node;
-	uint64_t flags;
-	ListFS_BlockIndex data;
-	uint8_t *name;
-} ListFS_SearchState;
+ListFS_BlockIndex listfs_alloc_block(ListFS *this) {
+	if (!this) return -1;
+	return listfs_alloc_block_near(this, this->last_allocated_block);
+}
 
-bool listfs_search_node_callback(ListFS *fs, ListFS_BlockIndex node, ListFS_NodeHeader *header, void *data) {
-	ListFS_SearchState *state = data;
-	if (strncmp(header->name, state->name, sizeof(header->name)) == 0) {
-		state->node = node;
-		state->flags = header->flags;
-		state->data = header->data;
-		return false;
-	} else {
-		return true;
-	}
+/* Free list functions */
+
+int listfs_free_list_compare(const void *a, const void *b) {
+	ListFS_BlockIndex x = *(const ListFS_BlockIndex*)a, y = *(const ListFS_BlockIndex*)b;
+	return (x < y) ? -1 : ((x > y) ? 1 : 0);
 }
 
-uint64_t listfs_search_node(ListFS *this, uint8_t *path, ListFS_BlockIndex first) {
-	listfs_log(this, "[%s] path = '%s', first = %llu\n", __func__, path, first);
+void listfs_free_list_commit(ListFS *this, ListFS_FreeList *list) {
 	if (!this) return;
-	uint8_t node_name[256 + 1];
-	char *subpath = strchr(path, '/');
-	size_t node_name_len = subpath ? ((size_t)subpath - (size_t)path) : strlen(path);
-	if (subpath) subpath++;
-	strncpy(node_name, path, min(node_name_len, 256));
-	node_name[node_name_len] = 0;
+	listfs_log(this, "[%s] count = %u\n", __func__, list->count);
+	size_t i = 0, j;
+	if (this->refcount_chunks) {
+		/* Shared blocks only lose a reference and must not be discarded */
+		for (j = 0; i < list->count; i++) {
+			ListFS_BlockIndex block = list->blocks[i];
+			uint16_t count = listfs_get_refcount(this, block);
+			if (count) {
+				listfs_set_refcount(this, block, count - 1);
+			} else {
+				list->blocks[j++] = block;
+			}
+		}
+		list->count = j;
+		i = 0;
+		listfs_flush_refcounts(this);
+	}
+	qsort(list->blocks, list->count, sizeof(ListFS_BlockIndex), listfs_free_list_compare);
+	if (listfs_journal_active(this) && !this->committing && listfs_load_map(this)) {
+		/* Bitmap blocks the frees dirty are reserved up front, so the whole list fits one transaction if it can */
+		ListFS_BlockCount map_blocks = 0;
+		size_t last = -1, k;
+		for (k = 0; k < list->count; k++) {
+			size_t map_block = list->blocks[k] / 8 / this->block_size;
+			if ((map_block != last) && !(this->map_dirty[map_block / 8] & (1 << (map_block % 8)))) {
+				map_blocks++;
+			}
+			last = map_block;
+		}
+		listfs_journal_reserve(this, map_blocks);
+	}
+	while (i < list->count) {
+		j = i + 1;
+		while ((j < list->count) && (list->blocks[j] == list->blocks[j - 1] + 1)) {
+			j++;
+		}
+		listfs_free_blocks(this, list->blocks[i], j - i);
+		listfs_discard_blocks(this, list->blocks[i], j - i);
+		i = j;
+	}
+	free(list->blocks);
+	list->blocks = NULL;
+	list->count = 0;
+	list->capacity = 0;
+}
+
+bool listfs_free_list_callback(ListFS *fs, ListFS_BlockIndex block, bool block_list, void *data) {
+	listfs_free_list_add(data, block);
+	return true;
+}
+
+/* Directory index functions */
+
+/*
+	Indexed directories keep an extendible hash of child names next to the next/prev chain. The index block
+	holds a table of 2^depth bucket pointers selected by the low bits of the name hash, inline while it fits
+	and in a contiguous run of blocks after that. A full bucket is split on the next hash bit, doubling the
+	table when the bucket already uses all of them. The chain stays authoritative, so an index which can't
+	grow is dropped and the directory falls back to a plain list.
+*/
+
+uint64_t listfs_name_hash(uint8_t *name) {
+	return listfs_checksum(LISTFS_CHECKSUM_INIT, name, strnlen(name, sizeof(((ListFS_NodeHeader*)0)->name)));
+}
+
+size_t listfs_index_inline_slots(ListFS *this) {
+	return (this->block_size - sizeof(ListFS_IndexHeader)) / sizeof(ListFS_BlockIndex);
+}
+
+size_t listfs_bucket_capacity(ListFS *this) {
+	return (this->block_size - sizeof(ListFS_IndexBucket)) / sizeof(ListFS_IndexEntry);
+}
+
+/* Table blocks are read into buffer */
+ListFS_BlockIndex listfs_index_bucket(ListFS *this, ListFS_IndexHeader *index, uint64_t hash, void *buffer) {
+	uint64_t slot = hash & ((1ULL << index->depth) - 1);
+	if (index->table_base == -1) {
+		return index->buckets[slot];
+	}
+	size_t table_block_size = this->block_size / sizeof(ListFS_BlockIndex);
+	listfs_read_block(this, index->table_base + slot / table_block_size, buffer);
+	return ((ListFS_BlockIndex*)buffer)[slot % table_block_size];
+}
+
+/* Loaded table has room for doubling */
+ListFS_BlockIndex *listfs_index_load_table(ListFS *this, ListFS_IndexHeader *index) {
+	uint64_t slots = 1ULL << index->depth;
+	ListFS_BlockIndex *table = malloc(bytes_to_blocks(slots * 2 * sizeof(ListFS_BlockIndex), this->block_size) * this->block_size);
+	if (index->table_base == -1) {
+		memcpy(table, index->buckets, slots * sizeof(ListFS_BlockIndex));
+	} else {
+		listfs_read_blocks(this, index->table_base, table, index->table_size);
+	}
+	return table;
+}
+
+bool listfs_index_store_table(ListFS *this, ListFS_BlockIndex index_block, ListFS_IndexHeader *index, ListFS_BlockIndex *table) {
+	uint64_t slots = 1ULL << index->depth;
+	if (slots <= listfs_index_inline_slots(this)) {
+		memcpy(index->buckets, table, slots * sizeof(ListFS_BlockIndex));
+		return true;
+	}
+	ListFS_BlockCount size = bytes_to_blocks(slots * sizeof(ListFS_BlockIndex), this->block_size);
+	if (size != index->table_size) {
+		ListFS_BlockIndex base = listfs_alloc_run(this, size, index_block + 1);
+		if (base == -1) return false;
+		if (index->table_base != -1) {
+			ListFS_FreeList free_list = {NULL, 0, 0};
+			ListFS_BlockCount i;
+			for (i = 0; i < index->table_size; i++) {
+				listfs_free_list_add(&free_list, index->table_base + i);
+			}
+			listfs_free_list_commit(this, &free_list);
+		}
+		index->table_base = base;
+		index->table_size = size;
+	}
+	listfs_write_blocks(this, index->table_base, table, size);
+	return true;
+}
+
+/* Points every step-th slot of the table from first at bucket, rewriting only the table blocks holding them */
+void listfs_index_set_slots(ListFS *this, ListFS_IndexHeader *index, uint64_t first, uint64_t step, ListFS_BlockIndex bucket) {
+	uint64_t slots = 1ULL << index->depth, slot = first;
+	if (index->table_base == -1) {
+		for (; slot < slots; slot += step) {
+			index->buckets[slot] = bucket;
+		}
+		return;
+	}
+	size_t table_block_size = this->block_size / sizeof(ListFS_BlockIndex);
+	ListFS_BlockIndex *table = listfs_get_buffer(this);
+	while (slot < slots) {
+		uint64_t table_block = slot / table_block_size;
+		listfs_read_block(this, index->table_base + table_block, table);
+		for (; (slot < slots) && (slot / table_block_size == table_block); slot += step) {
+			table[slot % table_block_size] = bucket;
+		}
+		listfs_write_block(this, index->table_base + table_block, table);
+	}
+	listfs_put_buffer(this, table);
+}
+
+ListFS_BlockIndex listfs_index_create(ListFS *this, ListFS_BlockIndex hint) {
+	ListFS_BlockIndex index_block = listfs_alloc_block_near(this, hint);
+	if (index_block == -1) return -1;
+	ListFS_BlockIndex bucket_block = listfs_alloc_block_near(this, index_block + 1);
+	if (bucket_block == -1) {
+		listfs_free_blocks(this, index_block, 1);
+		return -1;
+	}
+	listfs_log(this, "[%s] index = %llu, bucket = %llu\n", __func__, index_block, bucket_block);
+	ListFS_IndexBucket *bucket = listfs_get_buffer(this);
+	memset(bucket, 0, this->block_size);
+	bucket->magic = LISTFS_BUCKET_MAGIC;
+	listfs_write_block(this, bucket_block, bucket);
+	listfs_put_buffer(this, bucket);
+	ListFS_IndexHeader *index = listfs_get_buffer(this);
+	memset(index, 0, this->block_size);
+	index->magic = LISTFS_INDEX_MAGIC;
+	index->table_base = -1;
+	index->buckets[0] = bucket_block;
+	listfs_write_block(this, index_block, index);
+	listfs_put_buffer(this, index);
+	return index_block;
+}
+
+void listfs_index_free(ListFS *this, ListFS_BlockIndex index_block, ListFS_FreeList *list) {
+	listfs_log(this, "[%s] index = %llu\n", __func__, index_block);
+	ListFS_IndexHeader *index = listfs_get_buffer(this);
+	listfs_read_block(this, index_block, index);
+	ListFS_BlockIndex *table = listfs_index_load_table(this, index);
+	uint64_t slots = 1ULL << index->depth, i;
+	qsort(table, slots, sizeof(ListFS_BlockIndex), listfs_free_list_compare);
+	for (i = 0; i < slots; i++) {
+		if ((i == 0) || (table[i] != table[i - 1])) {
+			listfs_free_list_add(list, table[i]);
+		}
+	}
+	for (i = 0; i < index->table_size; i++) {
+		listfs_free_list_add(list, index->table_base + i);
+	}
+	listfs_free_list_add(list, index_block);
+	free(table);
+	listfs_put_buffer(this, index);
+}
+
+bool listfs_index_insert(ListFS *this, ListFS_BlockIndex index_block, uint64_t hash, ListFS_BlockIndex node) {
+	listfs_log(this, "[%s] index = %llu, hash = %016llX, node = %llu\n", __func__, index_block, hash, node);
+	size_t capacity = listfs_bucket_capacity(this);
+	ListFS_IndexHeader *index = listfs_get_buffer(this);
+	ListFS_IndexBucket *bucket = listfs_get_buffer(this);
+	ListFS_IndexBucket *split = listfs_get_buffer(this);
+	bool result = false;
+	listfs_read_block(this, index_block, index);
+	while (true) {
+		ListFS_BlockIndex bucket_block = listfs_index_bucket(this, index, hash, bucket);
+		listfs_read_block(this, bucket_block, bucket);
+		if (bucket->count < capacity) {
+			bucket->entries[bucket->count].hash = hash;
+			bucket->entries[bucket->count].node = node;
+			bucket->count++;
+			listfs_write_block(this, bucket_block, bucket);
+			index->count++;
+			listfs_write_block(this, index_block, index);
+			result = true;
+			break;
+		}
+		if (bucket->depth >= LISTFS_INDEX_MAX_DEPTH) {
+			listfs_log(this, "[%s] Too many names with the same hash!\n", __func__);
+			break;
+		}
+		ListFS_BlockIndex split_block = listfs_alloc_block_near(this, bucket_block + 1);
+		if (split_block == -1) break;
+		uint64_t bit = 1ULL << bucket->depth;
+		if (bucket->depth == index->depth) {
+			/* Table doubles, its upper half starts as a copy of the lower one */
+			ListFS_BlockIndex *table = listfs_index_load_table(this, index);
+			uint64_t slots = 1ULL << index->depth;
+			memcpy(table + slots, table, slots * sizeof(ListFS_BlockIndex));
+			index->depth++;
+			bool stored = listfs_index_store_table(this, index_block, index, table);
+			free(table);
+			if (!stored) {
+				listfs_free_blocks(this, split_block, 1);
+				break;
+			}
+		}
+		listfs_index_set_slots(this, index, (hash & (bit - 1)) | bit, bit * 2, split_block);
+		memset(split, 0, this->block_size);
+		split->magic = LISTFS_BUCKET_MAGIC;
+		split->depth = bucket->depth + 1;
+		bucket->depth++;
+		size_t j, k = 0;
+		for (j = 0; j < bucket->count; j++) {
+			if (bucket->entries[j].hash & bit) {
+				split->entries[split->count++] = bucket->entries[j];
+			} else {
+				bucket->entries[k++] = bucket->entries[j];
+			}
+		}
+		bucket->count = k;
+		listfs_write_block(this, bucket_block, bucket);
+		listfs_write_block(this, split_block, split);
+		listfs_write_block(this, index_block, index);
+	}
+	listfs_put_buffer(this, split);
+	listfs_put_buffer(this, bucket);
+	listfs_put_buffer(this, index);
+	return result;
+}
+
+/* Replaces node of the entry with new_node or removes the entry if new_node is -1 */
+bool listfs_index_update(ListFS *this, ListFS_BlockIndex index_block, uint64_t hash, ListFS_BlockIndex node, ListFS_BlockIndex new_node) {
+	listfs_log(this, "[%s] index = %llu, hash = %016llX, node = %llu, new_node = %lli\n", __func__, index_block, hash, node, new_node);
+	ListFS_IndexHeader *index = listfs_get_buffer(this);
+	ListFS_IndexBucket *bucket = listfs_get_buffer(this);
+	listfs_read_block(this, index_block, index);
+	ListFS_BlockIndex bucket_block = listfs_index_bucket(this, index, hash, bucket);
+	listfs_read_block(this, bucket_block, bucket);
+	bool result = false;
+	size_t i;
+	for (i = 0; i < bucket->count; i++) {
+		if ((bucket->entries[i].hash != hash) || (bucket->entries[i].node != node)) continue;
+		if (new_node != -1) {
+			bucket->entries[i].node = new_node;
+		} else {
+			bucket->count--;
+			bucket->entries[i] = bucket->entries[bucket->count];
+			index->count--;
+			listfs_write_block(this, index_block, index);
+		}
+		listfs_write_block(this, bucket_block, bucket);
+		result = true;
+		break;
+	}
+	listfs_put_buffer(this, bucket);
+	listfs_put_buffer(this, index);
+	return result;
+}
+
+ListFS_BlockIndex listfs_index_find(ListFS *this, ListFS_BlockIndex index_block, uint8_t *name, ListFS_NodeHeader *header) {
+	uint64_t hash = listfs_name_hash(name);
+	ListFS_IndexHeader *index = listfs_get_buffer(this);
+	ListFS_IndexBucket *bucket = listfs_get_buffer(this);
+	listfs_read_block(this, index_block, index);
+	listfs_read_block(this, listfs_index_bucket(this, index, hash, bucket), bucket);
+	ListFS_BlockIndex node = -1;
+	size_t i;
+	for (i = 0; i < bucket->count; i++) {
+		if (bucket->entries[i].hash != hash) continue;
+		listfs_read_block(this, bucket->entries[i].node, header);
+		if (strncmp(header->name, name, sizeof(header->name)) == 0) {
+			node = bucket->entries[i].node;
+			break;
+		}
+	}
+	listfs_put_buffer(this, bucket);
+	listfs_put_buffer(this, index);
+	return node;
+}
+
+/* Looks the entry up without changing anything */
+bool listfs_index_contains(ListFS *this, ListFS_BlockIndex index_block, uint64_t hash, ListFS_BlockIndex node) {
+	ListFS_IndexHeader *index = listfs_get_buffer(this);
+	ListFS_IndexBucket *bucket = listfs_get_buffer(this);
+	listfs_read_block(this, index_block, index);
+	listfs_read_block(this, listfs_index_bucket(this, index, hash, bucket), bucket);
+	bool result = false;
+	size_t i;
+	for (i = 0; (i < bucket->count) && !result; i++) {
+		result = (bucket->entries[i].hash == hash) && (bucket->entries[i].node == node);
+	}
+	listfs_put_buffer(this, bucket);
+	listfs_put_buffer(this, index);
+	return result;
+}
+
+/* Index structure (header, table and buckets) is sound, so its blocks can be looked up and freed */
+bool listfs_index_intact(ListFS *this, ListFS_BlockIndex index_block) {
+	if (index_block >= this->header->size) return false;
+	ListFS_IndexHeader *index = listfs_get_buffer(this);
+	listfs_read_block(this, index_block, index);
+	uint64_t slots = 1ULL << index->depth, i;
+	bool result = (index->magic == LISTFS_INDEX_MAGIC) && (index->depth <= LISTFS_INDEX_MAX_DEPTH);
+	if (result && (index->table_base == -1)) {
+		result = (slots <= listfs_index_inline_slots(this));
+	} else if (result) {
+		result = (index->table_base < this->header->size) && (index->table_size <= this->header->size - index->table_base) &&
+			(index->table_size * this->block_size >= slots * sizeof(ListFS_BlockIndex));
+	}
+	if (!result) {
+		listfs_put_buffer(this, index);
+		return false;
+	}
+	ListFS_BlockIndex *table = listfs_index_load_table(this, index);
+	qsort(table, slots, sizeof(ListFS_BlockIndex), listfs_free_list_compare);
+	size_t capacity = listfs_bucket_capacity(this);
+	ListFS_IndexBucket *bucket = listfs_get_buffer(this);
+	for (i = 0; (i < slots) && result; i++) {
+		if ((i > 0) && (table[i] == table[i - 1])) continue;
+		result = (table[i] < this->header->size);
+		if (!result) break;
+		listfs_read_block(this, table[i], bucket);
+		result = (bucket->magic == LISTFS_BUCKET_MAGIC) && (bucket->depth <= index->depth) && (bucket->count <= capacity);
+	}
+	listfs_put_buffer(this, bucket);
+	free(table);
+	listfs_put_buffer(this, index);
+	return result;
+}
+
+/* Root directory has no node, its index is kept in the extended header */
+ListFS_BlockIndex listfs_dir_index(ListFS *this, ListFS_BlockIndex dir) {
+	if (dir == -1) {
+		return (this->ext_header && (this->ext_header->flags & LISTFS_EXT_FLAG_ROOT_INDEX)) ? this->ext_header->root_index : -1;
+	}
+	ListFS_NodeHeader *header = listfs_borrow_node(this, dir);
+	ListFS_BlockIndex index = (header->flags & LISTFS_NODE_FLAG_INDEXED) ? header->index : -1;
+	listfs_put_buffer(this, header);
+	return index;
+}
+
+void listfs_set_dir_index(ListFS *this, ListFS_BlockIndex dir, ListFS_BlockIndex index) {
+	if (dir == -1) {
+		this->ext_header->root_index = index;
+		if (index != -1) {
+			this->ext_header->flags |= LISTFS_EXT_FLAG_ROOT_INDEX;
+		} else {
+			this->ext_header->flags &= ~LISTFS_EXT_FLAG_ROOT_INDEX;
+		}
+		listfs_write_block(this, listfs_ext_header_block(this), this->ext_header);
+		return;
+	}
+	ListFS_NodeHeader *header = listfs_borrow_node(this, dir);
+	header->index = index;
+	if (index != -1) {
+		header->flags |= LISTFS_NODE_FLAG_INDEXED;
+	} else {
+		header->flags &= ~LISTFS_NODE_FLAG_INDEXED;
+	}
+	listfs_write_block(this, dir, header);
+	listfs_put_buffer(this, header);
+}
+
+/* Blocks of an index that isn't intact can't be told apart from garbage, so they are left for the checker */
+void listfs_remove_index(ListFS *this, ListFS_BlockIndex dir, ListFS_BlockIndex index) {
+	ListFS_FreeList free_list = {NULL, 0, 0};
+	if (listfs_index_intact(this, index)) {
+		listfs_index_free(this, index, &free_list);
+	} else {
+		listfs_log(this, "[%s] Index %llu of directory %lli is corrupted, leaving its blocks\n", __func__, index, dir);
+	}
+	listfs_set_dir_index(this, dir, -1);
+	listfs_free_list_commit(this, &free_list);
+}
+
+void listfs_drop_index(ListFS *this, ListFS_BlockIndex dir) {
+	ListFS_BlockIndex index = listfs_dir_index(this, dir);
+	if (index == -1) return;
+	listfs_log(this, "[%s] Index of directory %lli can't grow, using plain list\n", __func__, dir);
+	listfs_remove_index(this, dir, index);
+}
+
+typedef struct {
+	ListFS_BlockIndex index;
+	uint64_t count;
+	bool result;
+} ListFS_IndexState;
+
+bool listfs_index_directory_callback(ListFS *fs, ListFS_BlockIndex node, ListFS_NodeHeader *header, void *data) {
+	ListFS_IndexState *state = data;
+	state->result = listfs_index_insert(fs, state->index, listfs_name_hash(header->name), node);
+	return state->result;
+}
+
+bool listfs_index_directory(ListFS *this, ListFS_BlockIndex dir) {
+	if (!this) return false;
+	listfs_log(this, "[%s] dir = %lli\n", __func__, dir);
+	listfs_journal_reserve(this, LISTFS_JOURNAL_OP_BLOCKS);
+	if (!listfs_check_writable(this, __func__)) return false;
+	if (listfs_dir_index(this, dir) != -1) return true;
+	ListFS_BlockIndex first = this->header->root_dir;
+	if (dir == -1) {
+		if (!this->ext_header) {
+			listfs_log(this, "[%s] Volume has no extended header!\n", __func__);
+			return false;
+		}
+	} else {
+		ListFS_NodeHeader *header = listfs_borrow_node(this, dir);
+		bool directory = header->flags & LISTFS_NODE_FLAG_DIRECTORY;
+		first = header->data;
+		listfs_put_buffer(this, header);
+		if (!directory) return false;
+	}
+	ListFS_IndexState state;
+	state.index = listfs_index_create(this, (dir != -1) ? dir : first);
+	state.result = (state.index != -1);
+	if (!state.result) return false;
+	listfs_foreach_node(this, first, listfs_index_directory_callback, &state);
+	if (state.result) {
+		listfs_set_dir_index(this, dir, state.index);
+	} else {
+		ListFS_FreeList free_list = {NULL, 0, 0};
+		listfs_index_free(this, state.index, &free_list);
+		listfs_free_list_commit(this, &free_list);
+	}
+	return state.result;
+}
+
+/* Replaces the index of a directory with a new one built from its chain */
+bool listfs_rebuild_index(ListFS *this, ListFS_BlockIndex dir) {
+	if (!this) return false;
+	listfs_log(this, "[%s] dir = %lli\n", __func__, dir);
+	if (!listfs_check_writable(this, __func__)) return false;
+	ListFS_BlockIndex index = listfs_dir_index(this, dir);
+	if (index != -1) {
+		listfs_remove_index(this, dir, index);
+	}
+	return listfs_index_directory(this, dir);
+}
+
+bool listfs_index_verify_callback(ListFS *fs, ListFS_BlockIndex node, ListFS_NodeHeader *header, void *data) {
+	ListFS_IndexState *state = data;
+	state->count++;
+	state->result = listfs_index_contains(fs, state->index, listfs_name_hash(header->name), node);
+	return state->result;
+}
+
+/* Index matches the chain if it holds every child and nothing else */
+bool listfs_index_verify(ListFS *this, ListFS_BlockIndex dir) {
+	ListFS_IndexState state;
+	state.index = listfs_dir_index(this, dir);
+	state.count = 0;
+	state.result = listfs_index_intact(this, state.index);
+	if (!state.result) return false;
+	ListFS_BlockIndex first = this->header->root_dir;
+	if (dir != -1) {
+		ListFS_NodeHeader *header = listfs_borrow_node(this, dir);
+		first = header->data;
+		listfs_put_buffer(this, header);
+	}
+	listfs_foreach_node(this, first, listfs_index_verify_callback, &state);
+	ListFS_IndexHeader *index = listfs_get_buffer(this);
+	listfs_read_block(this, state.index, index);
+	state.result = state.result && (index->count == state.count);
+	listfs_put_buffer(this, index);
+	return state.result;
+}
+
+bool listfs_indexed_dir_callback(ListFS *fs, ListFS_BlockIndex node, ListFS_NodeHeader *header, void *data) {
+	if ((header->flags & LISTFS_NODE_FLAG_DIRECTORY) && (header->flags & LISTFS_NODE_FLAG_INDEXED)) {
+		listfs_free_list_add(data, node);
+	}
+	return true;
+}
+
+/*
+	Name and chain updates of an operation may be split by a crash (a volume without journal writes them
+	in turn, a journaled one may commit in the middle of a large operation). Volumes which weren't closed
+	cleanly get their indexes checked against the chains on the next writable open.
+*/
+void listfs_verify_indexes(ListFS *this) {
+	listfs_log(this, "[%s]\n", __func__);
+	ListFS_FreeList dirs = {NULL, 0, 0};
+	if (listfs_dir_index(this, -1) != -1) {
+		listfs_free_list_add(&dirs, -1);
+	}
+	listfs_scan(this, this->header->root_dir, listfs_indexed_dir_callback, NULL, &dirs);
+	size_t i, rebuilt = 0;
+	for (i = 0; i < dirs.count; i++) {
+		if (!listfs_index_verify(this, dirs.blocks[i])) {
+			listfs_rebuild_index(this, dirs.blocks[i]);
+			rebuilt++;
+		}
+	}
+	listfs_log(this, "[%s] %u of %u indexes rebuilt\n", __func__, rebuilt, dirs.count);
+	free(dirs.blocks);
+}
+
+/* Aggregate functions */
+
+/*
+	Directories of volumes with aggregates keep the total size, block count and entry count of their subtree,
+	root totals live in the extended header. A file counts as its node block plus the blocks its size needs,
+	a directory as its node block plus its aggregates. Changes are summed per directory in memory and
+	listfs_flush_aggregates applies them to all ancestors when a transaction is committed, so appends
+	don't rewrite the whole path and the extended header every time. Every directory and the extended
+	header are written once per flush.
+*/
+
+struct _ListFS_AggregateDelta {
+	ListFS_BlockIndex dir;
+	ListFS_Aggregates delta;
+};
+
+bool listfs_aggregates_active(ListFS *this) {
+	return this->ext_header && (this->ext_header->flags & LISTFS_EXT_FLAG_AGGREGATES);
+}
+
+void listfs_node_aggregates(ListFS *this, ListFS_NodeHeader *header, ListFS_Aggregates *result) {
+	if (header->flags & LISTFS_NODE_FLAG_DIRECTORY) {
+		*result = header->aggregates;
+	} else {
+		result->size = header->size;
+		result->blocks = bytes_to_blocks(header->size, this->block_size);
+		result->entries = 0;
+	}
+	result->blocks++;
+	result->entries++;
+}
+
+void listfs_apply_aggregates(ListFS_Aggregates *aggregates, ListFS_Aggregates *before, ListFS_Aggregates *after) {
+	/* Unsigned wrap-around makes shrinking work as well */
+	if (before) {
+		aggregates->size -= before->size;
+		aggregates->blocks -= before->blocks;
+		aggregates->entries -= before->entries;
+	}
+	if (after) {
+		aggregates->size += after->size;
+		aggregates->blocks += after->blocks;
+		aggregates->entries += after->entries;
+	}
+}
+
+/* Open addressing table keyed by directory, block 0 (the volume header) marks a free slot */
+ListFS_AggregateDelta *listfs_aggregate_slot(ListFS_AggregateDelta *table, size_t capacity, ListFS_BlockIndex dir) {
+	size_t slot = (dir * 0x9E3779B97F4A7C15ULL) & (capacity - 1);
+	while (table[slot].dir && (table[slot].dir != dir)) {
+		slot = (slot + 1) & (capacity - 1);
+	}
+	return &table[slot];
+}
+
+ListFS_AggregateDelta *listfs_aggregate_delta(ListFS_AggregateDelta **table, size_t *count, size_t *capacity,
+		ListFS_BlockIndex dir) {
+	if ((*count + 1) * 2 > *capacity) {
+		size_t old_capacity = *capacity, i;
+		ListFS_AggregateDelta *old_table = *table;
+		*capacity = old_capacity ? old_capacity * 2 : 64;
+		*table = calloc(*capacity, sizeof(ListFS_AggregateDelta));
+		for (i = 0; i < old_capacity; i++) {
+			if (old_table[i].dir) {
+				*listfs_aggregate_slot(*table, *capacity, old_table[i].dir) = old_table[i];
+			}
+		}
+		free(old_table);
+	}
+	ListFS_AggregateDelta *entry = listfs_aggregate_slot(*table, *capacity, dir);
+	if (!entry->dir) {
+		entry->dir = dir;
+		(*count)++;
+	}
+	return entry;
+}
+
+void listfs_update_aggregates(ListFS *this, ListFS_BlockIndex dir, ListFS_Aggregates *before, ListFS_Aggregates *after) {
+	if (!listfs_aggregates_active(this)) return;
+	if (before && after && !memcmp(before, after, sizeof(ListFS_Aggregates))) return;
+	listfs_log(this, "[%s] dir = %lli\n", __func__, dir);
+	ListFS_AggregateDelta *entry = listfs_aggregate_delta(&this->aggregate_deltas, &this->aggregate_delta_count,
+		&this->aggregate_delta_capacity, dir);
+	listfs_apply_aggregates(&entry->delta, before, after);
+}
+
+void listfs_drop_aggregates(ListFS *this) {
+	free(this->aggregate_deltas);
+	this->aggregate_deltas = NULL;
+	this->aggregate_delta_count = 0;
+	this->aggregate_delta_capacity = 0;
+}
+
+void listfs_flush_aggregates(ListFS *this) {
+	if (!this || !this->aggregate_delta_count || this->read_only) return;
+	listfs_log(this, "[%s] dirs = %u\n", __func__, this->aggregate_delta_count);
+	/* Table is taken over first, a commit in the middle of the writes below flushes nothing */
+	ListFS_AggregateDelta *pending = this->aggregate_deltas;
+	size_t capacity = this->aggregate_delta_capacity, i;
+	this->aggregate_deltas = NULL;
+	this->aggregate_delta_count = 0;
+	this->aggregate_delta_capacity = 0;
+	ListFS_AggregateDelta *totals = NULL;
+	size_t total_count = 0, total_capacity = 0;
+	ListFS_Aggregates root;
+	memset(&root, 0, sizeof(ListFS_Aggregates));
+	ListFS_NodeHeader *header = listfs_get_buffer(this);
+	/* Deltas are summed over all ancestors first, so a directory shared by several paths is written once */
+	for (i = 0; i < capacity; i++) {
+		ListFS_BlockIndex dir = pending[i].dir;
+		if (!dir) continue;
+		while (dir != -1) {
+			listfs_read_block(this, dir, header);
+			if (header->magic != LISTFS_NODE_MAGIC) {
+				listfs_log(this, "[%s] Node %llu is corrupted!\n", __func__, dir);
+				break;
+			}
+			ListFS_AggregateDelta *total = listfs_aggregate_delta(&totals, &total_count, &total_capacity, dir);
+			listfs_apply_aggregates(&total->delta, NULL, &pending[i].delta);
+			dir = header->parent;
+		}
+		if (dir == -1) {
+			listfs_apply_aggregates(&root, NULL, &pending[i].delta);
+		}
+	}
+	for (i = 0; i < total_capacity; i++) {
+		if (!totals[i].dir) continue;
+		listfs_read_block(this, totals[i].dir, header);
+		listfs_apply_aggregates(&header->aggregates, NULL, &totals[i].delta);
+		listfs_write_block(this, totals[i].dir, header);
+	}
+	listfs_put_buffer(this, header);
+	listfs_apply_aggregates(&this->ext_header->root_aggregates, NULL, &root);
+	listfs_write_block(this, listfs_ext_header_block(this), this->ext_header);
+	free(totals);
+	free(pending);
+}
+
+void listfs_sum_aggregates(ListFS *this, ListFS_BlockIndex node, ListFS_Aggregates *result) {
+	/* Sums the node list, recomputing aggregates of directories in it first */
+	ListFS_NodeHeader *header = listfs_get_buffer(this);
+	memset(result, 0, sizeof(ListFS_Aggregates));
+	while (node != -1) {
+		listfs_read_block(this, node, header);
+		if (header->magic != LISTFS_NODE_MAGIC) {
+			listfs_log(this, "[%s] Block %llu isn't node!\n", __func__, node);
+			break;
+		}
+		if (header->flags & LISTFS_NODE_FLAG_DIRECTORY) {
+			ListFS_Aggregates aggregates;
+			listfs_sum_aggregates(this, header->data, &aggregates);
+			if (memcmp(&aggregates, &header->aggregates, sizeof(ListFS_Aggregates))) {
+				header->aggregates = aggregates;
+				listfs_write_block(this, node, header);
+			}
+		}
+		ListFS_Aggregates aggregates;
+		listfs_node_aggregates(this, header, &aggregates);
+		listfs_apply_aggregates(result, NULL, &aggregates);
+		node = header->next;
+	}
+	listfs_put_buffer(this, header);
+}
+
+bool listfs_build_aggregates(ListFS *this) {
+	if (!this) return false;
+	listfs_log(this, "[%s]\n", __func__);
+	if (!this->ext_header || !listfs_check_writable(this, __func__)) return false;
+	/* Sums come from node headers, which already hold every pending change */
+	listfs_drop_aggregates(this);
+	listfs_sum_aggregates(this, this->header->root_dir, &this->ext_header->root_aggregates);
+	this->ext_header->flags |= LISTFS_EXT_FLAG_AGGREGATES;
+	listfs_write_block(this, listfs_ext_header_block(this), this->ext_header);
+	return true;
+}
+
+bool listfs_get_aggregates(ListFS *this, ListFS_BlockIndex dir, ListFS_Aggregates *result) {
+	if (!this) return false;
+	listfs_log(this, "[%s] dir = %lli\n", __func__, dir);
+	if (!listfs_aggregates_active(this)) return false;
+	listfs_flush_aggregates(this);
+	if (dir == -1) {
+		*result = this->ext_header->root_aggregates;
+		return true;
+	}
+	ListFS_NodeHeader *header = listfs_borrow_node(this, dir);
+	bool valid = (header->magic == LISTFS_NODE_MAGIC) && (header->flags & LISTFS_NODE_FLAG_DIRECTORY);
+	if (valid) {
+		*result = header->aggregates;
+	}
+	listfs_put_buffer(this, header);
+	return valid;
+}
+
+/* Node functions */
+
+void listfs_write_links(ListFS *this, ListFS_BlockIndex node, ListFS_NodeHeader *header) {
+	/* Open file writes its cached header back later, so it has to get new links as well */
+	listfs_write_block(this, node, header);
+	ListFS_OpennedFile *file = listfs_find_open_file(this, node);
+	if (file) {
+		file->node_header->parent = header->parent;
+		file->node_header->next = header->next;
+		file->node_header->prev = header->prev;
+	}
+}
+
+/* Returns header in a heap buffer, which the caller frees */
+ListFS_NodeHeader *listfs_fetch_node(ListFS *this, ListFS_BlockIndex node) {
+	if (!this) return NULL;
+	if (node == -1) return NULL;
+	listfs_log(this, "[%s] node = %llu\n", __func__, node);
+	ListFS_NodeHeader *header = malloc(this->block_size);
+	listfs_read_block(this, node, header);
+	return header;
+}
+
+/* Returns header in a pool buffer, which the caller gives back with listfs_put_buffer */
+ListFS_NodeHeader *listfs_borrow_node(ListFS *this, ListFS_BlockIndex node) {
+	if (!this) return NULL;
+	if (node == -1) return NULL;
+	listfs_log(this, "[%s] node = %llu\n", __func__, node);
+	ListFS_NodeHeader *header = listfs_get_buffer(this);
+	listfs_read_block(this, node, header);
+	return header;
+}
+
+void listfs_insert_node(ListFS *this, ListFS_BlockIndex node, ListFS_BlockIndex parent) {
+	if (!this) return;
+	if (node == -1) return;
+	listfs_log(this, "[%s] node = %llu, parent = %llu\n", __func__, node, parent);
+	ListFS_NodeHeader *header = listfs_borrow_node(this, node);
+	header->parent = parent;
+	header->prev = -1;
+	ListFS_NodeHeader *tmp_header = listfs_get_buffer(this);
+	memset(tmp_header, 0, this->block_size);
+	ListFS_BlockIndex index;
+	if (parent == -1) {
+		header->next = this->header->root_dir;
+		this->header->root_dir = node;
+		index = listfs_dir_index(this, -1);
+	} else {
+		listfs_read_block(this, parent, tmp_header);
+		header->next = tmp_header->data;
+		tmp_header->data = node;
+		listfs_write_block(this, parent, tmp_header);
+		index = (tmp_header->flags & LISTFS_NODE_FLAG_INDEXED) ? tmp_header->index : -1;
+	}
+	if (header->next != -1) {
+		listfs_read_block(this, header->next, tmp_header);
+		tmp_header->prev = node;
+		listfs_write_links(this, header->next, tmp_header);
+	}
+	listfs_write_links(this, node, header);
+	if ((index != -1) && !listfs_index_insert(this, index, listfs_name_hash(header->name), node)) {
+		listfs_drop_index(this, parent);
+	}
+	ListFS_Aggregates aggregates;
+	listfs_node_aggregates(this, header, &aggregates);
+	listfs_update_aggregates(this, parent, NULL, &aggregates);
+	listfs_put_buffer(this, tmp_header);
+	listfs_put_buffer(this, header);
+}
+
+void listfs_remove_node(ListFS *this, ListFS_BlockIndex node) {
+	if (!this) return;
+	if (node == -1) return;
+	listfs_log(this, "[%s] node = %llu\n", __func__, node);
+	ListFS_NodeHeader *header = listfs_borrow_node(this, node);
+	if ((header->flags & LISTFS_NODE_FLAG_DIRECTORY) && this->aggregate_delta_count) {
+		/* Pending changes inside the subtree must reach its aggregates before they leave the tree */
+		listfs_flush_aggregates(this);
+		listfs_read_block(this, node, header);
+	}
+	ListFS_BlockIndex next = header->next, prev = header->prev, parent = header->parent;
+	ListFS_BlockIndex index = listfs_dir_index(this, parent);
+	if (index != -1) {
+		listfs_index_update(this, index, listfs_name_hash(header->name), node, -1);
+	}
+	ListFS_Aggregates aggregates;
+	listfs_node_aggregates(this, header, &aggregates);
+	if (next != -1) {
+		listfs_read_block(this, next, header);
+		header->prev = prev;
+		listfs_write_links(this, next, header);
+	}
+	if (prev != -1) {
+		listfs_read_block(this, prev, header);
+		header->next = next;
+		listfs_write_links(this, prev, header);
+	} else {
+		if (parent != -1) {
+			listfs_read_block(this, parent, header);
+			header->data = next;
+			listfs_write_block(this, parent, header);
+		} else {
+			this->header->root_dir = next;
+		}
+	}
+	listfs_update_aggregates(this, parent, &aggregates, NULL);
+	listfs_put_buffer(this, header);
+}
+
+ListFS_BlockIndex listfs_create_node(ListFS *this, uint8_t *name, uint32_t flags, ListFS_BlockIndex parent) {
+	if (!this) return;
+	listfs_log(this, "[%s] name = '%s', flags = %llu, parent = %llu\n", __func__, name, flags, parent);
+	listfs_journal_reserve(this, LISTFS_JOURNAL_OP_BLOCKS);
+	ListFS_BlockIndex header_block = listfs_alloc_block_near(this, (parent != -1) ? parent : this->header->root_dir);
+	if (header_block == -1) return -1;
+	ListFS_NodeHeader *header = listfs_get_buffer(this);
+	memset(header, 0, this->block_size);
+	header->magic = LISTFS_NODE_MAGIC;
+	strncpy(header->name, name, sizeof(header->name));
+	header->flags = flags & ~LISTFS_NODE_FLAG_INDEXED;
+	header->data = -1;
+	if ((flags & LISTFS_NODE_FLAG_INDEXED) && (flags & LISTFS_NODE_FLAG_DIRECTORY)) {
+		header->index = listfs_index_create(this, header_block + 1);
+		if (header->index != -1) {
+			header->flags |= LISTFS_NODE_FLAG_INDEXED;
+		}
+	}
+#ifndef DISABLE_TIME
+	header->create_time = time(NULL);
+	header->modify_time = header->create_time;
+	header->access_time = header->create_time;
+#endif
+	listfs_write_block(this, header_block, header);
+	listfs_insert_node(this, header_block, parent);
+	listfs_put_buffer(this, header);
+	return header_block;
+}
+
+bool listfs_delete_node(ListFS *this, ListFS_BlockIndex node) {
+	if (!this) return false;
+	if (node == -1) return false;
+	listfs_log(this, "[%s] node = %llu\n", __func__, node);
+	listfs_journal_reserve(this, LISTFS_JOURNAL_OP_BLOCKS);
+	ListFS_NodeHeader *header = listfs_borrow_node(this, node);
+	if (header->data != -1) {
+		listfs_log(this, "[%s] Node has data!\n", __func__);
+		listfs_put_buffer(this, header);
+		return false;
+	}
+	listfs_remove_node(this, node);
+	if (header->flags & LISTFS_NODE_FLAG_INDEXED) {
+		ListFS_FreeList free_list = {NULL, 0, 0};
+		listfs_index_free(this, header->index, &free_list);
+		listfs_free_list_commit(this, &free_list);
+	}
+	listfs_free_blocks(this, node, 1);
+	listfs_discard_blocks(this, node, 1);
+	listfs_put_buffer(this, header);
+	return true;
+}
+
+/* Orphan functions */
+
+/*
+	Detached nodes wait for reclaim in a list kept by the extended header and linked through their next and
+	prev fields, so blocks of a node which was unlinked while open (or right before a crash) are never lost.
+	Volumes without the extended header can't keep orphans, their nodes must be reclaimed right away.
+*/
+
+ListFS_BlockIndex listfs_orphans(ListFS *this) {
+	return (this->ext_header && (this->ext_header->flags & LISTFS_EXT_FLAG_ORPHANS)) ? this->ext_header->orphans : -1;
+}
+
+void listfs_set_orphans(ListFS *this, ListFS_BlockIndex node) {
+	this->ext_header->orphans = node;
+	if (node != -1) {
+		this->ext_header->flags |= LISTFS_EXT_FLAG_ORPHANS;
+	} else {
+		this->ext_header->flags &= ~LISTFS_EXT_FLAG_ORPHANS;
+	}
+	listfs_write_block(this, listfs_ext_header_block(this), this->ext_header);
+}
+
+void listfs_remove_orphan(ListFS *this, ListFS_NodeHeader *header) {
+	if (!this->ext_header) return;
+	ListFS_NodeHeader *neighbour = listfs_get_buffer(this);
+	if (header->next != -1) {
+		listfs_read_block(this, header->next, neighbour);
+		neighbour->prev = header->prev;
+		listfs_write_links(this, header->next, neighbour);
+	}
+	if (header->prev != -1) {
+		listfs_read_block(this, header->prev, neighbour);
+		neighbour->next = header->next;
+		listfs_write_links(this, header->prev, neighbour);
+	} else {
+		listfs_set_orphans(this, header->next);
+	}
+	listfs_put_buffer(this, neighbour);
+}
+
+void listfs_detach_node(ListFS *this, ListFS_BlockIndex node) {
+	if (!this) return;
+	if (node == -1) return;
+	listfs_log(this, "[%s] node = %llu\n", __func__, node);
+	listfs_journal_reserve(this, LISTFS_JOURNAL_OP_BLOCKS);
+	listfs_remove_node(this, node);
+	ListFS_NodeHeader *header = listfs_borrow_node(this, node);
+	ListFS_BlockIndex orphans = listfs_orphans(this);
+	header->parent = -1;
+	header->next = orphans;
+	header->prev = -1;
+	listfs_write_links(this, node, header);
+	if (orphans != -1) {
+		listfs_read_block(this, orphans, header);
+		header->prev = node;
+		listfs_write_links(this, orphans, header);
+	}
+	if (this->ext_header) {
+		listfs_set_orphans(this, node);
+	}
+	listfs_put_buffer(this, header);
+}
+
+/*
+	Frees blocks of a detached node a few block lists at a time, until about limit blocks are collected,
+	so the caller can let other requests in between. The node itself is freed with the last chunk,
+	which is when true is returned. Nodes that are still open are left for later.
+*/
+bool listfs_reclaim_node(ListFS *this, ListFS_BlockIndex node, ListFS_BlockCount limit) {
+	if (!this) return false;
+	if (node == -1) return false;
+	listfs_log(this, "[%s] node = %llu, limit = %llu\n", __func__, node, limit);
+	if (listfs_find_open_file(this, node)) {
+		listfs_log(this, "[%s] Node is still open!\n", __func__);
+		return false;
+	}
+	listfs_journal_reserve(this, LISTFS_JOURNAL_OP_BLOCKS);
+	ListFS_NodeHeader *header = listfs_borrow_node(this, node);
+	if ((header->flags & LISTFS_NODE_FLAG_DIRECTORY) && (header->data != -1)) {
+		listfs_log(this, "[%s] Directory isn't empty!\n", __func__);
+		listfs_put_buffer(this, header);
+		return false;
+	}
+	ListFS_FreeList free_list = {NULL, 0, 0};
+	if (!(header->flags & LISTFS_NODE_FLAG_DIRECTORY) && (header->data != -1)) {
+		size_t block_list_size = this->block_size / sizeof(ListFS_BlockIndex);
+		ListFS_BlockIndex *list = listfs_get_buffer(this);
+		ListFS_BlockIndex next = header->data;
+		while ((next != -1) && (free_list.count < limit)) {
+			listfs_read_block(this, next, list);
+			listfs_free_list_add(&free_list, next);
+			size_t i;
+			for (i = 1; i < block_list_size - 1; i++) {
+				if (list[i] != -1) {
+					listfs_free_list_add(&free_list, list[i]);
+				}
+			}
+			next = list[block_list_size - 1];
+		}
+		if (next != -1) {
+			/* Rest of the file stays a valid chain of block lists for the next chunk */
+			listfs_read_block(this, next, list);
+			list[0] = -1;
+			listfs_write_block(this, next, list);
+			header->data = next;
+			header->size = 0;
+			listfs_write_block(this, node, header);
+			listfs_put_buffer(this, list);
+			listfs_put_buffer(this, header);
+			listfs_free_list_commit(this, &free_list);
+			return false;
+		}
+		listfs_put_buffer(this, list);
+	} else if (header->flags & LISTFS_NODE_FLAG_INDEXED) {
+		listfs_index_free(this, header->index, &free_list);
+	}
+	listfs_remove_orphan(this, header);
+	listfs_free_list_add(&free_list, node);
+	listfs_free_list_commit(this, &free_list);
+	listfs_put_buffer(this, header);
+	return true;
+}
+
+/* Reclaims a chunk of the first orphan which isn't open. Returns false when there is nothing to reclaim */
+bool listfs_reclaim_orphans(ListFS *this, ListFS_BlockCount limit) {
+	if (!this) return false;
+	ListFS_BlockIndex node = listfs_orphans(this);
+	if ((node == -1) || this->read_only) return false;
+	listfs_log(this, "[%s] limit = %llu\n", __func__, limit);
+	ListFS_NodeHeader *header = listfs_get_buffer(this);
+	while (node != -1) {
+		listfs_read_block(this, node, header);
+		if (header->magic != LISTFS_NODE_MAGIC) {
+			listfs_log(this, "[%s] Block %llu isn't node!\n", __func__, node);
+			node = -1;
+			break;
+		}
+		if (!listfs_find_open_file(this, node) &&
+				!((header->flags & LISTFS_NODE_FLAG_DIRECTORY) && (header->data != -1))) break;
+		node = header->next;
+	}
+	listfs_put_buffer(this, header);
+	if (node == -1) return false;
+	listfs_reclaim_node(this, node, limit);
+	return true;
+}
+
+void listfs_pending_push(ListFS_FreeList *heap, ListFS_BlockIndex block) {
+	listfs_free_list_add(heap, block);
+	size_t i = heap->count - 1;
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (heap->blocks[parent] <= heap->blocks[i]) break;
+		ListFS_BlockIndex tmp = heap->blocks[parent];
+		heap->blocks[parent] = heap->blocks[i];
+		heap->blocks[i] = tmp;
+		i = parent;
+	}
+}
+
+ListFS_BlockIndex listfs_pending_pop(ListFS_FreeList *heap) {
+	ListFS_BlockIndex result = heap->blocks[0];
+	heap->count--;
+	heap->blocks[0] = heap->blocks[heap->count];
+	size_t i = 0;
+	while (true) {
+		size_t smallest = i, child = i * 2 + 1;
+		if ((child < heap->count) && (heap->blocks[child] < heap->blocks[smallest])) smallest = child;
+		if ((child + 1 < heap->count) && (heap->blocks[child + 1] < heap->blocks[smallest])) smallest = child + 1;
+		if (smallest == i) break;
+		ListFS_BlockIndex tmp = heap->blocks[smallest];
+		heap->blocks[smallest] = heap->blocks[i];
+		heap->blocks[i] = tmp;
+		i = smallest;
+	}
+	return result;
+}
+
+bool listfs_delete_tree(ListFS *this, ListFS_BlockIndex node) {
+	if (!this) return false;
+	if (node == -1) return false;
+	listfs_log(this, "[%s] node = %llu\n", __func__, node);
+	listfs_journal_reserve(this, LISTFS_JOURNAL_OP_BLOCKS);
+	listfs_remove_node(this, node);
+	ListFS_FreeList free_list = {NULL, 0, 0};
+	ListFS_FreeList pending = {NULL, 0, 0};
+	ListFS_NodeHeader *header = listfs_borrow_node(this, node);
+	/* Siblings stay in the tree, the walk below must not follow them */
+	header->next = -1;
+	listfs_write_block(this, node, header);
+	listfs_pending_push(&pending, node);
+	while (pending.count) {
+		node = listfs_pending_pop(&pending);
+		while (node != -1) {
+			listfs_read_block(this, node, header);
+			if (header->magic != LISTFS_NODE_MAGIC) {
+				listfs_log(this, "[%s] Block %llu isn't node!\n", __func__, node);
+				break;
+			}
+			listfs_free_list_add(&free_list, node);
+			if (header->flags & LISTFS_NODE_FLAG_DIRECTORY) {
+				if (header->data != -1) {
+					listfs_pending_push(&pending, header->data);
+				}
+				if (header->flags & LISTFS_NODE_FLAG_INDEXED) {
+					listfs_index_free(this, header->index, &free_list);
+				}
+			} else {
+				listfs_foreach_block(this, header->data, listfs_free_list_callback, &free_list);
+			}
+			node = header->next;
+		}
+	}
+	listfs_put_buffer(this, header);
+	free(pending.blocks);
+	listfs_free_list_commit(this, &free_list);
+	return true;
+}
+
+void listfs_move_node(ListFS *this, ListFS_BlockIndex node, ListFS_BlockIndex new_parent) {
+	if (!this) return;
+	if (node == -1) return;
+	listfs_log(this, "[%s] node = %llu, new_parent = %llu\n", __func__, node, new_parent);
+	listfs_journal_reserve(this, LISTFS_JOURNAL_OP_BLOCKS);
+	listfs_remove_node(this, node);
+	listfs_insert_node(this, node, new_parent);
+}
+
+void listfs_foreach_node(ListFS *this, ListFS_BlockIndex node, bool (*callback)(ListFS*, ListFS_BlockIndex, ListFS_NodeHeader*, void*), void *data) {
+	if (!this) return;
+	listfs_log(this, "[%s] first node = %llu\n", __func__, node);
+	ListFS_NodeHeader *header = listfs_get_buffer(this);
+	memset(header, 0, this->block_size);
+	while (node != -1) {
+		listfs_read_block(this, node, header);
+		if (callback) {
+			if (!callback(this, node, header, data)) break;
+		}
+		node = header->next;
+		listfs_log(this, "[%s] next node = %llu\n", __func__, node);
+	}
+	listfs_put_buffer(this, header);
+}
+
+void listfs_foreach_subnode(ListFS *this, ListFS_BlockIndex node, bool (*callback)(ListFS*, ListFS_BlockIndex, ListFS_NodeHeader*, void*), void *data) {
+	if (!this) return;
+	listfs_log(this, "[%s] parent node = %llu\n", __func__, node);
+	if (node != -1) {
+		ListFS_NodeHeader *header = listfs_borrow_node(this, node);
+		listfs_read_block(this, node, header);
+		listfs_foreach_node(this, header->data, callback, data);
+		listfs_put_buffer(this, header);
+	}
+}
+
+void listfs_foreach_block(ListFS *this, ListFS_BlockIndex list, bool (*callback)(ListFS*, ListFS_BlockIndex, bool, void*), void *data) {
+	if (!this) return;
+	listfs_log(this, "[%s] first list = %llu\n", __func__, list);
+	size_t block_list_size = this->block_size / sizeof(ListFS_BlockIndex);
+	ListFS_BlockIndex *blocks = listfs_get_buffer(this);
+	while (list != -1) {
+		listfs_read_block(this, list, blocks);
+		if (!callback(this, list, true, data)) break;
+		size_t i;
+		for (i = 1; i < block_list_size - 1; i++) {
+			if (blocks[i] == -1) continue;
+			if (!callback(this, blocks[i], false, data)) {
+				listfs_put_buffer(this, blocks);
+				return;
+			}
+		}
+		list = blocks[block_list_size - 1];
+	}
+	listfs_put_buffer(this, blocks);
+}
+
+/*
+	Walks the subtree of a node chain reading metadata in disk order. Found nodes and block lists wait
+	in a heap ordered by block index and are visited in ascending sweeps. Each read fetches a run of
+	blocks from the visited one, so neighbours found later (like next nodes of a packed directory) are
+	served from memory. Like readahead of a sequential reader, the run starts at one block and doubles
+	up to LISTFS_SCAN_CHUNK bytes while reads keep landing right after the previous run (allowing gaps
+	of LISTFS_SCAN_GAP blocks). Nodes come out of tree order, but block lists of a file still come in
+	list order. Block lists are only read if list_callback is given. Every block is visited once
+	(a bitmap of the volume tracks them), so corrupted links that loop or point outside of the volume
+	are logged and skipped. Returns false if a callback stopped the scan.
+*/
+
+#define LISTFS_SCAN_CHUNK (128 * 1024)
+#define LISTFS_SCAN_GAP 8
+
+typedef struct {
+	ListFS_BlockIndex block;
+	ListFS_BlockIndex node;
+	bool list;
+} ListFS_ScanItem;
+
+typedef struct {
+	ListFS_ScanItem *items;
+	size_t count;
+	size_t capacity;
+} ListFS_ScanHeap;
+
+void listfs_scan_push(ListFS_ScanHeap *heap, ListFS_BlockIndex block, ListFS_BlockIndex node, bool list) {
+	if (heap->count >= heap->capacity) {
+		heap->capacity = heap->capacity ? heap->capacity * 2 : 64;
+		heap->items = realloc(heap->items, heap->capacity * sizeof(ListFS_ScanItem));
+	}
+	size_t i = heap->count++;
+	while (i > 0) {
+		size_t parent = (i - 1) / 2;
+		if (heap->items[parent].block <= block) break;
+		heap->items[i] = heap->items[parent];
+		i = parent;
+	}
+	heap->items[i].block = block;
+	heap->items[i].node = node;
+	heap->items[i].list = list;
+}
+
+ListFS_ScanItem listfs_scan_pop(ListFS_ScanHeap *heap) {
+	ListFS_ScanItem result = heap->items[0];
+	ListFS_ScanItem last = heap->items[--heap->count];
+	size_t i = 0;
+	while (true) {
+		size_t child = i * 2 + 1;
+		if (child >= heap->count) break;
+		if ((child + 1 < heap->count) && (heap->items[child + 1].block < heap->items[child].block)) child++;
+		if (last.block <= heap->items[child].block) break;
+		heap->items[i] = heap->items[child];
+		i = child;
+	}
+	if (heap->count) {
+		heap->items[i] = last;
+	}
+	return result;
+}
+
+bool listfs_scan(ListFS *this, ListFS_BlockIndex first, bool (*node_callback)(ListFS*, ListFS_BlockIndex, ListFS_NodeHeader*, void*),
+		bool (*list_callback)(ListFS*, ListFS_BlockIndex, ListFS_BlockIndex, ListFS_BlockIndex*, void*), void *data) {
+	if (!this) return false;
+	listfs_log(this, "[%s] first node = %lli\n", __func__, first);
+	size_t block_list_size = this->block_size / sizeof(ListFS_BlockIndex);
+	ListFS_BlockCount chunk_size = max(LISTFS_SCAN_CHUNK / this->block_size, 1);
+	uint8_t *chunk = malloc(chunk_size * this->block_size);
+	ListFS_BlockIndex chunk_base = 0;
+	ListFS_BlockCount chunk_count = 0, run = 1;
+	uint8_t *visited = calloc((this->header->size + 7) / 8, 1);
+	/* Blocks found behind the current position wait for the next sweep */
+	ListFS_ScanHeap sweep = {NULL, 0, 0}, next_sweep = {NULL, 0, 0};
+	bool result = true;
+	if (first != -1) {
+		listfs_scan_push(&sweep, first, -1, false);
+	}
+	while (result && (sweep.count || next_sweep.count)) {
+		if (!sweep.count) {
+			ListFS_ScanHeap tmp = sweep;
+			sweep = next_sweep;
+			next_sweep = tmp;
+		}
+		ListFS_ScanItem item = listfs_scan_pop(&sweep);
+		if (item.block >= this->header->size) {
+			listfs_log(this, "[%s] Block %llu is out of range!\n", __func__, item.block);
+			continue;
+		}
+		if (visited[item.block / 8] & (1 << (item.block % 8))) {
+			listfs_log(this, "[%s] Block %llu is linked more than once!\n", __func__, item.block);
+			continue;
+		}
+		visited[item.block / 8] |= 1 << (item.block % 8);
+		if ((item.block < chunk_base) || (item.block >= chunk_base + chunk_count)) {
+			bool sequential = (item.block >= chunk_base + chunk_count) && (item.block - chunk_base - chunk_count <= LISTFS_SCAN_GAP);
+			run = sequential ? min(run * 2, chunk_size) : 1;
+			chunk_base = item.block;
+			chunk_count = min(run, this->header->size - item.block);
+			listfs_read_blocks(this, chunk_base, chunk, chunk_count);
+		}
+		uint8_t *block = chunk + (item.block - chunk_base) * this->block_size;
+		ListFS_BlockIndex found[2] = {-1, -1};
+		bool found_list = false;
+		if (item.list) {
+			ListFS_BlockIndex *list = (ListFS_BlockIndex*)block;
+			found[0] = list[block_list_size - 1];
+			found_list = true;
+			result = list_callback(this, item.node, item.block, list, data);
+		} else {
+			ListFS_NodeHeader *header = (ListFS_NodeHeader*)block;
+			if (header->magic != LISTFS_NODE_MAGIC) {
+				listfs_log(this, "[%s] Block %llu isn't node!\n", __func__, item.block);
+				continue;
+			}
+			/* Links are taken before the callback, it may change the header */
+			found[0] = header->next;
+			if ((header->flags & LISTFS_NODE_FLAG_DIRECTORY) || list_callback) {
+				found[1] = header->data;
+				found_list = !(header->flags & LISTFS_NODE_FLAG_DIRECTORY);
+			}
+			if (node_callback) {
+				result = node_callback(this, item.block, header, data);
+			}
+		}
+		if (found[0] != -1) {
+			listfs_scan_push((found[0] > item.block) ? &sweep : &next_sweep, found[0], item.node, item.list);
+		}
+		if (found[1] != -1) {
+			listfs_scan_push((found[1] > item.block) ? &sweep : &next_sweep, found[1], found_list ? item.block : -1, found_list);
+		}
+	}
+	free(sweep.items);
+	free(next_sweep.items);
+	free(visited);
+	free(chunk);
+	return result;
+}
+
+typedef struct {
+	ListFS_BlockIndex node;
+	uint64_t flags;
+	ListFS_BlockIndex data;
+	ListFS_BlockIndex index;
+	uint8_t *name;
+} ListFS_SearchState;
+
+bool listfs_search_node_callback(ListFS *fs, ListFS_BlockIndex node, ListFS_NodeHeader *header, void *data) {
+	ListFS_SearchState *state = data;
+	if (strncmp(header->name, state->name, sizeof(header->name)) == 0) {
+		state->node = node;
+		state->flags = header->flags;
+		state->data = header->data;
+		state->index = (header->flags & LISTFS_NODE_FLAG_INDEXED) ? header->index : -1;
+		return false;
+	} else {
+		return true;
+	}
+}
+
+ListFS_BlockIndex listfs_search_path(ListFS *this, uint8_t *path, ListFS_BlockIndex first, ListFS_BlockIndex index) {
+	listfs_log(this, "[%s] path = '%s', first = %llu, index = %lli\n", __func__, path, first, index);
+	uint8_t node_name[256 + 1];
+	char *subpath = strchr(path, '/');
+	size_t node_name_len = subpath ? ((size_t)subpath - (size_t)path) : strlen(path);
+	if (subpath) subpath++;
+	strncpy(node_name, path, min(node_name_len, 256));
+	node_name[node_name_len] = 0;
 	listfs_log(this, "[%s] node_name = '%s', subpath = '%s'\n", __func__, node_name, subpath);
 	ListFS_SearchState state;
 	state.node = -1;
 	state.name = node_name;
-	listfs_foreach_node(this, first, listfs_search_node_callback, &state);
+	if (index != -1) {
+		ListFS_NodeHeader *header = listfs_get_buffer(this);
+		ListFS_BlockIndex node = listfs_index_find(this, index, node_name, header);
+		if (node != -1) {
+			listfs_search_node_callback(this, node, header, &state);
+		}
+		listfs_put_buffer(this, header);
+	}
+	if ((index == -1) || ((state.node == -1) && this->index_untrusted)) {
+		/* Indexes of a volume which wasn't closed cleanly may miss names, the chain is authoritative */
+		listfs_foreach_node(this, first, listfs_search_node_callback, &state);
+	}
 	if (state.node == -1) {
 		listfs_log(this, "[%s] Node '%s' not found %llu\n", __func__, node_name);
 		return -1;
@@ -351,300 +2000,1825 @@ uint64_t listfs_search_node(ListFS *this, uint8_t *path, ListFS_BlockIndex first
 			return state.node;
 		} else if (state.flags & LISTFS_NODE_FLAG_DIRECTORY) {
 			listfs_log(this, "[%s] We going deeper\n", __func__);
-			return listfs_search_node(this, subpath, state.data);
+			return listfs_search_path(this, subpath, state.data, state.index);
+		} else {
+			listfs_log(this, "[%s] We need directory, but found file\n", __func__);
+			return -1;
+		}
+	}
+}
+
+uint64_t listfs_search_node(ListFS *this, uint8_t *path, ListFS_BlockIndex first) {
+	if (!this) return -1;
+	ListFS_BlockIndex index = -1;
+	if (first == this->header->root_dir) {
+		index = listfs_dir_index(this, -1);
+	} else if (first != -1) {
+		ListFS_NodeHeader *header = listfs_borrow_node(this, first);
+		index = listfs_dir_index(this, header->parent);
+		listfs_put_buffer(this, header);
+	}
+	return listfs_search_path(this, path, first, index);
+}
+
+void listfs_rename_node(ListFS *this, ListFS_BlockIndex node, uint8_t *name) {
+	listfs_log(this, "[%s] node = %llu, name = '%s'\n", __func__, node, name);
+	listfs_journal_reserve(this, LISTFS_JOURNAL_OP_BLOCKS);
+	ListFS_NodeHeader *header = listfs_borrow_node(this, node);
+	ListFS_BlockIndex index = listfs_dir_index(this, header->parent);
+	if (index != -1) {
+		listfs_index_update(this, index, listfs_name_hash(header->name), node, -1);
+	}
+	strncpy(header->name, name, 256);
+	listfs_write_block(this, node, header);
+	ListFS_OpennedFile *file = listfs_find_open_file(this, node);
+	if (file) {
+		memcpy(file->node_header->name, header->name, sizeof(header->name));
+	}
+	if ((index != -1) && !listfs_index_insert(this, index, listfs_name_hash(header->name), node)) {
+		listfs_drop_index(this, header->parent);
+	}
+	listfs_put_buffer(this, header);
+}
+
+/* Compression functions */
+
+#define LISTFS_LZ_HASH_BITS 12
+#define LISTFS_LZ_MIN_MATCH 4
+#define LISTFS_LZ_MAX_OFFSET 65535
+
+uint8_t *listfs_lz_length(uint8_t *out, uint8_t *end, size_t length) {
+	while (length >= 255) {
+		if (out >= end) return NULL;
+		*out++ = 255;
+		length -= 255;
+	}
+	if (out >= end) return NULL;
+	*out++ = length;
+	return out;
+}
+
+uint8_t *listfs_lz_sequence(uint8_t *out, uint8_t *end, uint8_t *literals, size_t literal_length, size_t offset, size_t match_length) {
+	if (out >= end) return NULL;
+	uint8_t *token = out++;
+	*token = min(literal_length, 15) << 4;
+	if ((literal_length >= 15) && !(out = listfs_lz_length(out, end, literal_length - 15))) return NULL;
+	if (literal_length > end - out) return NULL;
+	memcpy(out, literals, literal_length);
+	out += literal_length;
+	if (match_length) {
+		if (end - out < 2) return NULL;
+		*out++ = offset & 0xFF;
+		*out++ = offset >> 8;
+		match_length -= LISTFS_LZ_MIN_MATCH;
+		*token |= min(match_length, 15);
+		if ((match_length >= 15) && !(out = listfs_lz_length(out, end, match_length - 15))) return NULL;
+	}
+	return out;
+}
+
+size_t listfs_compress(void *src, size_t length, void *dst, size_t capacity) {
+	uint8_t *in = src, *out = dst, *end = out + capacity;
+	uint32_t table[1 << LISTFS_LZ_HASH_BITS];
+	memset(table, 0, sizeof(table));
+	size_t position = 0, anchor = 0;
+	while (position + LISTFS_LZ_MIN_MATCH <= length) {
+		uint32_t sequence;
+		memcpy(&sequence, in + position, sizeof(sequence));
+		uint32_t hash = (sequence * 2654435761U) >> (32 - LISTFS_LZ_HASH_BITS);
+		size_t candidate = table[hash];
+		table[hash] = position + 1;
+		if (candidate && (position - (candidate - 1) <= LISTFS_LZ_MAX_OFFSET) && (memcmp(in + candidate - 1, &sequence, sizeof(sequence)) == 0)) {
+			size_t reference = candidate - 1, match_length = LISTFS_LZ_MIN_MATCH;
+			while ((position + match_length < length) && (in[reference + match_length] == in[position + match_length])) {
+				match_length++;
+			}
+			out = listfs_lz_sequence(out, end, in + anchor, position - anchor, position - reference, match_length);
+			if (!out) return 0;
+			position += match_length;
+			anchor = position;
+		} else {
+			position++;
+		}
+	}
+	out = listfs_lz_sequence(out, end, in + anchor, length - anchor, 0, 0);
+	if (!out) return 0;
+	return out - (uint8_t*)dst;
+}
+
+size_t listfs_decompress(void *src, size_t length, void *dst, size_t capacity) {
+	uint8_t *in = src, *in_end = in + length, *out = dst, *out_end = out + capacity;
+	while (in < in_end) {
+		uint8_t token = *in++, byte;
+		size_t literal_length = token >> 4;
+		if (literal_length == 15) {
+			do {
+				if (in >= in_end) return -1;
+				byte = *in++;
+				literal_length += byte;
+			} while (byte == 255);
+		}
+		if ((literal_length > in_end - in) || (literal_length > out_end - out)) return -1;
+		memcpy(out, in, literal_length);
+		in += literal_length;
+		out += literal_length;
+		if (in == in_end) break;
+		if (in_end - in < 2) return -1;
+		size_t offset = in[0] | (in[1] << 8);
+		in += 2;
+		if ((offset == 0) || (offset > out - (uint8_t*)dst)) return -1;
+		size_t match_length = token & 15;
+		if (match_length == 15) {
+			do {
+				if (in >= in_end) return -1;
+				byte = *in++;
+				match_length += byte;
+			} while (byte == 255);
+		}
+		match_length += LISTFS_LZ_MIN_MATCH;
+		if (match_length > out_end - out) return -1;
+		uint8_t *reference = out - offset;
+		while (match_length--) {
+			*out++ = *reference++;
+		}
+	}
+	return out - (uint8_t*)dst;
+}
+
+/*
+	Compressed files are split into clusters of (cluster blocks - 1) * block size bytes. Cluster N owns
+	slots [N * cluster blocks, (N + 1) * cluster blocks) of the file block lists and is stored in as many
+	of them as needed: 32-bit length followed by LZ stream (or raw data if LISTFS_CLUSTER_STORED is set).
+	The rest of the slots are -1.
+*/
+
+size_t listfs_cluster_blocks(uint32_t block_size) {
+	return max(LISTFS_CLUSTER_SIZE / block_size, 2);
+}
+
+size_t listfs_decode_cluster(uint32_t block_size, void *stored, void *cluster) {
+	size_t capacity = (listfs_cluster_blocks(block_size) - 1) * block_size;
+	uint32_t length;
+	memcpy(&length, stored, sizeof(length));
+	if (length & LISTFS_CLUSTER_STORED) {
+		length &= ~LISTFS_CLUSTER_STORED;
+		if (length > capacity) return -1;
+		memcpy(cluster, (uint8_t*)stored + sizeof(length), length);
+		return length;
+	}
+	if (length > capacity + block_size - sizeof(length)) return -1;
+	return listfs_decompress((uint8_t*)stored + sizeof(length), length, cluster, capacity);
+}
+
+/* File functions */
+
+ListFS_OpennedFile *listfs_open_file(ListFS *this, ListFS_BlockIndex node) {
+	if (!this) return;
+	listfs_log(this, "[%s] node = %llu\n", __func__, node);
+	if (node == -1) return NULL;
+	ListFS_OpennedFile *file = listfs_find_open_file(this, node);
+	if (file) {
+		file->link_count++;
+		listfs_log(this, "[%s] This file already openned\n", __func__);
+		return file;
+	}
+	file = calloc(sizeof(ListFS_OpennedFile), 1);
+	file->fs = this;
+	file->node = node;
+	file->alloc_hint = -1;
+	file->alloc_group = -1;
+	file->cluster_index = -1;
+	file->node_header = listfs_get_buffer(this);
+	listfs_read_block(this, node, file->node_header);
+	if ((file->node_header->magic != LISTFS_NODE_MAGIC) || (file->node_header->flags & LISTFS_NODE_FLAG_DIRECTORY)) {
+		listfs_file_close(file);
+		return NULL;
+	}
+	file->stored_size = file->node_header->size;
+	file->cur_block_list_block = file->node_header->data;
+	file->cur_block_list = listfs_get_buffer(this);
+	if (file->node_header->data != -1) {
+		listfs_read_block(this, file->node_header->data, file->cur_block_list);
+	} else {
+		memset(file->cur_block_list, 0, this->block_size);
+	}
+	file->cur_block = 1;
+	file->link_count++;
+	if (this->file_info_count == this->file_info_capacity) {
+		this->file_info_capacity = this->file_info_capacity ? this->file_info_capacity * 2 : 16;
+		this->file_info = realloc(this->file_info, this->file_info_capacity * sizeof(ListFS_FileInfo));
+	}
+	this->file_info_count++;
+	this->file_info[this->file_info_count - 1].node = node;
+	this->file_info[this->file_info_count - 1].file = file;
+	return file;
+}
+
+void listfs_file_close(ListFS_OpennedFile *this) {
+	if (!this) return;
+	listfs_log(this->fs, "[%s] link count = %u\n", __func__, this->link_count);
+	this->link_count--;
+	if (this->link_count == 0) {
+		listfs_file_flush(this);
+		ListFS *fs = this->fs;
+		size_t i;
+		for (i = 0; i < fs->file_info_count; i++) {
+			if (fs->file_info[i].node == this->node) {
+				memmove(&fs->file_info[i], &fs->file_info[i + 1], (fs->file_info_count - i - 1) * sizeof(ListFS_FileInfo));
+				fs->file_info_count--;
+				break;
+			}
+		}
+		if (this->alloc_group != -1) {
+			this->fs->groups[this->alloc_group].writers--;
+		}
+		listfs_put_buffer(this->fs, this->node_header);
+		listfs_put_buffer(this->fs, this->cur_block_list);
+		free(this->cluster);
+		free(this);
+	}
+}
+
+void listfs_file_write_header(ListFS_OpennedFile *this) {
+	ListFS *fs = this->fs;
+	uint64_t size = this->node_header->size;
+	ListFS_NodeHeader *header = this->node_header;
+	/* Detached file isn't counted anywhere */
+	bool linked = (header->parent != -1) || (header->prev != -1) || (fs->header->root_dir == this->node);
+	if ((size != this->stored_size) && linked) {
+		ListFS_Aggregates before = {this->stored_size, bytes_to_blocks(this->stored_size, fs->block_size), 0};
+		ListFS_Aggregates after = {size, bytes_to_blocks(size, fs->block_size), 0};
+		listfs_update_aggregates(fs, header->parent, &before, &after);
+	}
+	this->stored_size = size;
+	listfs_write_block(fs, this->node, header);
+}
+
+void listfs_file_set_alloc_group(ListFS_OpennedFile *this, size_t group) {
+	if (this->alloc_group == group) return;
+	if (this->alloc_group != -1) {
+		this->fs->groups[this->alloc_group].writers--;
+	}
+	this->alloc_group = group;
+	if (group != -1) {
+		this->fs->groups[group].writers++;
+	}
+}
+
+ListFS_BlockIndex listfs_file_alloc_block(ListFS_OpennedFile *this) {
+	ListFS *fs = this->fs;
+	ListFS_BlockIndex hint = this->alloc_hint;
+	if (!listfs_load_map(fs)) return -1;
+	if (hint == -1) {
+		hint = this->node + 1;
+		if ((this->cur_block_list_block != -1) && (this->cur_block > 1) && (this->cur_block_list[this->cur_block - 1] != -1)) {
+			hint = this->cur_block_list[this->cur_block - 1] + 1;
+		}
+	}
+	size_t group = min(hint, fs->header->size - 1) / fs->group_size;
+	if ((group != this->alloc_group) && fs->groups[group].writers) {
+		/* Another file is streaming into this group, start the new run in an idle one */
+		size_t i;
+		for (i = 1; i < fs->group_count; i++) {
+			size_t g = (group + i) % fs->group_count;
+			if ((fs->groups[g].writers == 0) && fs->groups[g].free_blocks) {
+				hint = fs->groups[g].cursor;
+				break;
+			}
+		}
+	}
+	ListFS_BlockIndex block = listfs_alloc_block_near(fs, hint);
+	if (block != -1) {
+		listfs_file_set_alloc_group(this, block / fs->group_size);
+		this->alloc_hint = block + 1;
+	}
+	return block;
+}
+
+/* Slot updates of the current block list are written once per operation or when the cursor leaves the list */
+void listfs_file_flush_list(ListFS_OpennedFile *this) {
+	listfs_flush_refcounts(this->fs);
+	if (!this->cur_block_list_dirty) return;
+	listfs_write_block(this->fs, this->cur_block_list_block, this->cur_block_list);
+	this->cur_block_list_dirty = false;
+}
+
+void listfs_file_load_list(ListFS_OpennedFile *this, ListFS_BlockIndex list) {
+	listfs_file_flush_list(this);
+	this->cur_block_list_block = list;
+	listfs_read_block(this->fs, this->cur_block_list_block, this->cur_block_list);
+}
+
+/* Copy-on-write: replace shared block in current slot with a private one */
+bool listfs_file_unshare_cur_block(ListFS_OpennedFile *this, bool copy) {
+	ListFS *fs = this->fs;
+	ListFS_BlockIndex shared = this->cur_block_list[this->cur_block];
+	ListFS_BlockIndex block = listfs_file_alloc_block(this);
+	if (block == -1) return false;
+	listfs_log(fs, "[%s] shared = %llu, block = %llu\n", __func__, shared, block);
+	if (copy) {
+		uint8_t *tmp = listfs_get_buffer(fs);
+		listfs_read_block(fs, shared, tmp);
+		listfs_write_data_block(fs, block, tmp);
+		listfs_put_buffer(fs, tmp);
+	}
+	listfs_set_refcount(fs, shared, listfs_get_refcount(fs, shared) - 1);
+	this->cur_block_list[this->cur_block] = block;
+	this->cur_block_list_dirty = true;
+	return true;
+}
+
+bool listfs_file_touch_cur_block(ListFS_OpennedFile *this, bool write) {
+	if (!this) return false;
+	listfs_log(this->fs, "[%s] write = %u\n", __func__, write);
+	size_t block_list_size = this->fs->block_size / sizeof(ListFS_BlockIndex);
+	bool result = false;
+	if (this->cur_block_list_block == -1) {
+		if (write) {
+			this->cur_block_list_block = listfs_file_alloc_block(this);
+			if (this->cur_block_list_block != -1) {
+				this->cur_list_number = 0;
+				this->node_header->data = this->cur_block_list_block;
+				listfs_file_write_header(this);
+				memset(this->cur_block_list, -1, block_list_size * sizeof(ListFS_BlockIndex));
+				listfs_write_block(this->fs, this->cur_block_list_block, this->cur_block_list);
+			}
+		}
+	}
+	if (this->cur_block_list_block != -1) {
+		if (this->cur_block == 0) {
+			if (this->cur_block_list[0] == -1) {
+				this->cur_block = 1;
+			} else {
+				listfs_file_load_list(this, this->cur_block_list[0]);
+				this->cur_block = block_list_size - 2;
+				this->cur_list_number--;
+			}
+		} else if (this->cur_block == block_list_size - 1) {
+			if (this->cur_block_list[block_list_size - 1] == -1) {
+				if (write) {
+					this->cur_block_list[block_list_size - 1] = listfs_file_alloc_block(this);
+					if (this->cur_block_list[block_list_size - 1] != -1) {
+						this->cur_block_list_dirty = true;
+						listfs_file_flush_list(this);
+						ListFS_BlockIndex prev_block_list = this->cur_block_list_block;
+						this->cur_block_list_block = this->cur_block_list[block_list_size - 1];
+						memset(this->cur_block_list + 1, -1, (block_list_size - 1) * sizeof(ListFS_BlockIndex));
+						this->cur_block_list[0] = prev_block_list;
+						listfs_write_block(this->fs, this->cur_block_list_block, this->cur_block_list);
+						this->cur_block = 1;
+						this->cur_list_number++;
+					}
+				}
+			} else {
+				listfs_file_load_list(this, this->cur_block_list[block_list_size - 1]);
+				this->cur_block = 1;
+				this->cur_list_number++;
+			}
+		}
+		if ((this->cur_block > 0) && (this->cur_block < block_list_size - 1)) {
+			if (this->cur_block_list[this->cur_block] == -1) {
+				if (write) {
+					this->cur_block_list[this->cur_block] = listfs_file_alloc_block(this);
+					if (this->cur_block_list[this->cur_block] != -1) {
+						this->cur_block_list_dirty = true;
+						result = true;
+					}
+				}
+			} else if (write && listfs_block_shared(this->fs, this->cur_block_list[this->cur_block])) {
+				result = listfs_file_unshare_cur_block(this, true);
+			} else {
+				result = true;
+			}
+		}
+	}
+	return result;
+}
+
+bool listfs_file_switch_cur_block(ListFS_OpennedFile *this, bool prev, bool write) {
+	if (!this) return false;
+	listfs_log(this->fs, "[%s] prev = %u, write = %u\n", __func__, prev, write);
+	size_t block_list_size = this->fs->block_size / sizeof(ListFS_BlockIndex);
+	bool result;
+	if (prev) {
+		if (this->cur_block > 0) {
+			this->cur_block--;
+			if (this->cur_global_offset >= this->fs->block_size) {
+ 				this->cur_global_offset -= this->fs->block_size;
+			}
+		}
+	} else {
+		if (this->cur_block < block_list_size) {
+ 			this->cur_block++;
+		}
+	}
+	result = listfs_file_touch_cur_block(this, write);
+	if (result && !prev) {
+		this->cur_global_offset += this->fs->block_size;
+	}
+	return result;
+}
+
+bool listfs_file_goto_list(ListFS_OpennedFile *this, uint64_t number, bool write) {
+	size_t block_list_size = this->fs->block_size / sizeof(ListFS_BlockIndex);
+	if (this->cur_block_list_block == -1) {
+		if (!write) return false;
+		this->cur_block_list_block = listfs_file_alloc_block(this);
+		if (this->cur_block_list_block == -1) return false;
+		this->cur_list_number = 0;
+		this->node_header->data = this->cur_block_list_block;
+		listfs_file_write_header(this);
+		memset(this->cur_block_list, -1, block_list_size * sizeof(ListFS_BlockIndex));
+		listfs_write_block(this->fs, this->cur_block_list_block, this->cur_block_list);
+	}
+	while (this->cur_list_number > number) {
+		if (this->cur_block_list[0] == -1) return false;
+		listfs_file_load_list(this, this->cur_block_list[0]);
+		this->cur_list_number--;
+	}
+	while (this->cur_list_number < number) {
+		ListFS_BlockIndex next_list = this->cur_block_list[block_list_size - 1];
+		if (next_list == -1) {
+			if (!write) return false;
+			this->cur_block = block_list_size - 1;
+			next_list = listfs_file_alloc_block(this);
+			if (next_list == -1) return false;
+			this->cur_block_list[block_list_size - 1] = next_list;
+			this->cur_block_list_dirty = true;
+			listfs_file_flush_list(this);
+			memset(this->cur_block_list + 1, -1, (block_list_size - 1) * sizeof(ListFS_BlockIndex));
+			this->cur_block_list[0] = this->cur_block_list_block;
+			this->cur_block_list_block = next_list;
+			listfs_write_block(this->fs, this->cur_block_list_block, this->cur_block_list);
+		} else {
+			listfs_file_load_list(this, next_list);
+		}
+		this->cur_list_number++;
+	}
+	return true;
+}
+
+ListFS_BlockIndex listfs_file_get_slot(ListFS_OpennedFile *this, uint64_t slot, bool write) {
+	size_t block_list_size = this->fs->block_size / sizeof(ListFS_BlockIndex);
+	if (!listfs_file_goto_list(this, slot / (block_list_size - 2), write)) return -1;
+	this->cur_block = slot % (block_list_size - 2) + 1;
+	if ((this->cur_block_list[this->cur_block] == -1) && write) {
+		ListFS_BlockIndex block = listfs_file_alloc_block(this);
+		if (block != -1) {
+			this->cur_block_list[this->cur_block] = block;
+			this->cur_block_list_dirty = true;
+		}
+	} else if (write && listfs_block_shared(this->fs, this->cur_block_list[this->cur_block])) {
+		/* Caller overwrites the whole slot, so shared data need not be copied */
+		if (!listfs_file_unshare_cur_block(this, false)) return -1;
+	}
+	return this->cur_block_list[this->cur_block];
+}
+
+uint64_t listfs_file_cluster_size(ListFS_OpennedFile *this) {
+	return (listfs_cluster_blocks(this->fs->block_size) - 1) * this->fs->block_size;
+}
+
+void listfs_file_load_cluster(ListFS_OpennedFile *this, uint64_t index) {
+	if (this->cluster_index == index) return;
+	listfs_file_flush(this);
+	uint32_t block_size = this->fs->block_size;
+	size_t cluster_blocks = listfs_cluster_blocks(block_size);
+	uint64_t cluster_size = listfs_file_cluster_size(this);
+	if (!this->cluster) {
+		this->cluster = malloc(cluster_size);
+	}
+	size_t length = 0;
+	ListFS_BlockIndex block = listfs_file_get_slot(this, index * cluster_blocks, false);
+	if (block != -1) {
+		uint8_t *stored = malloc(cluster_blocks * block_size);
+		listfs_read_block(this->fs, block, stored);
+		uint32_t stored_length;
+		memcpy(&stored_length, stored, sizeof(stored_length));
+		size_t count = min(bytes_to_blocks(sizeof(stored_length) + (stored_length & ~LISTFS_CLUSTER_STORED), block_size), cluster_blocks);
+		size_t i;
+		for (i = 1; i < count; i++) {
+			block = listfs_file_get_slot(this, index * cluster_blocks + i, false);
+			if (block == -1) break;
+			listfs_read_block(this->fs, block, stored + i * block_size);
+		}
+		length = (i == count) ? listfs_decode_cluster(block_size, stored, this->cluster) : -1;
+		if (length == -1) {
+			listfs_log(this->fs, "[%s] Cluster %llu of node %llu is corrupted!\n", __func__, index, this->node);
+			length = 0;
+		}
+		free(stored);
+	}
+	memset(this->cluster + length, 0, cluster_size - length);
+	this->cluster_index = index;
+	this->cluster_dirty = false;
+}
+
+void listfs_file_flush(ListFS_OpennedFile *this) {
+	if (!this) return;
+	listfs_file_flush_list(this);
+	if (!this->cluster_dirty) return;
+	listfs_log(this->fs, "[%s] cluster = %llu\n", __func__, this->cluster_index);
+	uint32_t block_size = this->fs->block_size;
+	size_t cluster_blocks = listfs_cluster_blocks(block_size);
+	uint64_t cluster_size = listfs_file_cluster_size(this);
+	uint64_t start = this->cluster_index * cluster_size;
+	uint32_t length = (this->node_header->size > start) ? min(this->node_header->size - start, cluster_size) : 0;
+	uint8_t *stored = calloc(cluster_blocks, block_size);
+	uint32_t stored_length = listfs_compress(this->cluster, length, stored + sizeof(stored_length),
+		cluster_blocks * block_size - sizeof(stored_length));
+	if ((stored_length == 0) || (stored_length >= length)) {
+		memcpy(stored + sizeof(stored_length), this->cluster, length);
+		stored_length = length;
+		memcpy(stored, &stored_length, sizeof(stored_length));
+		stored[sizeof(stored_length) - 1] |= LISTFS_CLUSTER_STORED >> 24;
+	} else {
+		memcpy(stored, &stored_length, sizeof(stored_length));
+	}
+	size_t count = bytes_to_blocks(sizeof(stored_length) + stored_length, block_size);
+	/*
+		Cluster is written to fresh blocks and the slots are switched afterwards, so a crash in the middle
+		leaves either the old cluster or the new one behind, never a mix of both
+	*/
+	size_t list_slots = block_size / sizeof(ListFS_BlockIndex) - 2;
+	uint64_t first_slot = this->cluster_index * cluster_blocks;
+	ListFS_BlockIndex *fresh = malloc(cluster_blocks * sizeof(ListFS_BlockIndex));
+	size_t i = 0;
+	if (listfs_file_goto_list(this, (first_slot + count - 1) / list_slots, true)) {
+		for (; i < count; i++) {
+			fresh[i] = listfs_file_alloc_block(this);
+			if (fresh[i] == -1) break;
+			listfs_write_data_block(this->fs, fresh[i], stored + i * block_size);
+		}
+	}
+	free(stored);
+	this->cluster_dirty = false;
+	if (i < count) {
+		listfs_log(this->fs, "[%s] No space to rewrite cluster %llu!\n", __func__, this->cluster_index);
+		while (i > 0) {
+			listfs_free_blocks(this->fs, fresh[--i], 1);
+		}
+		free(fresh);
+		return;
+	}
+	ListFS_FreeList free_list = {NULL, 0, 0};
+	for (i = 0; i < cluster_blocks; i++) {
+		uint64_t slot = first_slot + i;
+		if (!listfs_file_goto_list(this, slot / list_slots, false)) break;
+		this->cur_block = slot % list_slots + 1;
+		ListFS_BlockIndex block = this->cur_block_list[this->cur_block];
+		ListFS_BlockIndex replacement = (i < count) ? fresh[i] : -1;
+		if (block == replacement) continue;
+		if (block != -1) {
+			/* Shared blocks only lose a reference */
+			listfs_free_list_add(&free_list, block);
+		}
+		this->cur_block_list[this->cur_block] = replacement;
+		this->cur_block_list_dirty = true;
+	}
+	free(fresh);
+	listfs_file_flush_list(this);
+	listfs_free_list_commit(this->fs, &free_list);
+}
+
+size_t listfs_file_write_compressed(ListFS_OpennedFile *this, void *buffer, size_t length) {
+	uint64_t cluster_size = listfs_file_cluster_size(this);
+	size_t count = 0;
+	while (length) {
+		uint64_t index = this->cur_global_offset / cluster_size;
+		size_t offset = this->cur_global_offset % cluster_size;
+		size_t c = min(cluster_size - offset, length);
+		listfs_file_load_cluster(this, index);
+		memmove(this->cluster + offset, buffer, c);
+		this->cluster_dirty = true;
+		buffer += c;
+		length -= c;
+		count += c;
+		this->cur_global_offset += c;
+		if (this->cur_global_offset > this->node_header->size) {
+			this->node_header->size = this->cur_global_offset;
+		}
+	}
+	return count;
+}
+
+size_t listfs_file_read_compressed(ListFS_OpennedFile *this, void *buffer, size_t length) {
+	uint64_t cluster_size = listfs_file_cluster_size(this);
+	size_t count = 0;
+	if (this->cur_global_offset >= this->node_header->size) return 0;
+	length = min(length, this->node_header->size - this->cur_global_offset);
+	while (length) {
+		uint64_t index = this->cur_global_offset / cluster_size;
+		size_t offset = this->cur_global_offset % cluster_size;
+		size_t c = min(cluster_size - offset, length);
+		listfs_file_load_cluster(this, index);
+		memmove(buffer, this->cluster + offset, c);
+		buffer += c;
+		length -= c;
+		count += c;
+		this->cur_global_offset += c;
+	}
+	return count;
+}
+
+void listfs_file_seek(ListFS_OpennedFile *this, uint64_t offset, bool write) {
+	if (!this) return;
+	listfs_log(this->fs, "[%s] offset = %llu, write = %u\n", __func__, offset, write);
+	if (this->node_header->flags & LISTFS_NODE_FLAG_COMPRESSED) {
+		this->cur_global_offset = offset;
+		if ((offset > this->node_header->size) && write) {
+			this->node_header->size = offset;
+			listfs_file_write_header(this);
+		}
+		return;
+	}
+	size_t block_list_size = this->fs->block_size / sizeof(ListFS_BlockIndex);
+	uint64_t slot = offset / this->fs->block_size;
+	if ((this->cur_global_offset / this->fs->block_size != slot) && (!write || (offset <= this->node_header->size))) {
+		/* Jump between lists instead of stepping through every block */
+		if (listfs_file_goto_list(this, slot / (block_list_size - 2), false)) {
+			this->cur_block = slot % (block_list_size - 2) + 1;
+			this->cur_global_offset = slot * this->fs->block_size;
+		} else if (this->cur_block_list_block != -1) {
+			this->cur_block = 1;
+			this->cur_global_offset = this->cur_list_number * (block_list_size - 2) * this->fs->block_size;
+		}
+	}
+	while (this->cur_global_offset / this->fs->block_size > offset / this->fs->block_size) {
+		if (!listfs_file_switch_cur_block(this, true, write)) break;
+	}
+	while (this->cur_global_offset / this->fs->block_size < offset / this->fs->block_size) {
+		if (!listfs_file_switch_cur_block(this, false, write)) break;
+	}
+	this->cur_offset = offset % this->fs->block_size;
+	this->cur_global_offset = offset;
+	listfs_file_flush_list(this);
+	if ((this->cur_global_offset > this->node_header->size) && write) {
+		this->node_header->size = this->cur_global_offset;
+		listfs_file_write_header(this);
+	}
+}
+
+void listfs_file_truncate_blocks(ListFS_OpennedFile *this) {
+	listfs_file_flush_list(this);
+	ListFS_BlockIndex cur_list = this->cur_block_list_block;
+	if (cur_list == -1) return;
+	size_t cur_block = this->cur_block;
+	if (this->cur_offset > 0) {
+		cur_block++;
+	}
+	size_t block_list_size = this->fs->block_size / sizeof(ListFS_BlockIndex);
+	ListFS_BlockIndex *list = listfs_get_buffer(this->fs);
+	listfs_read_block(this->fs, cur_list, list);
+	ListFS_FreeList free_list = {NULL, 0, 0};
+	bool first_list = true;
+	while (true) {
+		bool list_unused = (cur_block <= 1);
+		for (; cur_block < block_list_size - 1; cur_block++) {
+			if (list[cur_block] != -1) {
+				listfs_free_list_add(&free_list, list[cur_block]);
+				list[cur_block] = -1;
+			}
+		}
+		ListFS_BlockIndex next_list = list[block_list_size - 1];
+		if (list_unused) {
+			listfs_free_list_add(&free_list, cur_list);
+			if (first_list) {
+				if (list[0] == -1) {
+					this->node_header->data = -1;
+					this->cur_block_list_block = -1;
+				} else {
+					ListFS_BlockIndex *prev_list = listfs_get_buffer(this->fs);
+					listfs_read_block(this->fs, list[0], prev_list);
+					prev_list[block_list_size - 1] = -1;
+					listfs_write_block(this->fs, list[0], prev_list);
+					listfs_put_buffer(this->fs, prev_list);
+					this->cur_block_list_block = list[0];
+					this->cur_block = block_list_size - 1;
+					this->cur_list_number--;
+				}
+			}
 		} else {
-			listfs_log(this, "[%s] We need directory, but found file\n", __func__);
-			return -1;
+			list[block_list_size - 1] = -1;
+			listfs_write_block(this->fs, cur_list, list);
+		}
+		if (next_list == -1) {
+			break;
 		}
+		cur_list = next_list;
+		listfs_read_block(this->fs, cur_list, list);
+		cur_block = 1;
+		first_list = false;
+	}
+	listfs_put_buffer(this->fs, list);
+	listfs_free_list_commit(this->fs, &free_list);
+	this->node_header->size = this->cur_global_offset;
+#ifndef DISABLE_TIME
+	this->node_header->modify_time = time(NULL);
+#endif
+	listfs_file_write_header(this);
+	if (this->cur_block_list_block != -1) {
+		listfs_read_block(this->fs, this->cur_block_list_block, this->cur_block_list);
 	}
 }
 
-void listfs_rename_node(ListFS *this, ListFS_BlockIndex node, uint8_t *name) {
-	listfs_log(this, "[%s] node = %llu, name = '%s'\n", __func__, node, name);
-	ListFS_NodeHeader *header = listfs_fetch_node(this, node);
-	strncpy(header->name, name, 256);
-	listfs_write_block(this, node, header);
-	free(header);
+void listfs_file_truncate_compressed(ListFS_OpennedFile *this) {
+	size_t block_list_size = this->fs->block_size / sizeof(ListFS_BlockIndex);
+	size_t cluster_blocks = listfs_cluster_blocks(this->fs->block_size);
+	uint64_t cluster_size = listfs_file_cluster_size(this);
+	uint64_t size = this->cur_global_offset;
+	uint64_t index = size / cluster_size;
+	if (size % cluster_size) {
+		listfs_file_load_cluster(this, index);
+		memset(this->cluster + size % cluster_size, 0, cluster_size - size % cluster_size);
+		this->node_header->size = size;
+		this->cluster_dirty = true;
+		listfs_file_flush(this);
+		index++;
+	}
+	this->cluster_index = -1;
+	uint64_t slot = index * cluster_blocks;
+	if (listfs_file_goto_list(this, slot / (block_list_size - 2), false)) {
+		this->cur_block = slot % (block_list_size - 2) + 1;
+		this->cur_offset = 0;
+		listfs_file_truncate_blocks(this);
+	}
+	this->cur_global_offset = size;
+	this->node_header->size = size;
+#ifndef DISABLE_TIME
+	this->node_header->modify_time = time(NULL);
+#endif
+	listfs_file_write_header(this);
+}
+void listfs_file_truncate(ListFS_OpennedFile *this) {
+	if (!this) return;
+	listfs_log(this->fs, "[%s]\n", __func__);
+	if (!listfs_check_writable(this->fs, __func__)) return;
+	listfs_journal_reserve(this->fs, LISTFS_JOURNAL_OP_BLOCKS);
+	if (this->node_header->flags & LISTFS_NODE_FLAG_COMPRESSED) {
+		listfs_file_truncate_compressed(this);
+	} else {
+		listfs_file_truncate_blocks(this);
+	}
 }
 
-/* File functions */
+size_t listfs_file_write(ListFS_OpennedFile *this, void *buffer, size_t length) {
+	if (!this) return 0;
+	listfs_log(this->fs, "[%s] length = %u\n", __func__, length);
+	if (!listfs_check_writable(this->fs, __func__)) return 0;
+	listfs_journal_reserve(this->fs, LISTFS_JOURNAL_OP_BLOCKS);
+	size_t count = 0;
+	if (this->node_header->flags & LISTFS_NODE_FLAG_COMPRESSED) {
+		uint64_t size = this->node_header->size;
+		count = listfs_file_write_compressed(this, buffer, length);
+		if (count && (this->node_header->size > size)) {
+#ifndef DISABLE_TIME
+			this->node_header->modify_time = time(NULL);
+#endif
+			listfs_file_write_header(this);
+		}
+		return count;
+	}
+	uint8_t *tmp = listfs_get_buffer(this->fs);
+	memset(tmp, 0, this->fs->block_size);
+	while (length) {
+		if (!listfs_file_touch_cur_block(this, true)) break;
+		if ((this->cur_offset > 0) || (length < this->fs->block_size)) {
+			listfs_read_block(this->fs, this->cur_block_list[this->cur_block], tmp);
+		}
+		size_t c = min(this->fs->block_size - this->cur_offset, length);
+		listfs_log(this->fs, "[%s] We writing %u bytes of data at offset %u now\n", __func__, c, this->cur_offset);
+		memmove(tmp + this->cur_offset, buffer, c);
+		listfs_write_data_block(this->fs, this->cur_block_list[this->cur_block], tmp);
+		buffer += c;
+		length -= c;
+		count += c;
+		this->cur_offset += c;
+		this->cur_global_offset += c;
+		if (this->cur_offset >= this->fs->block_size) {
+			this->cur_block++;
+			this->cur_offset = 0;
+		}
+	}
+	listfs_put_buffer(this->fs, tmp);
+	listfs_file_flush_list(this);
+	if (this->cur_global_offset > this->node_header->size) {
+		this->node_header->size = this->cur_global_offset;
+#ifndef DISABLE_TIME
+		this->node_header->modify_time = time(NULL);
+#endif
+		listfs_file_write_header(this);
+	}
+	return count;
+}
 
-ListFS_OpennedFile *listfs_open_file(ListFS *this, ListFS_BlockIndex node) {
+size_t listfs_file_read(ListFS_OpennedFile *this, void *buffer, size_t length) {
+	if (!this) return 0;
+	listfs_log(this->fs, "[%s] length = %u\n", __func__, length);
+	if (this->node_header->flags & LISTFS_NODE_FLAG_COMPRESSED) {
+		return listfs_file_read_compressed(this, buffer, length);
+	}
+	size_t count = 0;
+	uint8_t *tmp = listfs_get_buffer(this->fs);
+	memset(tmp, 0, this->fs->block_size);
+	length = min(length, this->node_header->size - this->cur_global_offset);
+	while (length) {
+		if (!listfs_file_touch_cur_block(this, false)) break;
+		listfs_read_block(this->fs, this->cur_block_list[this->cur_block], tmp);
+		size_t c = min(this->fs->block_size - this->cur_offset, length);
+		listfs_log(this->fs, "[%s] We reading %u bytes of data at offset %u now\n", __func__, c, this->cur_offset);
+		memmove(buffer, tmp + this->cur_offset, c);
+		buffer += c;
+		length -= c;
+		count += c;
+		this->cur_offset += c;
+		this->cur_global_offset += c;
+		if (this->cur_offset >= this->fs->block_size) {
+			this->cur_block++;
+			this->cur_offset = 0;
+		}
+	}
+	listfs_put_buffer(this->fs, tmp);
+	return count;
+}
+
+/* Asynchronous file functions */
+
+/*
+	Asynchronous operations are resumable state machines. Every step issues at most one block transfer
+	through read_block_async_func or write_block_async_func and returns; the driver calls listfs_io_complete
+	when the transfer is done and the operation continues from there. Without async callbacks the synchronous
+	ones are used and the operation completes before listfs_file_*_async returns. Allocation and block list
+	updates of writes still go through the synchronous path, only data transfers and list lookups of reads are
+	asynchronous. listfs_io_complete must not run concurrently with other liblistfs calls.
+
+	A write holds its block from the first transfer until the block is written: a partial block write reads
+	the block, merges its bytes and writes it back, and another write to the same block in between would be
+	lost. Writes that find their block held wait behind the holder and are resumed in order when it is done.
+	Synchronous writes don't take part in this, they must not overlap pending asynchronous ones.
+*/
+
+#define LISTFS_ASYNC_NEXT 0
+#define LISTFS_ASYNC_LIST 1
+#define LISTFS_ASYNC_READ 2
+#define LISTFS_ASYNC_WRITE 3
+#define LISTFS_ASYNC_DONE 4
+
+void listfs_async_read_block(ListFS_AsyncIO *this, ListFS_BlockIndex index, void *buffer) {
+	ListFS *fs = this->file->fs;
+	this->pending = true;
+	void *data = listfs_transaction_find(fs, index);
+	if (data) {
+		memcpy(buffer, data, fs->block_size);
+		listfs_io_complete(this);
+	} else if (fs->read_block_async_func) {
+		fs->read_block_async_func(fs, index, buffer, this);
+	} else {
+		fs->read_block_func(fs, index, buffer);
+		listfs_io_complete(this);
+	}
+}
+
+void listfs_async_write_block(ListFS_AsyncIO *this, ListFS_BlockIndex index, void *buffer) {
+	ListFS *fs = this->file->fs;
+	this->pending = true;
+	void *data = listfs_transaction_find(fs, index);
+	if (data) {
+		memcpy(data, buffer, fs->block_size);
+		listfs_io_complete(this);
+	} else if (fs->write_block_async_func) {
+		fs->write_block_async_func(fs, index, buffer, this);
+	} else {
+		fs->write_block_func(fs, index, buffer);
+		listfs_io_complete(this);
+	}
+}
+
+bool listfs_async_lock_block(ListFS_AsyncIO *this) {
+	ListFS *fs = this->file->fs;
+	ListFS_AsyncIO *holder;
+	for (holder = fs->async_writes; holder; holder = holder->next_write) {
+		if (holder->block != this->block) continue;
+		listfs_log(fs, "[%s] block = %llu is busy\n", __func__, this->block);
+		/* Waiters aren't in the list of writes, so the same link chains them */
+		ListFS_AsyncIO **link = &holder->waiters;
+		while (*link) {
+			link = &(*link)->next_write;
+		}
+		*link = this;
+		this->next_write = NULL;
+		this->pending = true;
+		return false;
+	}
+	this->next_write = fs->async_writes;
+	fs->async_writes = this;
+	return true;
+}
+
+void listfs_async_unlock_block(ListFS_AsyncIO *this) {
+	ListFS *fs = this->file->fs;
+	ListFS_AsyncIO **link = &fs->async_writes;
+	while (*link != this) {
+		link = &(*link)->next_write;
+	}
+	*link = this->next_write;
+	this->next_write = NULL;
+	ListFS_AsyncIO *waiter = this->waiters;
+	this->waiters = NULL;
+	while (waiter) {
+		ListFS_AsyncIO *next = waiter->next_write;
+		waiter->next_write = NULL;
+		/* The first waiter takes the block again, the rest queue up behind it */
+		listfs_io_complete(waiter);
+		waiter = next;
+	}
+}
+
+void listfs_async_finish(ListFS_AsyncIO *this) {
+	ListFS_OpennedFile *file = this->file;
+	listfs_file_flush_list(file);
+	if (this->write && (this->offset + this->done > file->node_header->size)) {
+		file->node_header->size = this->offset + this->done;
+#ifndef DISABLE_TIME
+		file->node_header->modify_time = time(NULL);
+#endif
+		listfs_file_write_header(file);
+	}
+	this->state = LISTFS_ASYNC_DONE;
+}
+
+void listfs_async_load_list(ListFS_AsyncIO *this) {
+	if (!this->list) {
+		this->list = listfs_get_buffer(this->file->fs);
+	}
+	this->shared_list = false;
+	this->state = LISTFS_ASYNC_LIST;
+	listfs_async_read_block(this, this->list_block, this->list);
+}
+
+void listfs_async_zero_chunk(ListFS_AsyncIO *this) {
+	memset(this->buffer + this->done, 0, this->chunk);
+	this->done += this->chunk;
+}
+
+void listfs_async_step(ListFS_AsyncIO *this) {
+	ListFS_OpennedFile *file = this->file;
+	uint32_t block_size = file->fs->block_size;
+	size_t block_list_size = block_size / sizeof(ListFS_BlockIndex);
+	uint64_t position = this->offset + this->done;
+	switch (this->state) {
+		case LISTFS_ASYNC_NEXT: {
+			size_t length = this->length;
+			if (!this->write) {
+				uint64_t size = file->node_header->size;
+				length = (this->offset < size) ? min(length, size - this->offset) : 0;
+			}
+			if (this->done >= length) {
+				listfs_async_finish(this);
+				return;
+			}
+			this->chunk = min(block_size - position % block_size, length - this->done);
+			this->bounce = (position % block_size) || (this->chunk < block_size);
+			if (this->write) {
+				listfs_file_seek(file, position, true);
+				if (!listfs_file_touch_cur_block(file, true)) {
+					listfs_async_finish(this);
+					return;
+				}
+				this->block = file->cur_block_list[file->cur_block];
+				if (!listfs_async_lock_block(this)) return;
+				if (this->bounce && !this->tmp) {
+					this->tmp = listfs_get_buffer(file->fs);
+				}
+				if (this->bounce) {
+					this->state = LISTFS_ASYNC_READ;
+					listfs_async_read_block(this, this->block, this->tmp);
+				} else {
+					this->state = LISTFS_ASYNC_WRITE;
+					listfs_async_write_block(this, this->block, this->buffer + this->done);
+				}
+				return;
+			}
+			uint64_t slot = position / block_size;
+			uint64_t number = slot / (block_list_size - 2);
+			if (this->list_block == -1) {
+				/* Start from the file cursor when it is closer than the first list */
+				uint64_t distance = (file->cur_list_number > number) ? (file->cur_list_number - number) : (number - file->cur_list_number);
+				if ((file->cur_block_list_block != -1) && (distance <= number)) {
+					this->list_block = file->cur_block_list_block;
+					this->list_number = file->cur_list_number;
+					this->shared_list = true;
+				} else if (file->node_header->data != -1) {
+					this->list_block = file->node_header->data;
+					this->list_number = 0;
+					listfs_async_load_list(this);
+					return;
+				} else {
+					listfs_async_zero_chunk(this);
+					return;
+				}
+			}
+			ListFS_BlockIndex *list = this->list;
+			if (this->shared_list) {
+				/* The list of the file cursor is used in place until the cursor leaves it */
+				if (file->cur_block_list_block != this->list_block) {
+					listfs_async_load_list(this);
+					return;
+				}
+				list = file->cur_block_list;
+			}
+			if (this->list_number != number) {
+				ListFS_BlockIndex next_list = list[(this->list_number < number) ? (block_list_size - 1) : 0];
+				if (next_list == -1) {
+					listfs_async_zero_chunk(this);
+					return;
+				}
+				this->list_block = next_list;
+				this->list_number += (this->list_number < number) ? 1 : -1;
+				listfs_async_load_list(this);
+				return;
+			}
+			this->block = list[slot % (block_list_size - 2) + 1];
+			if (this->block == -1) {
+				listfs_async_zero_chunk(this);
+				return;
+			}
+			if (this->bounce && !this->tmp) {
+				this->tmp = listfs_get_buffer(file->fs);
+			}
+			this->state = LISTFS_ASYNC_READ;
+			listfs_async_read_block(this, this->block, this->bounce ? this->tmp : this->buffer + this->done);
+			return;
+		}
+		case LISTFS_ASYNC_LIST:
+			this->state = LISTFS_ASYNC_NEXT;
+			return;
+		case LISTFS_ASYNC_READ:
+			if (this->write) {
+				memcpy(this->tmp + position % block_size, this->buffer + this->done, this->chunk);
+				this->state = LISTFS_ASYNC_WRITE;
+				listfs_async_write_block(this, this->block, this->tmp);
+				return;
+			}
+			if (this->bounce) {
+				memcpy(this->buffer + this->done, this->tmp + position % block_size, this->chunk);
+			}
+			this->done += this->chunk;
+			this->state = LISTFS_ASYNC_NEXT;
+			return;
+		case LISTFS_ASYNC_WRITE:
+			this->done += this->chunk;
+			this->state = LISTFS_ASYNC_NEXT;
+			listfs_async_unlock_block(this);
+			return;
+	}
+}
+
+void listfs_async_run(ListFS_AsyncIO *this) {
+	this->running = true;
+	while (!this->pending && (this->state != LISTFS_ASYNC_DONE)) {
+		listfs_async_step(this);
+	}
+	this->running = false;
+	if (this->state == LISTFS_ASYNC_DONE) {
+		listfs_log(this->file->fs, "[%s] done = %u\n", __func__, this->done);
+		listfs_put_buffer(this->file->fs, this->list);
+		listfs_put_buffer(this->file->fs, this->tmp);
+		this->list = NULL;
+		this->tmp = NULL;
+		if (this->callback) {
+			this->callback(this);
+		}
+	}
+}
+
+void listfs_io_complete(ListFS_AsyncIO *this) {
 	if (!this) return;
-	listfs_log(this, "[%s] node = %llu\n", __func__, node);
-	if (node == -1) return NULL;
-	ListFS_OpennedFile *file;
-	size_t i;
-	for (i = 0; i < file_info_count; i++) {
-		if (file_info[i].node == node) {
-			file_info[i].file->link_count++;
-			listfs_log(this, "[%s] This file already openned\n", __func__);
-			return file_info[i].file;
+	this->pending = false;
+	if (!this->running) {
+		listfs_async_run(this);
+	}
+}
+
+bool listfs_file_start_async(ListFS_AsyncIO *this, ListFS_OpennedFile *file, uint64_t offset, void *buffer, size_t length,
+		bool write, void (*callback)(ListFS_AsyncIO*), void *data) {
+	if (!this || !file) return false;
+	listfs_log(file->fs, "[%s] offset = %llu, length = %u, write = %u\n", __func__, offset, length, write);
+	if (write && !listfs_check_writable(file->fs, __func__)) return false;
+	memset(this, 0, sizeof(ListFS_AsyncIO));
+	this->file = file;
+	this->offset = offset;
+	this->buffer = buffer;
+	this->length = length;
+	this->write = write;
+	this->callback = callback;
+	this->data = data;
+	this->list_block = -1;
+	if (file->node_header->flags & LISTFS_NODE_FLAG_COMPRESSED) {
+		/* Clusters are decoded as a whole, so compressed files are served synchronously */
+		listfs_file_seek(file, offset, write);
+		this->done = write ? listfs_file_write(file, buffer, length) : listfs_file_read(file, buffer, length);
+		this->state = LISTFS_ASYNC_DONE;
+	} else {
+		this->state = LISTFS_ASYNC_NEXT;
+	}
+	listfs_async_run(this);
+	return true;
+}
+
+bool listfs_file_read_async(ListFS_AsyncIO *this, ListFS_OpennedFile *file, uint64_t offset, void *buffer, size_t length,
+		void (*callback)(ListFS_AsyncIO*), void *data) {
+	return listfs_file_start_async(this, file, offset, buffer, length, false, callback, data);
+}
+
+bool listfs_file_write_async(ListFS_AsyncIO *this, ListFS_OpennedFile *file, uint64_t offset, void *buffer, size_t length,
+		void (*callback)(ListFS_AsyncIO*), void *data) {
+	return listfs_file_start_async(this, file, offset, buffer, length, true, callback, data);
+}
+
+/* Relocation functions */
+
+ListFS_BlockIndex listfs_find_free_run(ListFS *this, ListFS_BlockCount count, ListFS_BlockIndex hint) {
+	if (!this) return -1;
+	listfs_log(this, "[%s] count = %llu, hint = %llu\n", __func__, count, hint);
+	if ((count == 0) || !listfs_check_writable(this, __func__) || !listfs_load_map(this)) return -1;
+	if (hint >= this->header->size) {
+		hint = 0;
+	}
+	int pass;
+	for (pass = 0; pass < 2; pass++) {
+		ListFS_BlockIndex block = pass ? 0 : hint;
+		ListFS_BlockIndex end = pass ? min(hint + count, this->header->size) : this->header->size;
+		ListFS_BlockIndex run_start = block;
+		ListFS_BlockCount run = 0;
+		while (block < end) {
+			if ((block % 8 == 0) && (this->map[block / 8] == 0xFF)) {
+				run = 0;
+				block += 8;
+			} else if (this->map[block / 8] & (1 << (block % 8))) {
+				run = 0;
+				block++;
+			} else {
+				if (run == 0) {
+					run_start = block;
+				}
+				run++;
+				block++;
+				if (run == count) {
+					listfs_log(this, "[%s] Found free run at %llu\n", __func__, run_start);
+					return run_start;
+				}
+			}
 		}
 	}
-	file = calloc(sizeof(ListFS_OpennedFile), 1);
-	file->fs = this;
-	file->node = node;
-	file->node_header = calloc(this->header->block_size, 1);
-	listfs_read_block(this, node, file->node_header);
-	if ((file->node_header->magic != LISTFS_NODE_MAGIC) || (file->node_header->flags & LISTFS_NODE_FLAG_DIRECTORY)) {
-		listfs_file_close(file);
-		return NULL;
+	listfs_log(this, "[%s] Free run not found\n", __func__);
+	return -1;
+}
+
+ListFS_BlockIndex listfs_alloc_run(ListFS *this, ListFS_BlockCount count, ListFS_BlockIndex hint) {
+	if (!this) return -1;
+	ListFS_BlockIndex start = listfs_find_free_run(this, count, hint);
+	if (start != -1) {
+		listfs_get_blocks(this, start, count);
 	}
-	file->cur_block_list_block = file->node_header->data;
-	file->cur_block_list = calloc(this->header->block_size, 1);
-	if (file->node_header->data != -1) {
-		listfs_read_block(this, file->node_header->data, file->cur_block_list);
+	return start;
+}
+
+bool listfs_relocate_node(ListFS *this, ListFS_BlockIndex node, ListFS_BlockIndex target) {
+	if (!this) return false;
+	if ((node == -1) || (target == -1)) return false;
+	listfs_log(this, "[%s] node = %llu, target = %llu\n", __func__, node, target);
+	listfs_journal_reserve(this, LISTFS_JOURNAL_OP_BLOCKS);
+	if (!listfs_check_writable(this, __func__) || !listfs_load_map(this)) return false;
+	if (this->map[target / 8] & (1 << (target % 8))) {
+		listfs_log(this, "[%s] Target block is used!\n", __func__);
+		return false;
 	}
-	file->cur_block = 1;
-	file->link_count++;
-	file_info_count++;
-	file_info = realloc(file_info, file_info_count * sizeof(FileInfo));
-	file_info[file_info_count - 1].node = node;
-	file_info[file_info_count - 1].file = file;
-	return file;
+	/* Pending aggregate changes are keyed by directory block */
+	listfs_flush_aggregates(this);
+	ListFS_NodeHeader *header = listfs_borrow_node(this, node);
+	ListFS_NodeHeader *tmp_header = listfs_get_buffer(this);
+	listfs_get_blocks(this, target, 1);
+	listfs_write_block(this, target, header);
+	if (header->prev != -1) {
+		listfs_read_block(this, header->prev, tmp_header);
+		tmp_header->next = target;
+		listfs_write_block(this, header->prev, tmp_header);
+	} else if (header->parent != -1) {
+		listfs_read_block(this, header->parent, tmp_header);
+		tmp_header->data = target;
+		listfs_write_block(this, header->parent, tmp_header);
+	} else if (this->header->root_dir == node) {
+		this->header->root_dir = target;
+	}
+	if (header->next != -1) {
+		listfs_read_block(this, header->next, tmp_header);
+		tmp_header->prev = target;
+		listfs_write_block(this, header->next, tmp_header);
+	}
+	if (header->flags & LISTFS_NODE_FLAG_DIRECTORY) {
+		ListFS_BlockIndex child = header->data;
+		while (child != -1) {
+			listfs_read_block(this, child, tmp_header);
+			tmp_header->parent = target;
+			listfs_write_block(this, child, tmp_header);
+			child = tmp_header->next;
+		}
+	}
+	ListFS_BlockIndex index = listfs_dir_index(this, header->parent);
+	if (index != -1) {
+		listfs_index_update(this, index, listfs_name_hash(header->name), node, target);
+	}
+	listfs_free_blocks(this, node, 1);
+	listfs_discard_blocks(this, node, 1);
+	listfs_put_buffer(this, tmp_header);
+	listfs_put_buffer(this, header);
+	return true;
+}
+
+bool listfs_shared_block_callback(ListFS *fs, ListFS_BlockIndex block, bool block_list, void *data) {
+	*(bool*)data = listfs_block_shared(fs, block);
+	return !*(bool*)data;
+}
+
+bool listfs_relocate_file(ListFS *this, ListFS_BlockIndex node, ListFS_BlockIndex target) {
+	if (!this) return false;
+	if ((node == -1) || (target == -1)) return false;
+	listfs_log(this, "[%s] node = %llu, target = %llu\n", __func__, node, target);
+	listfs_journal_reserve(this, LISTFS_JOURNAL_OP_BLOCKS);
+	if (!listfs_check_writable(this, __func__)) return false;
+	ListFS_NodeHeader *header = listfs_borrow_node(this, node);
+	bool shared = false;
+	if (this->refcount_chunks && !(header->flags & LISTFS_NODE_FLAG_DIRECTORY)) {
+		listfs_foreach_block(this, header->data, listfs_shared_block_callback, &shared);
+	}
+	if ((header->flags & LISTFS_NODE_FLAG_DIRECTORY) || shared) {
+		/* Moving a copy of a shared block would take it away from the clones */
+		if (shared) {
+			listfs_log(this, "[%s] File shares blocks with its clones!\n", __func__);
+		}
+		listfs_put_buffer(this, header);
+		return false;
+	}
+	size_t block_list_size = this->block_size / sizeof(ListFS_BlockIndex);
+	ListFS_BlockIndex *list = listfs_get_buffer(this);
+	uint8_t *data = listfs_get_buffer(this);
+	ListFS_FreeList free_list = {NULL, 0, 0};
+	ListFS_BlockIndex old_list = header->data;
+	ListFS_BlockIndex new_list = target;
+	ListFS_BlockIndex prev_list = -1;
+	while (old_list != -1) {
+		listfs_read_block(this, old_list, list);
+		listfs_free_list_add(&free_list, old_list);
+		ListFS_BlockIndex next_block = new_list + 1;
+		size_t i;
+		for (i = 1; i < block_list_size - 1; i++) {
+			if (list[i] == -1) continue;
+			listfs_read_block(this, list[i], data);
+			listfs_write_data_block(this, next_block, data);
+			listfs_free_list_add(&free_list, list[i]);
+			list[i] = next_block;
+			next_block++;
+		}
+		old_list = list[block_list_size - 1];
+		list[0] = prev_list;
+		list[block_list_size - 1] = (old_list != -1) ? next_block : -1;
+		listfs_write_block(this, new_list, list);
+		listfs_get_blocks(this, new_list, next_block - new_list);
+		prev_list = new_list;
+		new_list = next_block;
+	}
+	header->data = (header->data != -1) ? target : -1;
+	listfs_write_block(this, node, header);
+	listfs_free_list_commit(this, &free_list);
+	listfs_put_buffer(this, data);
+	listfs_put_buffer(this, list);
+	listfs_put_buffer(this, header);
+	return true;
+}
+
+/* Journal functions */
+
+typedef struct {
+	ListFS_BlockIndex block;
+	size_t entry;
+} ListFS_JournalEntry;
+
+int listfs_journal_entry_compare(const void *a, const void *b) {
+	ListFS_BlockIndex x = ((const ListFS_JournalEntry*)a)->block, y = ((const ListFS_JournalEntry*)b)->block;
+	return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+/* Writes the transaction out, without touching pending aggregates that callers in the middle of operation may hold */
+bool listfs_commit_transaction(ListFS *this) {
+	if (!listfs_journal_active(this) || this->committing || this->read_only) return false;
+	uint32_t block_size = this->block_size;
+	if ((this->transaction.count == 0) && (this->map_dirty_count == 0)) return false;
+	/* Reservations keep transactions within the journal, anything larger would overwrite blocks behind it */
+	ListFS_BlockCount needed = listfs_journal_blocks_needed(this, this->transaction.count + this->map_dirty_count + 1);
+	if (needed > this->ext_header->journal_size) {
+		listfs_log(this, "[%s] Transaction of %llu blocks doesn't fit journal of %llu blocks!\n", __func__, needed,
+			this->ext_header->journal_size);
+		return false;
+	}
+	listfs_log(this, "[%s] blocks = %u, map blocks = %u, frees = %u\n", __func__, this->transaction.count,
+		this->map_dirty_count, this->deferred_frees->count);
+	this->committing = true;
+	ListFS_FreeList frees = *this->deferred_frees;
+	memset(this->deferred_frees, 0, sizeof(ListFS_FreeList));
+	qsort(frees.blocks, frees.count, sizeof(ListFS_BlockIndex), listfs_free_list_compare);
+	size_t i, j;
+	for (i = 0; i < frees.count; i = j) {
+		for (j = i + 1; (j < frees.count) && (frees.blocks[j] == frees.blocks[j - 1] + 1); j++);
+		listfs_free_blocks(this, frees.blocks[i], j - i);
+	}
+	for (i = 0; this->map_dirty && (i < this->header->map_size); i++) {
+		if (this->map_dirty[i / 8] & (1 << (i % 8))) {
+			listfs_transaction_add(this, this->header->map_base + i, this->map + i * block_size);
+		}
+	}
+	listfs_transaction_add(this, 0, this->header);
+	ListFS_Transaction *transaction = &this->transaction;
+	ListFS_JournalEntry *entries = malloc(transaction->count * sizeof(ListFS_JournalEntry));
+	for (i = 0; i < transaction->count; i++) {
+		entries[i].block = transaction->blocks[i];
+		entries[i].entry = i;
+	}
+	qsort(entries, transaction->count, sizeof(ListFS_JournalEntry), listfs_journal_entry_compare);
+	size_t per_descriptor = (block_size - sizeof(ListFS_JournalBlock)) / sizeof(ListFS_BlockIndex);
+	ListFS_BlockCount total = listfs_journal_blocks_needed(this, transaction->count);
+	uint8_t *journal = calloc(total, block_size);
+	uint64_t checksum = LISTFS_CHECKSUM_INIT;
+	size_t position = 0;
+	for (i = 0; i < transaction->count; i += per_descriptor) {
+		ListFS_JournalBlock *descriptor = (void*)(journal + position * block_size);
+		descriptor->magic = LISTFS_JOURNAL_MAGIC;
+		descriptor->type = LISTFS_JOURNAL_DESCRIPTOR;
+		descriptor->sequence = this->ext_header->journal_sequence;
+		descriptor->count = min(per_descriptor, transaction->count - i);
+		for (j = 0; j < descriptor->count; j++) {
+			descriptor->blocks[j] = entries[i + j].block;
+		}
+		checksum = listfs_checksum(checksum, descriptor->blocks, descriptor->count * sizeof(ListFS_BlockIndex));
+		position++;
+		for (j = 0; j < descriptor->count; j++) {
+			memcpy(journal + position * block_size, transaction->data + entries[i + j].entry * block_size, block_size);
+			checksum = listfs_checksum(checksum, journal + position * block_size, block_size);
+			position++;
+		}
+	}
+	ListFS_JournalBlock *commit = (void*)(journal + position * block_size);
+	commit->magic = LISTFS_JOURNAL_MAGIC;
+	commit->type = LISTFS_JOURNAL_COMMIT;
+	commit->sequence = this->ext_header->journal_sequence;
+	commit->count = transaction->count;
+	commit->checksum = checksum;
+	listfs_write_raw_blocks(this, this->ext_header->journal_base, journal, total);
+	listfs_flush(this);
+	for (i = 0; i < transaction->count; i++) {
+		this->write_block_func(this, entries[i].block, transaction->data + entries[i].entry * block_size);
+	}
+	listfs_flush(this);
+	this->ext_header->journal_sequence++;
+	this->write_block_func(this, listfs_ext_header_block(this), this->ext_header);
+	for (i = 0; i < frees.count; i = j) {
+		for (j = i + 1; (j < frees.count) && (frees.blocks[j] == frees.blocks[j - 1] + 1); j++);
+		listfs_issue_discard(this, frees.blocks[i], j - i);
+	}
+	free(frees.blocks);
+	free(journal);
+	free(entries);
+	listfs_transaction_clear(this);
+	if (this->map_dirty) {
+		memset(this->map_dirty, 0, bytes_to_blocks(this->header->map_size, 8));
+	}
+	this->map_dirty_count = 0;
+	this->committing = false;
+	return true;
+}
+
+bool listfs_commit(ListFS *this, bool force) {
+	if (!this) return false;
+	if (this->committing || this->read_only) return false;
+	if (!listfs_journal_active(this)) {
+		/* Without journal, aggregates are written on forced commits and on close */
+		if (force) {
+			listfs_flush_aggregates(this);
+		}
+		return false;
+	}
+	ListFS_BlockCount needed = listfs_journal_blocks_needed(this, this->transaction.count + this->map_dirty_count + 1);
+	if (!force && (needed * 2 < this->ext_header->journal_size)) return false;
+	listfs_flush_aggregates(this);
+	return listfs_commit_transaction(this);
 }
 
-void listfs_file_close(ListFS_OpennedFile *this) {
-	if (!this) return;
-	listfs_log(this->fs, "[%s] link count = %u\n", __func__, this->link_count);
-	this->link_count--;
-	if (this->link_count == 0) {
-		size_t i;
-		for (i = 0; i < file_info_count; i++) {
-			if (file_info[i].node = this->node) {
-				memmove(&file_info[i], &file_info[i + 1], file_info_count - i - 1);
-				file_info_count--;
-				file_info = realloc(file_info, file_info_count * sizeof(FileInfo));
-				break;
+bool listfs_replay_journal(ListFS *this) {
+	if (!this) return false;
+	uint32_t block_size = this->block_size;
+	size_t per_descriptor = (block_size - sizeof(ListFS_JournalBlock)) / sizeof(ListFS_BlockIndex);
+	ListFS_BlockIndex base = this->ext_header->journal_base;
+	ListFS_JournalBlock *descriptor = malloc(block_size);
+	uint8_t *block = malloc(block_size);
+	uint64_t checksum = LISTFS_CHECKSUM_INIT;
+	ListFS_BlockCount total = 0, position = 0;
+	bool valid = false;
+	while (position < this->ext_header->journal_size) {
+		this->read_block_func(this, base + position, descriptor);
+		if ((descriptor->magic != LISTFS_JOURNAL_MAGIC) || (descriptor->sequence != this->ext_header->journal_sequence)) break;
+		if (descriptor->type == LISTFS_JOURNAL_COMMIT) {
+			valid = (descriptor->count == total) && (descriptor->checksum == checksum);
+			break;
+		}
+		if ((descriptor->type != LISTFS_JOURNAL_DESCRIPTOR) || (descriptor->count > per_descriptor)) break;
+		checksum = listfs_checksum(checksum, descriptor->blocks, descriptor->count * sizeof(ListFS_BlockIndex));
+		position += descriptor->count + 1;
+		ListFS_BlockIndex i;
+		for (i = position - descriptor->count; (i < position) && (i < this->ext_header->journal_size); i++) {
+			this->read_block_func(this, base + i, block);
+			checksum = listfs_checksum(checksum, block, block_size);
+		}
+		total += descriptor->count;
+	}
+	if (valid) {
+		listfs_log(this, "[%s] Replaying transaction %llu (%llu blocks)\n", __func__, this->ext_header->journal_sequence, total);
+		position = 0;
+		while (total) {
+			this->read_block_func(this, base + position, descriptor);
+			size_t i;
+			for (i = 0; i < descriptor->count; i++) {
+				this->read_block_func(this, base + position + 1 + i, block);
+				listfs_transaction_add(this, descriptor->blocks[i], block);
 			}
+			position += descriptor->count + 1;
+			total -= descriptor->count;
 		}
-		free(this->node_header);
-		free(this->cur_block_list);
-		free(this);
 	}
+	free(block);
+	free(descriptor);
+	return valid;
 }
 
-bool listfs_file_touch_cur_block(ListFS_OpennedFile *this, bool write) {
+bool listfs_create_journal(ListFS *this, ListFS_BlockCount size) {
 	if (!this) return false;
-	listfs_log(this->fs, "[%s] write = %u\n", __func__, write);
-	size_t block_list_size = this->fs->header->block_size / sizeof(ListFS_BlockIndex);
-	bool result = false;
-	if (this->cur_block_list_block == -1) {
-		if (write) {
-			this->cur_block_list_block = listfs_alloc_block(this->fs);
-			if (this->cur_block_list_block != -1) {
-				this->node_header->data = this->cur_block_list_block;
-				listfs_write_block(this->fs, this->node, this->node_header);
-				memset(this->cur_block_list, -1, block_list_size * sizeof(ListFS_BlockIndex));
-				listfs_write_block(this->fs, this->cur_block_list_block, this->cur_block_list);
-			}
-		}
+	listfs_log(this, "[%s] size = %llu\n", __func__, size);
+	if (!this->ext_header || listfs_journal_active(this)) return false;
+	if (size < listfs_journal_blocks_needed(this, this->header->map_size + 8)) {
+		listfs_log(this, "[%s] Journal is too small!\n", __func__);
+		return false;
+	}
+	ListFS_BlockIndex base = listfs_alloc_run(this, size, listfs_ext_header_block(this) + 1);
+	if (base == -1) return false;
+	uint8_t *tmp = listfs_get_buffer(this);
+	memset(tmp, 0, this->block_size);
+	this->write_block_func(this, base, tmp);
+	listfs_put_buffer(this, tmp);
+	this->ext_header->journal_base = base;
+	this->ext_header->journal_size = size;
+	this->ext_header->journal_sequence = 1;
+	listfs_write_raw_blocks(this, 0, this->header, 1);
+	listfs_write_map(this);
+	this->write_block_func(this, listfs_ext_header_block(this), this->ext_header);
+	listfs_flush(this);
+	return true;
+}
+
+/* Clone functions */
+
+bool listfs_create_refcounts(ListFS *this) {
+	if (this->refcount_chunks) return true;
+	if (!this->ext_header) {
+		listfs_log(this, "[%s] Volume has no extended header!\n", __func__);
+		return false;
+	}
+	size_t count = listfs_refcount_chunk_count(this);
+	ListFS_BlockCount size = bytes_to_blocks(count * sizeof(ListFS_BlockIndex), this->block_size);
+	ListFS_BlockIndex base = listfs_alloc_run(this, size, listfs_ext_header_block(this) + 1);
+	if (base == -1) {
+		listfs_log(this, "[%s] Not enough contiguous space for %llu blocks!\n", __func__, size);
+		return false;
 	}
+	this->refcount_chunks = malloc(size * this->block_size);
+	memset(this->refcount_chunks, 0xFF, size * this->block_size);
+	this->refcounts = calloc(count, sizeof(uint16_t*));
+	this->refcount_dirty = calloc(count, 1);
+	listfs_write_raw_blocks(this, base, this->refcount_chunks, size);
+	this->ext_header->refcount_base = base;
+	this->ext_header->refcount_size = size;
+	this->ext_header->flags |= LISTFS_EXT_FLAG_REFCOUNTS;
+	listfs_write_block(this, listfs_ext_header_block(this), this->ext_header);
+	return true;
+}
+
+/* Opened file state is refreshed after its data was replaced behind its back */
+void listfs_file_reload(ListFS_OpennedFile *this) {
+	listfs_read_block(this->fs, this->node, this->node_header);
+	this->stored_size = this->node_header->size;
+	this->cur_block_list_block = this->node_header->data;
+	this->cur_block_list_dirty = false;
 	if (this->cur_block_list_block != -1) {
-		if (this->cur_block == 0) {
-			if (this->cur_block_list[0] == -1) {
-				this->cur_block = 1;
-			} else {
-				this->cur_block_list_block = this->cur_block_list[0];
-				listfs_read_block(this->fs, this->cur_block_list_block, this->cur_block_list);
-				this->cur_block = block_list_size - 2;
-			}
-		} else if (this->cur_block == block_list_size - 1) {
-			if (this->cur_block_list[block_list_size - 1] == -1) {
-				if (write) {
-					this->cur_block_list[block_list_size - 1] = listfs_alloc_block(this->fs);
-					if (this->cur_block_list[block_list_size - 1] != -1) {
-						listfs_write_block(this->fs, this->cur_block_list_block, this->cur_block_list);
-						ListFS_BlockIndex prev_block_list = this->cur_block_list_block;
-						this->cur_block_list_block = this->cur_block_list[block_list_size - 1];
-						memset(this->cur_block_list + 1, -1, (block_list_size - 1) * sizeof(ListFS_BlockIndex));
-						this->cur_block_list[0] = prev_block_list;
-						listfs_write_block(this->fs, this->cur_block_list_block, this->cur_block_list);
-						this->cur_block = 1;
-					}
-				}
-			} else {
-				this->cur_block_list_block = this->cur_block_list[block_list_size - 1];
-				listfs_read_block(this->fs, this->cur_block_list_block, this->cur_block_list);
-				this->cur_block = 1;
-			}
-		}
-		if ((this->cur_block > 0) && (this->cur_block < block_list_size - 1)) {
-			if (this->cur_block_list[this->cur_block] == -1) {
-				if (write) {
-					this->cur_block_list[this->cur_block] = listfs_alloc_block(this->fs);
-					if (this->cur_block_list[this->cur_block] != -1) {
-						listfs_write_block(this->fs, this->cur_block_list_block, this->cur_block_list);
-						result = true;
-					}
-				}
-			} else {
-				result = true;
-			}
-		}
+		listfs_read_block(this->fs, this->cur_block_list_block, this->cur_block_list);
 	}
-	return result;
+	this->cur_block = 1;
+	this->cur_offset = 0;
+	this->cur_global_offset = 0;
+	this->cur_list_number = 0;
+	this->cluster_index = -1;
+	this->cluster_dirty = false;
 }
 
-bool listfs_file_switch_cur_block(ListFS_OpennedFile *this, bool prev, bool write) {
+bool listfs_clone_data(ListFS *this, ListFS_BlockIndex src, ListFS_BlockIndex dst) {
 	if (!this) return false;
-	listfs_log(this->fs, "[%s] prev = %u, write = %u\n", __func__, prev, write);
-	size_t block_list_size = this->fs->header->block_size / sizeof(ListFS_BlockIndex);
-	bool result;
-	if (prev) {
-		if (this->cur_block > 0) {
-			this->cur_block--;
-			if (this->cur_global_offset >= this->fs->header->block_size) {
- 				this->cur_global_offset -= this->fs->header->block_size;
+	listfs_log(this, "[%s] src = %llu, dst = %llu\n", __func__, src, dst);
+	listfs_journal_reserve(this, LISTFS_JOURNAL_OP_BLOCKS);
+	if ((src == -1) || (dst == -1) || !listfs_check_writable(this, __func__)) return false;
+	ListFS_OpennedFile *src_file = listfs_find_open_file(this, src);
+	ListFS_OpennedFile *dst_file = listfs_find_open_file(this, dst);
+	listfs_file_flush(src_file);
+	listfs_file_flush(dst_file);
+	ListFS_NodeHeader *header = listfs_borrow_node(this, src);
+	ListFS_NodeHeader *dst_header = listfs_borrow_node(this, dst);
+	if ((header->magic != LISTFS_NODE_MAGIC) || (dst_header->magic != LISTFS_NODE_MAGIC) ||
+			((header->flags | dst_header->flags) & LISTFS_NODE_FLAG_DIRECTORY) || (dst_header->data != -1)) {
+		listfs_log(this, "[%s] Source must be a file and destination must be an empty file!\n", __func__);
+		listfs_put_buffer(this, dst_header);
+		listfs_put_buffer(this, header);
+		return false;
+	}
+	if (!listfs_create_refcounts(this)) {
+		listfs_put_buffer(this, dst_header);
+		listfs_put_buffer(this, header);
+		return false;
+	}
+	size_t block_list_size = this->block_size / sizeof(ListFS_BlockIndex);
+	ListFS_BlockIndex *list = listfs_get_buffer(this);
+	uint8_t *tmp = NULL;
+	ListFS_BlockIndex src_list = header->data, prev_list = -1;
+	ListFS_BlockIndex new_list = (src_list != -1) ? listfs_alloc_block_near(this, dst + 1) : -1;
+	bool result = (src_list == -1) || (new_list != -1);
+	dst_header->data = new_list;
+	while ((src_list != -1) && (new_list != -1)) {
+		listfs_read_block(this, src_list, list);
+		size_t i;
+		for (i = 1; i < block_list_size - 1; i++) {
+			ListFS_BlockIndex block = list[i];
+			if (block == -1) continue;
+			uint16_t count = listfs_get_refcount(this, block);
+			if ((count < UINT16_MAX) && listfs_set_refcount(this, block, count + 1)) continue;
+			/* Reference count is saturated (or its chunk can't be allocated), this block gets a copy */
+			list[i] = listfs_alloc_block_near(this, block + 1);
+			if (list[i] == -1) {
+				result = false;
+				continue;
 			}
+			if (!tmp) {
+				tmp = listfs_get_buffer(this);
+			}
+			listfs_read_block(this, block, tmp);
+			listfs_write_data_block(this, list[i], tmp);
 		}
-	} else {
-		if (this->cur_block < block_list_size) {
- 			this->cur_block++;
+		src_list = list[block_list_size - 1];
+		ListFS_BlockIndex next_list = (src_list != -1) ? listfs_alloc_block_near(this, new_list + 1) : -1;
+		if ((src_list != -1) && (next_list == -1)) {
+			result = false;
 		}
+		list[0] = prev_list;
+		list[block_list_size - 1] = next_list;
+		listfs_write_block(this, new_list, list);
+		prev_list = new_list;
+		new_list = next_list;
 	}
-	result = listfs_file_touch_cur_block(this, write);
-	if (result && !prev) {
-		this->cur_global_offset += this->fs->header->block_size;
+	listfs_put_buffer(this, tmp);
+	listfs_put_buffer(this, list);
+	listfs_flush_refcounts(this);
+	if (!result) {
+		/* Volume is full, blocks the partial clone got are given back (shared ones lose their new reference) */
+		ListFS_FreeList free_list = {NULL, 0, 0};
+		listfs_foreach_block(this, dst_header->data, listfs_free_list_callback, &free_list);
+		listfs_free_list_commit(this, &free_list);
+		dst_header->data = -1;
+	}
+	ListFS_Aggregates before, after;
+	listfs_node_aggregates(this, dst_header, &before);
+	dst_header->size = result ? header->size : 0;
+	dst_header->flags = (dst_header->flags & ~LISTFS_NODE_FLAG_COMPRESSED) | (header->flags & LISTFS_NODE_FLAG_COMPRESSED);
+#ifndef DISABLE_TIME
+	dst_header->modify_time = time(NULL);
+#endif
+	listfs_node_aggregates(this, dst_header, &after);
+	listfs_update_aggregates(this, dst_header->parent, &before, &after);
+	listfs_write_block(this, dst, dst_header);
+	if (dst_file) {
+		listfs_file_reload(dst_file);
 	}
+	listfs_put_buffer(this, dst_header);
+	listfs_put_buffer(this, header);
 	return result;
 }
 
-void listfs_file_seek(ListFS_OpennedFile *this, uint64_t offset, bool write) {
-	if (!this) return;
-	listfs_log(this->fs, "[%s] offset = %llu, write = %u\n", __func__, offset, write);
-	while (this->cur_global_offset / this->fs->header->block_size > offset / this->fs->header->block_size) {
-		if (!listfs_file_switch_cur_block(this, true, write)) break;
+ListFS_BlockIndex listfs_clone_file(ListFS *this, ListFS_BlockIndex src, ListFS_BlockIndex dst_parent, uint8_t *name) {
+	if (!this) return -1;
+	listfs_log(this, "[%s] src = %llu, dst_parent = %llu, name = '%s'\n", __func__, src, dst_parent, name);
+	if (src == -1) return -1;
+	ListFS_NodeHeader *header = listfs_borrow_node(this, src);
+	uint32_t flags = header->flags;
+	listfs_put_buffer(this, header);
+	if (flags & LISTFS_NODE_FLAG_DIRECTORY) return -1;
+	ListFS_BlockIndex node = listfs_create_node(this, name, flags & LISTFS_NODE_FLAG_COMPRESSED, dst_parent);
+	if (node == -1) return -1;
+	if (!listfs_clone_data(this, src, node)) {
+		listfs_delete_tree(this, node);
+		return -1;
 	}
-	while (this->cur_global_offset / this->fs->header->block_size < offset / this->fs->header->block_size) {
-		if (!listfs_file_switch_cur_block(this, false, write)) break;
+	return node;
+}
+
+/* Read-only cache functions */
+
+/*
+	Volumes opened with read_only set never change, so path lookups and node information (header and
+	data block indices) are cached until listfs_close. Entries are immutable once published and are pushed
+	to bucket heads with compare-and-swap, so these functions may be called from any number of threads
+	without locking. Two threads missing the same entry may both publish it, lookups return either one.
+*/
+
+#define LISTFS_CACHE_BUCKETS 4096
+
+struct _ListFS_PathInfo {
+	ListFS_PathInfo *next;
+	uint64_t hash;
+	ListFS_BlockIndex node;
+	uint8_t path[];
+};
+
+ListFS_BlockIndex listfs_lookup_node(ListFS *this, uint8_t *path) {
+	if (!this) return -1;
+	listfs_log(this, "[%s] path = '%s'\n", __func__, path);
+	if (!this->read_only) {
+		return listfs_search_node(this, path, this->header->root_dir);
 	}
- 	this->cur_offset = offset % this->fs->header->block_size;
-	this->cur_global_offset = offset;
-	if ((this->cur_global_offset > this->node_header->size) && write) {
-		this->node_header->size = this->cur_global_offset;
-		listfs_write_block(this->fs, this->node, this->node_header);
+	size_t length = strlen(path);
+	uint64_t hash = listfs_checksum(LISTFS_CHECKSUM_INIT, path, length);
+	ListFS_PathInfo **bucket = &this->path_cache[hash % LISTFS_CACHE_BUCKETS];
+	ListFS_PathInfo *info;
+	for (info = __atomic_load_n(bucket, __ATOMIC_ACQUIRE); info; info = info->next) {
+		if ((info->hash == hash) && (strcmp(info->path, path) == 0)) {
+			return info->node;
+		}
 	}
+	info = malloc(sizeof(ListFS_PathInfo) + length + 1);
+	info->hash = hash;
+	info->node = listfs_search_node(this, path, this->header->root_dir);
+	memcpy(info->path, path, length + 1);
+	info->next = __atomic_load_n(bucket, __ATOMIC_ACQUIRE);
+	while (!__atomic_compare_exchange_n(bucket, &info->next, info, true, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+	return info->node;
 }
 
-void listfs_file_truncate(ListFS_OpennedFile *this) {
-	if (!this) return;
-	listfs_log(this->fs, "[%s]\n", __func__);
-	ListFS_BlockIndex cur_list = this->cur_block_list_block;
-	if (cur_list == -1) return;
-	size_t cur_block = this->cur_block;
-	if (this->cur_offset > 0) {
-		cur_block++;
+ListFS_NodeInfo *listfs_get_node_info(ListFS *this, ListFS_BlockIndex node) {
+	if (!this) return NULL;
+	listfs_log(this, "[%s] node = %llu\n", __func__, node);
+	if (!this->read_only) {
+		listfs_log(this, "[%s] Node cache is available only on read-only volumes!\n", __func__);
+		return NULL;
 	}
-	size_t block_list_size = this->fs->header->block_size / sizeof(ListFS_BlockIndex);
-	ListFS_BlockIndex *list = malloc(block_list_size * sizeof(ListFS_BlockIndex));
-	listfs_read_block(this->fs, cur_list, list);
-	size_t free_blocks = 0;
-	while (true) {
-		if (cur_block == block_list_size - 1) {
-			if (free_blocks == block_list_size - 2) {
-				listfs_free_blocks(this->fs, cur_list, 1);
-				if (list[0] == -1) {
-					this->node_header->data = -1;
-					this->cur_block_list_block = -1;
-					listfs_write_block(this->fs, this->node, this->node_header);
-				} else {
-					ListFS_BlockIndex *prev_list = malloc(block_list_size * sizeof(ListFS_BlockIndex));
-					listfs_read_block(this->fs, list[0], prev_list);
-					list[block_list_size - 1] = -1;
-					listfs_write_block(this->fs, list[0], prev_list);
-					free(prev_list);
-				}
-			} else {
-				listfs_write_block(this->fs, cur_list, list);
-			}
-			cur_list = list[cur_block];
-			if (cur_list == -1) {
-				break;
-			}
-			listfs_read_block(this->fs, cur_list, list);
-			cur_block = 1;
-			free_blocks = 0;
+	if (node == -1) return NULL;
+	ListFS_NodeInfo **bucket = &this->node_cache[(node * 0x9E3779B97F4A7C15ULL) % LISTFS_CACHE_BUCKETS];
+	ListFS_NodeInfo *info;
+	for (info = __atomic_load_n(bucket, __ATOMIC_ACQUIRE); info; info = info->next) {
+		if (info->node == node) return info;
+	}
+	ListFS_NodeHeader *header = listfs_borrow_node(this, node);
+	if (header->magic != LISTFS_NODE_MAGIC) {
+		listfs_log(this, "[%s] Node %llu is corrupted!\n", __func__, node);
+		listfs_put_buffer(this, header);
+		return NULL;
+	}
+	info = calloc(sizeof(ListFS_NodeInfo), 1);
+	info->node = node;
+	info->header = header;
+	if (!(header->flags & LISTFS_NODE_FLAG_DIRECTORY)) {
+		uint32_t block_size = this->block_size;
+		size_t list_size = block_size / sizeof(ListFS_BlockIndex);
+		if (header->flags & LISTFS_NODE_FLAG_COMPRESSED) {
+			size_t cluster_blocks = listfs_cluster_blocks(block_size);
+			info->block_count = bytes_to_blocks(header->size, (cluster_blocks - 1) * (uint64_t)block_size) * cluster_blocks;
 		} else {
-			if (list[cur_block] != -1) {
-				listfs_free_blocks(this->fs, list[cur_block], 1);
-				list[cur_block] = -1;
+			info->block_count = bytes_to_blocks(header->size, block_size);
+		}
+		info->blocks = malloc(info->block_count * sizeof(ListFS_BlockIndex));
+		memset(info->blocks, 0xFF, info->block_count * sizeof(ListFS_BlockIndex));
+		ListFS_BlockIndex *list = listfs_get_buffer(this);
+		ListFS_BlockIndex list_block = header->data;
+		uint64_t count = 0;
+		while ((list_block != -1) && (count < info->block_count)) {
+			listfs_read_block(this, list_block, list);
+			size_t i;
+			for (i = 1; (i < list_size - 1) && (count < info->block_count); i++) {
+				info->blocks[count++] = list[i];
 			}
-			free_blocks++;
-			cur_block++;
+			list_block = list[list_size - 1];
 		}
+		listfs_put_buffer(this, list);
 	}
-	free(list);
-	this->node_header->size = this->cur_global_offset;
-#ifndef DISABLE_TIME
-	this->node_header->modify_time = time(NULL);
-#endif
-	listfs_write_block(this->fs, this->node, this->node_header);
-	if (this->cur_block_list_block != -1) {
-		listfs_read_block(this->fs, this->cur_block_list_block, this->cur_block_list);
+	info->next = __atomic_load_n(bucket, __ATOMIC_ACQUIRE);
+	while (!__atomic_compare_exchange_n(bucket, &info->next, info, true, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+	return info;
+}
+
+void listfs_node_load_cluster(ListFS *this, ListFS_NodeInfo *info, uint64_t index, uint8_t *stored, uint8_t *cluster) {
+	uint32_t block_size = this->block_size;
+	size_t cluster_blocks = listfs_cluster_blocks(block_size);
+	size_t cluster_size = (cluster_blocks - 1) * block_size;
+	uint64_t slot = index * cluster_blocks;
+	size_t length = 0;
+	if ((slot < info->block_count) && (info->blocks[slot] != -1)) {
+		listfs_read_block(this, info->blocks[slot], stored);
+		uint32_t stored_length;
+		memcpy(&stored_length, stored, sizeof(stored_length));
+		size_t count = min(bytes_to_blocks(sizeof(stored_length) + (stored_length & ~LISTFS_CLUSTER_STORED), block_size), cluster_blocks);
+		size_t i;
+		for (i = 1; i < count; i++) {
+			if ((slot + i >= info->block_count) || (info->blocks[slot + i] == -1)) break;
+			listfs_read_block(this, info->blocks[slot + i], stored + i * block_size);
+		}
+		length = (i == count) ? listfs_decode_cluster(block_size, stored, cluster) : -1;
+		if (length == -1) {
+			listfs_log(this, "[%s] Cluster %llu of node %llu is corrupted!\n", __func__, index, info->node);
+			length = 0;
+		}
 	}
+	memset(cluster + length, 0, cluster_size - length);
 }
 
-size_t listfs_file_write(ListFS_OpennedFile *this, void *buffer, size_t length) {
-	if (!this) return 0;
-	listfs_log(this->fs, "[%s] length = %u\n", __func__, length);
+size_t listfs_node_read(ListFS *this, ListFS_NodeInfo *info, uint64_t offset, void *buffer, size_t length) {
+	if (!this || !info) return 0;
+	listfs_log(this, "[%s] node = %llu, offset = %llu, length = %u\n", __func__, info->node, offset, length);
+	if ((info->header->flags & LISTFS_NODE_FLAG_DIRECTORY) || (offset >= info->header->size)) return 0;
+	uint32_t block_size = this->block_size;
+	length = min(length, info->header->size - offset);
 	size_t count = 0;
-	uint8_t *tmp = calloc(this->fs->header->block_size, 1);
-	while (length) {
-		if (!listfs_file_touch_cur_block(this, true)) break;
-		if ((this->cur_offset > 0) || (length < this->fs->header->block_size)) {
-			listfs_read_block(this->fs, this->cur_block_list[this->cur_block], tmp);
-		}
-		size_t c = min(this->fs->header->block_size - this->cur_offset, length);
-		listfs_log(this->fs, "[%s] We writing %u bytes of data at offset %u now\n", __func__, c, this->cur_offset);
-		memmove(tmp + this->cur_offset, buffer, c);
-		listfs_write_block(this->fs, this->cur_block_list[this->cur_block], tmp);
-		buffer += c;
-		length -= c;
-		count += c;
-		this->cur_offset += c;
-		this->cur_global_offset += c;
-		if (this->cur_offset >= this->fs->header->block_size) {
-			this->cur_block++;
-			this->cur_offset = 0;
+	if (info->header->flags & LISTFS_NODE_FLAG_COMPRESSED) {
+		size_t cluster_blocks = listfs_cluster_blocks(block_size);
+		size_t cluster_size = (cluster_blocks - 1) * block_size;
+		uint8_t *stored = malloc(cluster_blocks * block_size);
+		uint8_t *cluster = malloc(cluster_size);
+		while (count < length) {
+			size_t position = offset % cluster_size;
+			size_t c = min(cluster_size - position, length - count);
+			listfs_node_load_cluster(this, info, offset / cluster_size, stored, cluster);
+			memcpy(buffer + count, cluster + position, c);
+			count += c;
+			offset += c;
 		}
+		free(cluster);
+		free(stored);
+		return count;
 	}
-	free (tmp);
-	if (this->cur_global_offset > this->node_header->size) {
-		this->node_header->size = this->cur_global_offset;
-#ifndef DISABLE_TIME
-		this->node_header->modify_time = time(NULL);
-#endif
-		listfs_write_block(this->fs, this->node, this->node_header);
+	uint8_t *tmp = NULL;
+	while (count < length) {
+		uint64_t index = offset / block_size;
+		size_t position = offset % block_size;
+		size_t c = min(block_size - position, length - count);
+		ListFS_BlockIndex block = (index < info->block_count) ? info->blocks[index] : -1;
+		if (block == -1) {
+			memset(buffer + count, 0, c);
+		} else if (c == block_size) {
+			listfs_read_block(this, block, buffer + count);
+		} else {
+			if (!tmp) {
+				tmp = listfs_get_buffer(this);
+			}
+			listfs_read_block(this, block, tmp);
+			memcpy(buffer + count, tmp + position, c);
+		}
+		count += c;
+		offset += c;
 	}
+	listfs_put_buffer(this, tmp);
 	return count;
 }
 
-size_t listfs_file_read(ListFS_OpennedFile *this, void *buffer, size_t length) {
-	if (!this) return 0;
-	listfs_log(this->fs, "[%s] length = %u\n", __func__, length);
-	size_t count = 0;
-	uint8_t *tmp = calloc(this->fs->header->block_size, 1);
-	length = min(length, this->node_header->size - this->cur_global_offset);
-	while (length) {
-		if (!listfs_file_touch_cur_block(this, false)) break;
-		listfs_read_block(this->fs, this->cur_block_list[this->cur_block], tmp);
-		size_t c = min(this->fs->header->block_size - this->cur_offset, length);
-		listfs_log(this->fs, "[%s] We reading %u bytes of data at offset %u now\n", __func__, c, this->cur_offset);
-		memmove(buffer, tmp + this->cur_offset, c);
-		buffer += c;
-		length -= c;
-		count += c;
-		this->cur_offset += c;
-		this->cur_global_offset += c;
-		if (this->cur_offset >= this->fs->header->block_size) {
-			this->cur_block++;
-			this->cur_offset = 0;
+void listfs_free_caches(ListFS *this) {
+	size_t i;
+	for (i = 0; this->node_cache && (i < LISTFS_CACHE_BUCKETS); i++) {
+		while (this->node_cache[i]) {
+			ListFS_NodeInfo *info = this->node_cache[i];
+			this->node_cache[i] = info->next;
+			free(info->blocks);
+			listfs_put_buffer(this, info->header);
+			free(info);
 		}
 	}
-	free (tmp);
-	return count;
+	for (i = 0; this->path_cache && (i < LISTFS_CACHE_BUCKETS); i++) {
+		while (this->path_cache[i]) {
+			ListFS_PathInfo *info = this->path_cache[i];
+			this->path_cache[i] = info->next;
+			free(info);
+		}
+	}
+	free(this->node_cache);
+	free(this->path_cache);
 }
 
 /* Main functions */
@@ -655,55 +3829,239 @@ ListFS *listfs_init(void (*read_block_func)(ListFS*, ListFS_BlockIndex, void*),
 	this->read_block_func = read_block_func;
 	this->write_block_func = write_block_func;
 	this->log_func = log_func;
+	this->deferred_frees = calloc(sizeof(ListFS_FreeList), 1);
 	return this;
 }
 
-void listfs_create(ListFS *this, ListFS_BlockCount size, uint16_t block_size, void *bootloader, size_t bootloader_size) {
-	if (!this) return;
-	listfs_log(this, "[%s] size = %llu, block_size = %u, bootloader_size = %u\n", __func__, size, block_size, bootloader_size);
-	this->header = calloc(max(bootloader_size, block_size), 1);
+#define LISTFS_FORMAT_CHUNK (1024 * 1024)
+
+/*
+	Writes an empty volume and leaves it open. The bitmap is written through a buffer of up to
+	LISTFS_FORMAT_CHUNK bytes, so formatting takes the same memory for any volume size, and is only read
+	back by listfs_load_map once something is allocated. If the volume is known to read as zeros (e.g.
+	a freshly truncated sparse image), all-zero bitmap chunks are skipped. Discard asks the device to
+	drop its old contents first.
+*/
+bool listfs_format(ListFS *this, ListFS_BlockCount size, uint32_t block_size, void *bootloader, size_t bootloader_size,
+		bool discard, bool zeroed) {
+	if (!this) return false;
+	listfs_log(this, "[%s] size = %llu, block_size = %u, bootloader_size = %u, discard = %i, zeroed = %i\n", __func__,
+		size, block_size, bootloader_size, discard, zeroed);
+	ListFS_BlockCount map_base = bytes_to_blocks(bootloader_size ? bootloader_size : sizeof(ListFS_Header), block_size);
+	ListFS_BlockCount map_size = bytes_to_blocks(bytes_to_blocks(size, 8), block_size);
+	ListFS_BlockCount reserved = map_base + map_size + 1;
+	if (size <= reserved) {
+		listfs_log(this, "[%s] Volume is too small!\n", __func__);
+		return false;
+	}
+	this->header = calloc(map_base, block_size);
 	if (bootloader) {
 		memmove(this->header, bootloader, bootloader_size);
 	}
-	this->header->magic = LISTFS_MAGIC;
+	this->header->magic = (block_size > UINT16_MAX) ? LISTFS_LARGE_MAGIC : LISTFS_MAGIC;
 	this->header->version = (LISTFS_VERSION_MAJOR << 8) | LISTFS_VERSION_MINOR;
 	this->header->base = 0;
 	this->header->size = size;
-	this->header->map_base = bytes_to_blocks(bootloader_size ? bootloader_size : sizeof(ListFS_Header), block_size);
-	this->header->map_size = bytes_to_blocks(bytes_to_blocks(size, 8), block_size);
-	this->header->block_size = block_size;
-	this->header->used_blocks = 0;
-	this->map = calloc(block_size, this->header->map_size);
-	listfs_get_blocks(this, 0, this->header->map_base + this->header->map_size);
+	this->header->map_base = map_base;
+	this->header->map_size = map_size;
+	this->header->block_size = listfs_encode_block_size(block_size);
+	this->header->used_blocks = reserved;
 	this->header->root_dir = -1;
-	listfs_write_blocks(this, 0, this->header, this->header->map_base);
-	uint8_t tmp[block_size];
-	listfs_write_block(this, size - 1, &tmp);
+	this->block_size = block_size;
+	if (discard) {
+		listfs_issue_discard(this, 0, size);
+	}
+	listfs_write_raw_blocks(this, 0, this->header, map_base);
+	/* Header, bitmap and extended header blocks at the start are marked used */
+	size_t chunk_blocks = max(min(map_size, LISTFS_FORMAT_CHUNK / block_size), 1), i;
+	uint8_t *chunk = malloc(chunk_blocks * block_size);
+	for (i = 0; i < map_size; i += chunk_blocks) {
+		size_t count = min(chunk_blocks, map_size - i);
+		ListFS_BlockIndex first = i * block_size * 8;
+		if (zeroed && (first >= reserved)) break;
+		memset(chunk, 0, count * block_size);
+		if (first < reserved) {
+			ListFS_BlockCount bits = min(reserved - first, count * block_size * 8);
+			memset(chunk, 0xFF, bits / 8);
+			if (bits % 8) {
+				chunk[bits / 8] = (1 << (bits % 8)) - 1;
+			}
+		}
+		listfs_write_raw_blocks(this, map_base + i, chunk, count);
+	}
+	free(chunk);
+	this->ext_header = calloc(1, block_size);
+	this->ext_header->magic = LISTFS_EXT_MAGIC;
+	this->ext_header->flags = LISTFS_EXT_FLAG_MOUNTED;
+	listfs_write_raw_blocks(this, listfs_ext_header_block(this), this->ext_header, 1);
+	if (!zeroed) {
+		/* Extends an image file to its full size */
+		uint8_t *zero = calloc(1, block_size);
+		listfs_write_raw_blocks(this, size - 1, zero, 1);
+		free(zero);
+	}
+	listfs_flush(this);
+	return true;
+}
+
+void listfs_create(ListFS *this, ListFS_BlockCount size, uint32_t block_size, void *bootloader, size_t bootloader_size) {
+	if (!this) return;
+	listfs_log(this, "[%s] size = %llu, block_size = %u, bootloader_size = %u\n", __func__, size, block_size, bootloader_size);
+	listfs_format(this, size, block_size, bootloader, bootloader_size, false, false);
 }
 
 bool listfs_open(ListFS *this) {
 	if (!this) return;
 	listfs_log(this, "[%s]\n", __func__);
 	this->header = malloc(sizeof(ListFS_Header));
-	this->header->block_size = sizeof(ListFS_Header);
+	this->block_size = sizeof(ListFS_Header);
 	this->header->base = 0;
 	listfs_read_block(this, 0, this->header);
-	if (this->header->magic != LISTFS_MAGIC) {
+	if ((this->header->magic != LISTFS_MAGIC) && (this->header->magic != LISTFS_LARGE_MAGIC)) {
 		listfs_log(this, "[%s] This is not ListFS!\n", __func__);
 		return false;
 	}
-	this->header = realloc(this->header, this->header->block_size);
+	if ((this->header->version >> 8) > LISTFS_VERSION_MAJOR) {
+		listfs_log(this, "[%s] Version %i.%i is not supported!\n", __func__, this->header->version >> 8,
+			this->header->version & 0xFF);
+		return false;
+	}
+	this->block_size = listfs_decode_block_size(this->header->block_size);
+	bool large = (this->header->block_size < LISTFS_MIN_BLOCK_SIZE);
+	if (!listfs_valid_block_size(this->block_size) || (large && (this->header->version < 0x0102)) ||
+			(large != (this->header->magic == LISTFS_LARGE_MAGIC))) {
+		listfs_log(this, "[%s] Invalid block size!\n", __func__);
+		return false;
+	}
+	this->header = realloc(this->header, this->block_size);
 	listfs_read_block(this, 0, this->header);
-	this->map = calloc(this->header->block_size, this->header->map_size);
-	listfs_read_blocks(this, this->header->map_base, this->map, this->header->map_size);
+	if (this->header->version >= 0x0101) {
+		this->ext_header = malloc(this->block_size);
+		listfs_read_block(this, listfs_ext_header_block(this), this->ext_header);
+		if (this->ext_header->magic != LISTFS_EXT_MAGIC) {
+			listfs_log(this, "[%s] Extended header is corrupted!\n", __func__);
+			free(this->ext_header);
+			this->ext_header = NULL;
+		}
+	}
+	bool replayed = listfs_journal_active(this) && listfs_replay_journal(this);
+	if (replayed) {
+		listfs_read_block(this, 0, this->header);
+		listfs_read_block(this, listfs_ext_header_block(this), this->ext_header);
+	}
+	bool unclean = this->ext_header && (this->ext_header->flags & LISTFS_EXT_FLAG_MOUNTED);
+	if (this->read_only) {
+		this->index_untrusted = unclean;
+		/* Replayed transaction is never committed, listfs_read_block keeps serving it from memory */
+		this->node_cache = calloc(LISTFS_CACHE_BUCKETS, sizeof(ListFS_NodeInfo*));
+		this->path_cache = calloc(LISTFS_CACHE_BUCKETS, sizeof(ListFS_PathInfo*));
+		return true;
+	}
+	listfs_load_map(this);
+	if (replayed) {
+		listfs_commit(this, true);
+	}
+	if (this->ext_header) {
+		/* Flag is written right away (not through journal), it is cleared by listfs_close */
+		this->ext_header->flags |= LISTFS_EXT_FLAG_MOUNTED;
+		this->write_block_func(this, listfs_ext_header_block(this), this->ext_header);
+		if (unclean) {
+			listfs_log(this, "[%s] Volume wasn't closed cleanly\n", __func__);
+			listfs_verify_indexes(this);
+		}
+	}
 	return true;
 }
 
+/*
+	Read-only volumes skip the bitmap at open, checkers that need it load it on demand. Reference counts
+	are loaded as a whole, so that checker threads only ever read them. Freshly formatted volumes load
+	the bitmap and allocation groups on first allocation.
+*/
+bool listfs_load_map(ListFS *this) {
+	if (!this) return false;
+	if (this->map) return true;
+	listfs_log(this, "[%s]\n", __func__);
+	this->map = malloc(this->header->map_size * this->block_size);
+	if (!this->map) return false;
+	listfs_read_blocks(this, this->header->map_base, this->map, this->header->map_size);
+	if (this->read_only) {
+		return listfs_load_refcounts(this, true);
+	}
+	this->map_dirty = calloc(bytes_to_blocks(this->header->map_size, 8), 1);
+	listfs_init_groups(this);
+	return this->map_dirty && this->groups && listfs_load_refcounts(this, false);
+}
+
 void listfs_close(ListFS *this) {
 	if (!this) return;
 	listfs_log(this, "[%s]\n", __func__);
-	listfs_write_block(this, 0, this->header);
-	listfs_write_blocks(this, this->header->map_base, this->map, this->header->map_size);
+	listfs_flush_aggregates(this);
+	listfs_flush_refcounts(this);
+	if (this->read_only) {
+		listfs_free_caches(this);
+	} else if (listfs_journal_active(this)) {
+		listfs_commit(this, true);
+	} else {
+		listfs_write_block(this, 0, this->header);
+		listfs_write_map(this);
+	}
+	if (!this->read_only && this->ext_header) {
+		this->ext_header->flags &= ~LISTFS_EXT_FLAG_MOUNTED;
+		this->write_block_func(this, listfs_ext_header_block(this), this->ext_header);
+	}
+	if (this->refcounts) {
+		size_t i, count = listfs_refcount_chunk_count(this);
+		for (i = 0; i < count; i++) {
+			free(this->refcounts[i]);
+		}
+	}
+	free(this->transaction.blocks);
+	free(this->transaction.data);
+	free(this->transaction.hash);
+	free(this->deferred_frees->blocks);
+	free(this->deferred_frees);
+	free(this->aggregate_deltas);
+	free(this->file_info);
+	free(this->ext_header);
+	free(this->header);
+	free(this->groups);
+	free(this->refcount_dirty);
+	free(this->refcounts);
+	free(this->refcount_chunks);
+	free(this->map_dirty);
 	free(this->map);
+	listfs_free_pool(this);
 	free(this);
-}
\ No newline at end of file
+}
+
+ListFS_BlockCount listfs_trim(ListFS *this) {
+	if (!this) return 0;
+	listfs_log(this, "[%s]\n", __func__);
+	if (!listfs_check_writable(this, __func__) || !listfs_load_map(this)) return 0;
+	ListFS_BlockCount discarded = 0;
+	ListFS_BlockIndex block = 0;
+	while (block < this->header->size) {
+		if ((block % 8 == 0) && (this->map[block / 8] == 0xFF)) {
+			block += 8;
+			continue;
+		}
+		if (this->map[block / 8] & (1 << (block % 8))) {
+			block++;
+			continue;
+		}
+		ListFS_BlockIndex start = block;
+		while (block < this->header->size) {
+			if ((block % 8 == 0) && (this->map[block / 8] == 0) && (block + 8 <= this->header->size)) {
+				block += 8;
+			} else if ((this->map[block / 8] & (1 << (block % 8))) == 0) {
+				block++;
+			} else {
+				break;
+			}
+		}
+		listfs_issue_discard(this, start, block - start);
+		discarded += block - start;
+	}
+	return discarded;
+}
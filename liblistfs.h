@@ -5,14 +5,82 @@
 #include <stdbool.h>
 #include "listfs.h"
 
+typedef struct {
+	ListFS_BlockIndex cursor;
+	ListFS_BlockCount free_blocks;
+	unsigned int writers;
+} ListFS_AllocGroup;
+
+typedef struct {
+	ListFS_BlockIndex *blocks;
+	uint8_t *data;
+	size_t count;
+	size_t capacity;
+	size_t *hash;
+	size_t hash_size;
+} ListFS_Transaction;
+
+/* Head of the buffer pool stack, tag is bumped by every change so that a stale head never compares equal */
+typedef struct {
+	void *top;
+	uintptr_t tag;
+} __attribute__((aligned(2 * sizeof(void*)))) ListFS_BufferPool;
+
 typedef struct _ListFS ListFS;
+typedef struct _ListFS_FreeList ListFS_FreeList;
+typedef struct _ListFS_AsyncIO ListFS_AsyncIO;
+typedef struct _ListFS_PathInfo ListFS_PathInfo;
+typedef struct _ListFS_AggregateDelta ListFS_AggregateDelta;
+typedef struct _ListFS_FileInfo ListFS_FileInfo;
+
+typedef struct _ListFS_NodeInfo ListFS_NodeInfo;
+struct _ListFS_NodeInfo {
+	ListFS_NodeInfo *next;
+	ListFS_BlockIndex node;
+	ListFS_NodeHeader *header;
+	ListFS_BlockIndex *blocks;
+	uint64_t block_count;
+};
+
 struct _ListFS {
 	void (*read_block_func)(ListFS*, ListFS_BlockIndex, void*);
 	void (*write_block_func)(ListFS*, ListFS_BlockIndex, void*);
 	void (*log_func)(ListFS*, char *fmt, va_list args);
+	void (*discard_func)(ListFS*, ListFS_BlockIndex, ListFS_BlockCount);
+	void (*write_blocks_func)(ListFS*, ListFS_BlockIndex, void*, ListFS_BlockCount);
+	void (*read_blocks_func)(ListFS*, ListFS_BlockIndex, void*, ListFS_BlockCount);
+	void (*flush_func)(ListFS*);
+	void (*read_block_async_func)(ListFS*, ListFS_BlockIndex, void*, ListFS_AsyncIO*);
+	void (*write_block_async_func)(ListFS*, ListFS_BlockIndex, void*, ListFS_AsyncIO*);
 	ListFS_Header *header;
+	ListFS_ExtHeader *ext_header;
+	uint32_t block_size;
 	uint8_t *map;
 	ListFS_BlockIndex last_allocated_block;
+	ListFS_AllocGroup *groups;
+	size_t group_count;
+	ListFS_BlockCount group_size;
+	ListFS_Transaction transaction;
+	uint8_t *map_dirty;
+	size_t map_dirty_count;
+	ListFS_FreeList *deferred_frees;
+	bool committing;
+	bool read_only;
+	bool index_untrusted;
+	ListFS_BlockIndex *refcount_chunks;
+	uint16_t **refcounts;
+	uint8_t *refcount_dirty;
+	size_t refcount_dirty_count;
+	ListFS_NodeInfo **node_cache;
+	ListFS_PathInfo **path_cache;
+	ListFS_BufferPool buffer_pool;
+	ListFS_AggregateDelta *aggregate_deltas;
+	size_t aggregate_delta_count;
+	size_t aggregate_delta_capacity;
+	ListFS_AsyncIO *async_writes;
+	ListFS_FileInfo *file_info;
+	size_t file_info_count;
+	size_t file_info_capacity;
 };
 
 typedef struct {
@@ -22,31 +90,116 @@ typedef struct {
 	uint64_t cur_global_offset;
 	ListFS_BlockIndex cur_block_list_block;
 	ListFS_BlockIndex *cur_block_list;
+	bool cur_block_list_dirty;
 	uint32_t cur_block;
 	uint32_t cur_offset;
 	unsigned int link_count;
+	ListFS_BlockIndex alloc_hint;
+	size_t alloc_group;
+	uint64_t cur_list_number;
+	uint8_t *cluster;
+	uint64_t cluster_index;
+	bool cluster_dirty;
+	uint64_t stored_size;
 } ListFS_OpennedFile;
 
+struct _ListFS_AsyncIO {
+	ListFS_OpennedFile *file;
+	uint64_t offset;
+	uint8_t *buffer;
+	size_t length;
+	size_t done;
+	bool write;
+	void (*callback)(ListFS_AsyncIO*);
+	void *data;
+	int state;
+	bool running;
+	bool pending;
+	bool bounce;
+	ListFS_BlockIndex block;
+	size_t chunk;
+	uint64_t list_number;
+	ListFS_BlockIndex list_block;
+	ListFS_BlockIndex *list;
+	bool shared_list;
+	uint8_t *tmp;
+	ListFS_AsyncIO *next_write;
+	ListFS_AsyncIO *waiters;
+};
+
 ListFS *listfs_init(void (*read_block_func)(ListFS*, ListFS_BlockIndex, void*),
 	void (*write_block_func)(ListFS*, ListFS_BlockIndex, void*), void (*log_func)(ListFS*, char*, va_list));
-void listfs_create(ListFS *this, ListFS_BlockCount size, uint16_t block_size, void *bootloader, size_t bootloader_size);
+bool listfs_valid_block_size(uint32_t block_size);
+void listfs_read_block(ListFS *this, ListFS_BlockIndex index, void *buffer);
+void listfs_create(ListFS *this, ListFS_BlockCount size, uint32_t block_size, void *bootloader, size_t bootloader_size);
+bool listfs_format(ListFS *this, ListFS_BlockCount size, uint32_t block_size, void *bootloader, size_t bootloader_size,
+	bool discard, bool zeroed);
 bool listfs_open(ListFS *this);
+bool listfs_load_map(ListFS *this);
 void listfs_close(ListFS *this);
+ListFS_BlockCount listfs_trim(ListFS *this);
+bool listfs_create_journal(ListFS *this, ListFS_BlockCount size);
+bool listfs_commit(ListFS *this, bool force);
+
+ListFS_BlockIndex listfs_alloc_block_near(ListFS *this, ListFS_BlockIndex hint);
+void listfs_mark_map_dirty(ListFS *this, ListFS_BlockIndex index, size_t count);
+
+void *listfs_get_buffer(ListFS *this);
+void listfs_put_buffer(ListFS *this, void *buffer);
 
 ListFS_BlockIndex listfs_create_node(ListFS *this, uint8_t *name, uint32_t flags, ListFS_BlockIndex parent);
 bool listfs_delete_node(ListFS *this, ListFS_BlockIndex node);
+void listfs_detach_node(ListFS *this, ListFS_BlockIndex node);
+bool listfs_reclaim_node(ListFS *this, ListFS_BlockIndex node, ListFS_BlockCount limit);
+bool listfs_reclaim_orphans(ListFS *this, ListFS_BlockCount limit);
+bool listfs_delete_tree(ListFS *this, ListFS_BlockIndex node);
 void listfs_move_node(ListFS *this, ListFS_BlockIndex node, ListFS_BlockIndex new_parent);
 void listfs_foreach_node(ListFS *this, ListFS_BlockIndex node, bool (*callback)(ListFS*, ListFS_BlockIndex, ListFS_NodeHeader*, void*), void *data);
 void listfs_foreach_subnode(ListFS *this, ListFS_BlockIndex node, bool (*callback)(ListFS*, ListFS_BlockIndex, ListFS_NodeHeader*, void*), void *data);
+void listfs_foreach_block(ListFS *this, ListFS_BlockIndex list, bool (*callback)(ListFS*, ListFS_BlockIndex, bool, void*), void *data);
+bool listfs_scan(ListFS *this, ListFS_BlockIndex first, bool (*node_callback)(ListFS*, ListFS_BlockIndex, ListFS_NodeHeader*, void*),
+	bool (*list_callback)(ListFS*, ListFS_BlockIndex, ListFS_BlockIndex, ListFS_BlockIndex*, void*), void *data);
 ListFS_BlockIndex listfs_search_node(ListFS *this, uint8_t *path, ListFS_BlockIndex first);
 ListFS_NodeHeader *listfs_fetch_node(ListFS *this, ListFS_BlockIndex node);
+ListFS_NodeHeader *listfs_borrow_node(ListFS *this, ListFS_BlockIndex node);
 void listfs_rename_node(ListFS *this, ListFS_BlockIndex node, uint8_t *name);
+uint64_t listfs_name_hash(uint8_t *name);
+bool listfs_index_directory(ListFS *this, ListFS_BlockIndex dir);
+bool listfs_rebuild_index(ListFS *this, ListFS_BlockIndex dir);
+bool listfs_build_aggregates(ListFS *this);
+void listfs_flush_aggregates(ListFS *this);
+bool listfs_get_aggregates(ListFS *this, ListFS_BlockIndex dir, ListFS_Aggregates *result);
+uint16_t listfs_get_refcount(ListFS *this, ListFS_BlockIndex block);
+bool listfs_clone_data(ListFS *this, ListFS_BlockIndex src, ListFS_BlockIndex dst);
+ListFS_BlockIndex listfs_clone_file(ListFS *this, ListFS_BlockIndex src, ListFS_BlockIndex dst_parent, uint8_t *name);
 
+ListFS_BlockIndex listfs_find_free_run(ListFS *this, ListFS_BlockCount count, ListFS_BlockIndex hint);
+ListFS_BlockIndex listfs_alloc_run(ListFS *this, ListFS_BlockCount count, ListFS_BlockIndex hint);
+bool listfs_relocate_node(ListFS *this, ListFS_BlockIndex node, ListFS_BlockIndex target);
+bool listfs_relocate_file(ListFS *this, ListFS_BlockIndex node, ListFS_BlockIndex target);
+
+size_t listfs_compress(void *src, size_t length, void *dst, size_t capacity);
+size_t listfs_decompress(void *src, size_t length, void *dst, size_t capacity);
+size_t listfs_cluster_blocks(uint32_t block_size);
+size_t listfs_decode_cluster(uint32_t block_size, void *stored, void *cluster);
+
+ListFS_OpennedFile *listfs_find_open_file(ListFS *this, ListFS_BlockIndex node);
 ListFS_OpennedFile *listfs_open_file(ListFS *this, ListFS_BlockIndex node);
 void listfs_file_close(ListFS_OpennedFile *this);
+void listfs_file_flush(ListFS_OpennedFile *this);
 void listfs_file_seek(ListFS_OpennedFile *this, uint64_t offset, bool write);
 void listfs_file_truncate(ListFS_OpennedFile *this);
 size_t listfs_file_write(ListFS_OpennedFile *this, void *buffer, size_t length);
 size_t listfs_file_read(ListFS_OpennedFile *this, void *buffer, size_t length);
 
+bool listfs_file_read_async(ListFS_AsyncIO *this, ListFS_OpennedFile *file, uint64_t offset, void *buffer, size_t length,
+	void (*callback)(ListFS_AsyncIO*), void *data);
+bool listfs_file_write_async(ListFS_AsyncIO *this, ListFS_OpennedFile *file, uint64_t offset, void *buffer, size_t length,
+	void (*callback)(ListFS_AsyncIO*), void *data);
+void listfs_io_complete(ListFS_AsyncIO *this);
+
+ListFS_BlockIndex listfs_lookup_node(ListFS *this, uint8_t *path);
+ListFS_NodeInfo *listfs_get_node_info(ListFS *this, ListFS_BlockIndex node);
+size_t listfs_node_read(ListFS *this, ListFS_NodeInfo *info, uint64_t offset, void *buffer, size_t length);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,356 @@
+/*
+	This file is part of listfs-bench.
+	Copyright (C) 2026 ListFS contributors
+
+	This program is free software: you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation, either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License
+	along with this program.  If not, see <http://www.gnu.org/licenses/>
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include "liblistfs.h"
+
+uint8_t *device;
+uint64_t device_size;
+uint64_t read_count = 0;
+uint64_t write_count = 0;
+long latency = 0;
+bool csv = false;
+bool compress = false;
+unsigned int scale = 1;
+ListFS_BlockCount journal_size = 0;
+
+ListFS *fs;
+
+/* RAM block device */
+
+void inject_latency() {
+	if (latency > 0) {
+		struct timespec delay;
+		delay.tv_sec = latency / 1000000;
+		delay.tv_nsec = (latency % 1000000) * 1000;
+		nanosleep(&delay, NULL);
+	}
+}
+
+void read_block_func(ListFS *fs, ListFS_BlockIndex index, void *buffer) {
+	uint64_t offset = index * fs->block_size;
+	if (offset + fs->block_size <= device_size) {
+		memcpy(buffer, device + offset, fs->block_size);
+	} else if (offset < device_size) {
+		memset(buffer, 0, fs->block_size);
+		memcpy(buffer, device + offset, device_size - offset);
+	}
+	read_count++;
+	inject_latency();
+}
+
+void write_block_func(ListFS *fs, ListFS_BlockIndex index, void *buffer) {
+	uint64_t offset = index * fs->block_size;
+	if (offset + fs->block_size <= device_size) {
+		memcpy(device + offset, buffer, fs->block_size);
+	}
+	write_count++;
+	inject_latency();
+}
+
+/* Asynchronous requests are queued and serviced in batches, one latency per batch */
+
+typedef struct {
+	ListFS_BlockIndex index;
+	void *buffer;
+	ListFS_AsyncIO *io;
+	bool write;
+} AsyncRequest;
+
+AsyncRequest *async_queue = NULL;
+size_t async_queue_count = 0;
+size_t async_queue_capacity = 0;
+
+void queue_request(ListFS_BlockIndex index, void *buffer, ListFS_AsyncIO *io, bool write) {
+	if (async_queue_count == async_queue_capacity) {
+		async_queue_capacity = async_queue_capacity ? async_queue_capacity * 2 : 64;
+		async_queue = realloc(async_queue, async_queue_capacity * sizeof(AsyncRequest));
+	}
+	async_queue[async_queue_count].index = index;
+	async_queue[async_queue_count].buffer = buffer;
+	async_queue[async_queue_count].io = io;
+	async_queue[async_queue_count].write = write;
+	async_queue_count++;
+}
+
+void read_block_async_func(ListFS *fs, ListFS_BlockIndex index, void *buffer, ListFS_AsyncIO *io) {
+	queue_request(index, buffer, io, false);
+}
+
+void write_block_async_func(ListFS *fs, ListFS_BlockIndex index, void *buffer, ListFS_AsyncIO *io) {
+	queue_request(index, buffer, io, true);
+}
+
+void service_queue() {
+	inject_latency();
+	size_t count = async_queue_count;
+	AsyncRequest *batch = malloc(count * sizeof(AsyncRequest));
+	memcpy(batch, async_queue, count * sizeof(AsyncRequest));
+	async_queue_count = 0;
+	size_t i;
+	for (i = 0; i < count; i++) {
+		uint64_t offset = batch[i].index * fs->block_size;
+		if (batch[i].write) {
+			memcpy(device + offset, batch[i].buffer, fs->block_size);
+			write_count++;
+		} else {
+			memcpy(batch[i].buffer, device + offset, fs->block_size);
+			read_count++;
+		}
+		listfs_io_complete(batch[i].io);
+	}
+	free(batch);
+}
+
+/* Measurement functions */
+
+typedef struct {
+	char *name;
+	struct timespec start;
+	uint64_t reads;
+	uint64_t writes;
+} Measurement;
+
+void measure_start(Measurement *measurement, char *name) {
+	measurement->name = name;
+	measurement->reads = read_count;
+	measurement->writes = write_count;
+	clock_gettime(CLOCK_MONOTONIC, &measurement->start);
+}
+
+void measure_end(Measurement *measurement, uint64_t ops, uint64_t bytes) {
+	listfs_commit(fs, true);
+	struct timespec end;
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	double seconds = (end.tv_sec - measurement->start.tv_sec) + (end.tv_nsec - measurement->start.tv_nsec) / 1e9;
+	if (seconds <= 0) {
+		seconds = 1e-9;
+	}
+	uint64_t reads = read_count - measurement->reads;
+	uint64_t writes = write_count - measurement->writes;
+	if (csv) {
+		printf("%s,%u,%llu,%llu,%.6f,%.1f,%.1f,%llu,%llu,%.3f,%.3f\n", measurement->name, fs->block_size,
+			ops, bytes, seconds, ops / seconds, bytes / seconds, reads, writes, (double)reads / ops, (double)writes / ops);
+	} else {
+		printf("%-16s %10llu ops %12.1f ops/s %10.2f MiB/s %10.3f reads/op %10.3f writes/op\n", measurement->name,
+			ops, ops / seconds, bytes / seconds / (1024 * 1024), (double)reads / ops, (double)writes / ops);
+	}
+	fflush(stdout);
+}
+
+/* Workloads */
+
+#define SEQ_FILE_SIZE (64 * 1024 * 1024)
+#define SEQ_CHUNK_SIZE (1024 * 1024)
+#define RANDOM_READ_SIZE 4096
+#define RANDOM_READ_COUNT 20000
+#define SMALL_FILE_COUNT 5000
+#define SMALL_FILE_SIZE 100
+#define LOOKUP_COUNT 2000
+#define DEEP_PATH_DEPTH 64
+#define DEEP_LOOKUP_COUNT 2000
+#define ASYNC_QUEUE_DEPTH 32
+
+void bench_sequential() {
+	uint64_t file_size = SEQ_FILE_SIZE * (uint64_t)scale;
+	uint8_t *buffer = malloc(SEQ_CHUNK_SIZE);
+	memset(buffer, 0xA5, SEQ_CHUNK_SIZE);
+	ListFS_BlockIndex node = listfs_create_node(fs, "sequential", compress ? LISTFS_NODE_FLAG_COMPRESSED : 0, -1);
+	ListFS_OpennedFile *file = listfs_open_file(fs, node);
+	Measurement measurement;
+	uint64_t offset;
+	measure_start(&measurement, "seq_write");
+	for (offset = 0; offset < file_size; offset += SEQ_CHUNK_SIZE) {
+		listfs_file_write(file, buffer, SEQ_CHUNK_SIZE);
+	}
+	measure_end(&measurement, file_size / SEQ_CHUNK_SIZE, file_size);
+	listfs_file_seek(file, 0, false);
+	measure_start(&measurement, "seq_read");
+	for (offset = 0; offset < file_size; offset += SEQ_CHUNK_SIZE) {
+		listfs_file_read(file, buffer, SEQ_CHUNK_SIZE);
+	}
+	measure_end(&measurement, file_size / SEQ_CHUNK_SIZE, file_size);
+	srand(1);
+	unsigned int count = RANDOM_READ_COUNT * scale;
+	unsigned int i;
+	measure_start(&measurement, "random_read_4k");
+	for (i = 0; i < count; i++) {
+		uint64_t position = ((((uint64_t)rand() << 16) ^ rand()) % (file_size / RANDOM_READ_SIZE)) * RANDOM_READ_SIZE;
+		listfs_file_seek(file, position, false);
+		listfs_file_read(file, buffer, RANDOM_READ_SIZE);
+	}
+	measure_end(&measurement, count, count * (uint64_t)RANDOM_READ_SIZE);
+	ListFS_AsyncIO *requests = calloc(ASYNC_QUEUE_DEPTH, sizeof(ListFS_AsyncIO));
+	uint8_t *buffers = malloc(ASYNC_QUEUE_DEPTH * RANDOM_READ_SIZE);
+	fs->read_block_async_func = read_block_async_func;
+	fs->write_block_async_func = write_block_async_func;
+	srand(1);
+	measure_start(&measurement, "async_read_4k");
+	for (i = 0; i < count; i += ASYNC_QUEUE_DEPTH) {
+		unsigned int j;
+		for (j = 0; (j < ASYNC_QUEUE_DEPTH) && (i + j < count); j++) {
+			uint64_t position = ((((uint64_t)rand() << 16) ^ rand()) % (file_size / RANDOM_READ_SIZE)) * RANDOM_READ_SIZE;
+			listfs_file_read_async(&requests[j], file, position, buffers + j * RANDOM_READ_SIZE, RANDOM_READ_SIZE, NULL, NULL);
+		}
+		while (async_queue_count) {
+			service_queue();
+		}
+	}
+	measure_end(&measurement, count, count * (uint64_t)RANDOM_READ_SIZE);
+	fs->read_block_async_func = NULL;
+	fs->write_block_async_func = NULL;
+	free(buffers);
+	free(requests);
+	listfs_file_seek(file, 0, false);
+	measure_start(&measurement, "truncate_large");
+	listfs_file_truncate(file);
+	measure_end(&measurement, 1, file_size);
+	listfs_file_close(file);
+	listfs_delete_tree(fs, node);
+	free(buffer);
+}
+
+void bench_small_files() {
+	unsigned int count = SMALL_FILE_COUNT * scale;
+	ListFS_BlockIndex *nodes = malloc(count * sizeof(ListFS_BlockIndex));
+	uint8_t buffer[SMALL_FILE_SIZE];
+	memset(buffer, 0x5A, sizeof(buffer));
+	ListFS_BlockIndex dir = listfs_create_node(fs, "small", LISTFS_NODE_FLAG_DIRECTORY, -1);
+	char name[32];
+	Measurement measurement;
+	unsigned int i;
+	measure_start(&measurement, "create");
+	for (i = 0; i < count; i++) {
+		sprintf(name, "file%u", i);
+		nodes[i] = listfs_create_node(fs, name, 0, dir);
+		ListFS_OpennedFile *file = listfs_open_file(fs, nodes[i]);
+		listfs_file_write(file, buffer, sizeof(buffer));
+		listfs_file_close(file);
+	}
+	measure_end(&measurement, count, count * (uint64_t)sizeof(buffer));
+	measure_start(&measurement, "stat");
+	for (i = 0; i < count; i++) {
+		listfs_put_buffer(fs, listfs_borrow_node(fs, nodes[i]));
+	}
+	measure_end(&measurement, count, 0);
+	ListFS_NodeHeader *header = listfs_borrow_node(fs, dir);
+	ListFS_BlockIndex first = header->data;
+	listfs_put_buffer(fs, header);
+	srand(2);
+	unsigned int lookups = LOOKUP_COUNT;
+	measure_start(&measurement, "lookup_huge_dir");
+	for (i = 0; i < lookups; i++) {
+		sprintf(name, "file%u", rand() % count);
+		listfs_search_node(fs, name, first);
+	}
+	measure_end(&measurement, lookups, 0);
+	measure_start(&measurement, "delete");
+	for (i = 0; i < count; i++) {
+		listfs_delete_tree(fs, nodes[i]);
+	}
+	measure_end(&measurement, count, 0);
+	listfs_delete_tree(fs, dir);
+	free(nodes);
+}
+
+void bench_deep_path() {
+	char *path = malloc(DEEP_PATH_DEPTH * 8 + 1);
+	path[0] = 0;
+	ListFS_BlockIndex parent = -1;
+	char name[8];
+	unsigned int i;
+	for (i = 0; i < DEEP_PATH_DEPTH; i++) {
+		sprintf(name, "d%u", i);
+		parent = listfs_create_node(fs, name, LISTFS_NODE_FLAG_DIRECTORY, parent);
+		if (i > 0) {
+			strcat(path, "/");
+		}
+		strcat(path, name);
+	}
+	unsigned int count = DEEP_LOOKUP_COUNT * scale;
+	Measurement measurement;
+	measure_start(&measurement, "deep_path_lookup");
+	for (i = 0; i < count; i++) {
+		listfs_search_node(fs, path, fs->header->root_dir);
+	}
+	measure_end(&measurement, count, 0);
+	ListFS_BlockIndex top = listfs_search_node(fs, "d0", fs->header->root_dir);
+	listfs_delete_tree(fs, top);
+	free(path);
+}
+
+void display_usage() {
+	printf("ListFS Benchmark. Version %i.%i\n", LISTFS_VERSION_MAJOR, LISTFS_VERSION_MINOR);
+	printf("Usage:\n");
+	printf("\tlistfs-bench [--block-size=<bytes>] [--scale=<factor>] [--latency=<microseconds>]\n\t\t[--journal=<blocks>] [--compress] [--csv]\n");
+	printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+	unsigned int block_size = 4096;
+	int i;
+	for (i = 1; i < argc; i++) {
+		if (strncmp(argv[i], "--block-size=", 13) == 0) {
+			block_size = atoi(argv[i] + 13);
+		} else if (strncmp(argv[i], "--scale=", 8) == 0) {
+			scale = atoi(argv[i] + 8);
+		} else if (strncmp(argv[i], "--latency=", 10) == 0) {
+			latency = atol(argv[i] + 10);
+		} else if (strncmp(argv[i], "--journal=", 10) == 0) {
+			journal_size = atol(argv[i] + 10);
+		} else if (strcmp(argv[i], "--compress") == 0) {
+			compress = true;
+		} else if (strcmp(argv[i], "--csv") == 0) {
+			csv = true;
+		} else {
+			display_usage();
+			return 0;
+		}
+	}
+	if (!listfs_valid_block_size(block_size) || (scale < 1)) {
+		display_usage();
+		return -1;
+	}
+	device_size = SEQ_FILE_SIZE * 2ULL * scale;
+	device = calloc(device_size, 1);
+	if (!device) {
+		fprintf(stderr, "Failed to allocate %llu bytes!\n", device_size);
+		return -2;
+	}
+	fs = listfs_init(read_block_func, write_block_func, NULL);
+	listfs_create(fs, device_size / block_size, block_size, NULL, 0);
+	if (journal_size && !listfs_create_journal(fs, journal_size)) {
+		fprintf(stderr, "Failed to create journal of %llu blocks!\n", journal_size);
+		return -3;
+	}
+	if (csv) {
+		printf("workload,block_size,ops,bytes,seconds,ops_per_sec,bytes_per_sec,reads,writes,reads_per_op,writes_per_op\n");
+	}
+	bench_sequential();
+	bench_small_files();
+	bench_deep_path();
+	listfs_close(fs);
+	free(device);
+	return 0;
+}
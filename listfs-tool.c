@@ -16,6 +16,7 @@
 	along with this program.  If not, see <http://www.gnu.org/licenses/>
 */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
@@ -26,6 +27,13 @@
 #include <fcntl.h>
 #include <libgen.h>
 #include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <linux/fs.h>
+#include <linux/falloc.h>
 #ifndef DISABLE_FUSE
 #define FUSE_USE_VERSION 30
 #include <fuse.h>
@@ -34,22 +42,63 @@
 #include "liblistfs.h"
 
 FILE *log_file;
-FILE *device_file;
+int device_fd = -1;
+bool device_is_block = false;
 ListFS *fs;
+bool async_unlink = false;
+bool discard = false;
+bool dry_run = false;
+bool repair = false;
+bool compress = false;
+bool index_dirs = false;
+bool aggregates = false;
+int jobs = 0;
+ListFS_BlockCount journal_size = 0;
+ListFS_BlockCount stripe_width = 16;
 
 #ifndef DISABLE_FUSE
 
-static int _getattr(const char *path, struct stat *stbuf) {
-	if (strcmp(path, "/") == 0) {
-		stbuf->st_mode = S_IFDIR | 0755;
-		stbuf->st_nlink = 2;
-		return 0;
+pthread_mutex_t fs_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t reclaim_cond = PTHREAD_COND_INITIALIZER;
+pthread_t reclaim_thread;
+bool reclaim_stop = false;
+pthread_cond_t commit_cond = PTHREAD_COND_INITIALIZER;
+pthread_t commit_thread;
+bool commit_stop = false;
+
+#define COMMIT_INTERVAL 5
+#define RECLAIM_CHUNK 4096
+
+void unlock_fs() {
+	listfs_commit(fs, false);
+	pthread_mutex_unlock(&fs_mutex);
+}
+
+/* Orphans are reclaimed a chunk per lock, so other requests get through while a big file goes away */
+void *reclaim_thread_func(void *arg) {
+	pthread_mutex_lock(&fs_mutex);
+	while (!reclaim_stop) {
+		if (!listfs_reclaim_orphans(fs, RECLAIM_CHUNK)) {
+			pthread_cond_wait(&reclaim_cond, &fs_mutex);
+			continue;
+		}
+		unlock_fs();
+		pthread_mutex_lock(&fs_mutex);
 	}
-	ListFS_BlockIndex node = listfs_search_node(fs, (char*)path + 1, fs->header->root_dir);
-	if (node == -1) {
-		return -ENOENT;
+	unlock_fs();
+	return NULL;
+}
+
+/* Unlinked nodes are reclaimed once their last handle is closed, orphans left by a crash on mount */
+void reclaim_orphans() {
+	if (async_unlink) {
+		pthread_cond_signal(&reclaim_cond);
+	} else {
+		while (listfs_reclaim_orphans(fs, -1));
 	}
-	ListFS_NodeHeader *header = listfs_fetch_node(fs, node);
+}
+
+void fill_stat(struct stat *stbuf, ListFS_NodeHeader *header) {
 	stbuf->st_nlink = 1;
 	if (header->flags & LISTFS_NODE_FLAG_DIRECTORY) {
 		stbuf->st_mode = S_IFDIR | 0755;
@@ -60,7 +109,24 @@ static int _getattr(const char *path, struct stat *stbuf) {
 	stbuf->st_mtime = header->modify_time;
 	stbuf->st_atime = header->access_time;
 	stbuf->st_size = header->size;
-	free(header);
+}
+
+static int _getattr(const char *path, struct stat *stbuf) {
+	if (strcmp(path, "/") == 0) {
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+		return 0;
+	}
+	pthread_mutex_lock(&fs_mutex);
+	ListFS_BlockIndex node = listfs_search_node(fs, (char*)path + 1, fs->header->root_dir);
+	if (node == -1) {
+		unlock_fs();
+		return -ENOENT;
+	}
+	ListFS_NodeHeader *header = listfs_borrow_node(fs, node);
+	unlock_fs();
+	fill_stat(stbuf, header);
+	listfs_put_buffer(fs, header);
 	return 0;
 }
 
@@ -77,17 +143,20 @@ bool readdir_callback(ListFS *fs, ListFS_BlockIndex node, ListFS_NodeHeader *hea
 
 static int _readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
 	ListFS_BlockIndex node;
+	pthread_mutex_lock(&fs_mutex);
 	if (strcmp(path, "/") == 0) {
 		node = fs->header->root_dir;
 	} else {
 		node = listfs_search_node(fs, (char*)path + 1, fs->header->root_dir);
 		if (node == -1) {
+			unlock_fs();
 			return -ENOENT;
 		}
-		ListFS_NodeHeader *header = listfs_fetch_node(fs, node);
+		ListFS_NodeHeader *header = listfs_borrow_node(fs, node);
 		node = (header->flags & LISTFS_NODE_FLAG_DIRECTORY) ? header->data : -1;
-		free(header);
+		listfs_put_buffer(fs, header);
 		if (node == -1) {
+			unlock_fs();
 			return -ENOENT;
 		}
 	}
@@ -97,6 +166,7 @@ static int _readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t o
 	state.filler = filler;
 	state.buf = buf;
 	listfs_foreach_node(fs, node, readdir_callback, &state);
+	unlock_fs();
 	return 0;
 }
 
@@ -106,48 +176,68 @@ int _make_node(const char *path, uint32_t flags) {
 	free(_path);
 	const char *file_name = path + strlen(parent_name);
 	if (file_name[0] == '/') file_name++;
+	pthread_mutex_lock(&fs_mutex);
 	ListFS_BlockIndex parent;
 	if (strcmp(parent_name, "/") == 0) {
 		parent = -1;
 	} else {
 		parent = listfs_search_node(fs, parent_name + 1, fs->header->root_dir);
 		if (parent == -1) {
+			unlock_fs();
 			free(parent_name);
 			return -ENOENT;
 		}
 	}
 	free(parent_name);
-	return (listfs_create_node(fs, (char*)file_name, flags, parent) ? 0 : -EACCES);
+	ListFS_BlockIndex node = listfs_create_node(fs, (char*)file_name, flags, parent);
+	unlock_fs();
+	return (node ? 0 : -EACCES);
 }
 
 static int _mknod(const char *path, mode_t mode, dev_t rdev) {
-	return _make_node(path, 0);
+	return _make_node(path, compress ? LISTFS_NODE_FLAG_COMPRESSED : 0);
 }
 
 static int _mkdir(const char *path, mode_t mode) {
-	return _make_node(path, LISTFS_NODE_FLAG_DIRECTORY);
+	return _make_node(path, LISTFS_NODE_FLAG_DIRECTORY | (index_dirs ? LISTFS_NODE_FLAG_INDEXED : 0));
 }
 
 static int _unlink(const char *path) {
+	pthread_mutex_lock(&fs_mutex);
 	ListFS_BlockIndex node = listfs_search_node(fs, (char*)path + 1, fs->header->root_dir);
-	if (node == -1) return -ENOENT;
-	ListFS_OpennedFile *file = listfs_open_file(fs, node);
-	if (file) {
-		listfs_file_seek(file, 0, false);
-		listfs_file_truncate(file);
-		listfs_file_close(file);
+	if (node == -1) {
+		unlock_fs();
+		return -ENOENT;
 	}
-	if (listfs_delete_node(fs, node)) {
-		return 0;
-	} else {
+	ListFS_NodeHeader *header = listfs_borrow_node(fs, node);
+	bool not_empty = (header->flags & LISTFS_NODE_FLAG_DIRECTORY) && (header->data != -1);
+	listfs_put_buffer(fs, header);
+	if (not_empty) {
+		unlock_fs();
 		return -EACCES;
 	}
+	/* Without an extended header there is no orphan list to keep an open file on until it is released */
+	if (!fs->ext_header && listfs_find_open_file(fs, node)) {
+		unlock_fs();
+		return -EBUSY;
+	}
+	listfs_detach_node(fs, node);
+	if (fs->ext_header) {
+		reclaim_orphans();
+	} else {
+		listfs_reclaim_node(fs, node, -1);
+	}
+	unlock_fs();
+	return 0;
 }
 
 static int _rmdir(const char *path) {
+	pthread_mutex_lock(&fs_mutex);
 	ListFS_BlockIndex node = listfs_search_node(fs, (char*)path + 1, fs->header->root_dir);
+	bool result = (node != -1) && listfs_delete_node(fs, node);
+	unlock_fs();
 	if (node == -1) return -ENOENT;
-	if (listfs_delete_node(fs, node)) {
+	if (result) {
 		return 0;
 	} else {
 		return -EACCES;
@@ -155,19 +245,25 @@ static int _rmdir(const char *path) {
 }
 
 static int _rename(const char *from, const char *to) {
-	ListFS_BlockIndex node = listfs_search_node(fs, (char*)from + 1, fs->header->root_dir);
-	if (node == -1) return -ENOENT;
 	char *_path = strdup(to);
 	char *parent_name = strdup(dirname(_path));
 	free(_path);
 	const char *file_name = to + strlen(parent_name);
 	if (file_name[0] == '/') file_name++;
+	pthread_mutex_lock(&fs_mutex);
+	ListFS_BlockIndex node = listfs_search_node(fs, (char*)from + 1, fs->header->root_dir);
+	if (node == -1) {
+		unlock_fs();
+		free(parent_name);
+		return -ENOENT;
+	}
 	ListFS_BlockIndex parent;
 	if (strcmp(parent_name, "/") == 0) {
 		parent = -1;
 	} else {
 		parent = listfs_search_node(fs, parent_name + 1, fs->header->root_dir);
 		if (parent == -1) {
+			unlock_fs();
 			free(parent_name);
 			return -ENOENT;
 		}
@@ -175,11 +271,14 @@ static int _rename(const char *from, const char *to) {
 	free(parent_name);
 	listfs_move_node(fs, node, parent);
 	listfs_rename_node(fs, node, (char*)file_name);
+	unlock_fs();
 	return 0;
 }
 
 static int _open(const char *path, struct fuse_file_info *fi) {
+	pthread_mutex_lock(&fs_mutex);
 	ListFS_OpennedFile *file = listfs_open_file(fs, listfs_search_node(fs, (char*)path + 1, fs->header->root_dir));
+	unlock_fs();
 	if (!file) {
 		return -ENOENT;
 	}
@@ -188,40 +287,111 @@ static int _open(const char *path, struct fuse_file_info *fi) {
 }
 
 static int _release(const char *path, struct fuse_file_info *fi) {
+	pthread_mutex_lock(&fs_mutex);
 	listfs_file_close((void*)fi->fh);
+	reclaim_orphans();
+	unlock_fs();
 	return 0;
 }
 
 static int _read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
 	ListFS_OpennedFile *file = (void*)fi->fh;
+	pthread_mutex_lock(&fs_mutex);
 	listfs_file_seek(file, offset, false);
-	return listfs_file_read(file, buf, size);
+	int result = listfs_file_read(file, buf, size);
+	unlock_fs();
+	return result;
 }
 
 static int _write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
 	ListFS_OpennedFile *file = (void*)fi->fh;
+	pthread_mutex_lock(&fs_mutex);
 	listfs_file_seek(file, offset, true);
-	return listfs_file_write(file, (char*)buf, size);
+	int result = listfs_file_write(file, (char*)buf, size);
+	unlock_fs();
+	return result;
 }
 
 static int _truncate(const char *path, off_t size) {
+	pthread_mutex_lock(&fs_mutex);
 	ListFS_OpennedFile *file = listfs_open_file(fs, listfs_search_node(fs, (char*)path + 1, fs->header->root_dir));
 	if (!file) {
+		unlock_fs();
 		return -ENOENT;
 	}
 	listfs_file_seek(file, size, true);
 	listfs_file_truncate(file);
 	listfs_file_close(file);
+	unlock_fs();
+	return 0;
+}
+
+void *commit_thread_func(void *arg) {
+	pthread_mutex_lock(&fs_mutex);
+	while (!commit_stop) {
+		struct timespec deadline;
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += COMMIT_INTERVAL;
+		pthread_cond_timedwait(&commit_cond, &fs_mutex, &deadline);
+		listfs_commit(fs, true);
+	}
+	pthread_mutex_unlock(&fs_mutex);
+	return NULL;
+}
+
+static int _flush(const char *path, struct fuse_file_info *fi) {
+	pthread_mutex_lock(&fs_mutex);
+	listfs_file_flush((void*)fi->fh);
+	unlock_fs();
+	return 0;
+}
+
+static int _fsync(const char *path, int datasync, struct fuse_file_info *fi) {
+	pthread_mutex_lock(&fs_mutex);
+	listfs_file_flush((void*)fi->fh);
+	listfs_commit(fs, true);
+	pthread_mutex_unlock(&fs_mutex);
 	return 0;
 }
 
+void stripe_start();
+
+void *_init(struct fuse_conn_info *conn) {
+	stripe_start();
+	if (fs->ext_header && fs->ext_header->journal_size && !fs->read_only) {
+		pthread_create(&commit_thread, NULL, commit_thread_func, NULL);
+	}
+	if (async_unlink) {
+		pthread_create(&reclaim_thread, NULL, reclaim_thread_func, NULL);
+	} else if (!fs->read_only) {
+		pthread_mutex_lock(&fs_mutex);
+		reclaim_orphans();
+		unlock_fs();
+	}
+	return NULL;
+}
+
 void _destroy() {
+	if (async_unlink) {
+		pthread_mutex_lock(&fs_mutex);
+		reclaim_stop = true;
+		pthread_cond_signal(&reclaim_cond);
+		unlock_fs();
+		pthread_join(reclaim_thread, NULL);
+	}
+	if (fs->ext_header && fs->ext_header->journal_size && !fs->read_only) {
+		pthread_mutex_lock(&fs_mutex);
+		commit_stop = true;
+		pthread_cond_signal(&commit_cond);
+		pthread_mutex_unlock(&fs_mutex);
+		pthread_join(commit_thread, NULL);
+	}
 	listfs_close(fs);
 }
 
 static int _statfs(const char *path, struct statvfs *stbuf) {
-	stbuf->f_bsize = fs->header->block_size;
-	stbuf->f_frsize = fs->header->block_size;
+	stbuf->f_bsize = fs->block_size;
+	stbuf->f_frsize = fs->block_size;
 	stbuf->f_blocks = fs->header->size;
 	stbuf->f_bfree = fs->header->size - fs->header->used_blocks;
 	stbuf->f_bavail = stbuf->f_bfree;
@@ -229,6 +399,94 @@ static int _statfs(const char *path, struct statvfs *stbuf) {
 	return 0;
 }
 
+/* Setting user.listfs.clone to a source path makes the empty file share its data blocks */
+static int _setxattr(const char *path, const char *name, const char *value, size_t size, int flags) {
+	if (strcmp(name, "user.listfs.clone") != 0) {
+		return -ENOTSUP;
+	}
+	char *source = strndup(value, size);
+	pthread_mutex_lock(&fs_mutex);
+	ListFS_BlockIndex src = listfs_search_node(fs, source + ((source[0] == '/') ? 1 : 0), fs->header->root_dir);
+	ListFS_BlockIndex dst = listfs_search_node(fs, (char*)path + 1, fs->header->root_dir);
+	if ((src == -1) || (dst == -1)) {
+		unlock_fs();
+		free(source);
+		return -ENOENT;
+	}
+	ListFS_NodeHeader *src_header = listfs_borrow_node(fs, src);
+	ListFS_NodeHeader *dst_header = listfs_borrow_node(fs, dst);
+	bool valid = !((src_header->flags | dst_header->flags) & LISTFS_NODE_FLAG_DIRECTORY) && (dst_header->data == -1);
+	listfs_put_buffer(fs, dst_header);
+	listfs_put_buffer(fs, src_header);
+	/* Clone of a file into an empty file only fails when the volume is full */
+	bool result = valid && listfs_clone_data(fs, src, dst);
+	unlock_fs();
+	free(source);
+	if (!valid) return -EINVAL;
+	return (result ? 0 : -ENOSPC);
+}
+
+/* Aggregates of directories are read as user.listfs.total_size, user.listfs.total_blocks and user.listfs.total_entries */
+const char *aggregate_names[] = {"user.listfs.total_size", "user.listfs.total_blocks", "user.listfs.total_entries"};
+
+int get_aggregate_xattr(ListFS_Aggregates *aggregates, const char *name, char *value, size_t size) {
+	uint64_t values[] = {aggregates->size, aggregates->blocks, aggregates->entries};
+	int i;
+	for (i = 0; i < 3; i++) {
+		if (strcmp(name, aggregate_names[i]) == 0) {
+			char text[24];
+			int length = sprintf(text, "%llu", values[i]);
+			if (size == 0) return length;
+			if (size < length) return -ERANGE;
+			memcpy(value, text, length);
+			return length;
+		}
+	}
+	return -ENODATA;
+}
+
+int list_aggregate_xattrs(char *list, size_t size) {
+	int length = 0, i;
+	for (i = 0; i < 3; i++) {
+		length += strlen(aggregate_names[i]) + 1;
+	}
+	if (size == 0) return length;
+	if (size < length) return -ERANGE;
+	for (i = 0; i < 3; i++) {
+		strcpy(list, aggregate_names[i]);
+		list += strlen(aggregate_names[i]) + 1;
+	}
+	return length;
+}
+
+int find_aggregates(const char *path, ListFS_Aggregates *aggregates) {
+	ListFS_BlockIndex node = -1;
+	pthread_mutex_lock(&fs_mutex);
+	if (strcmp(path, "/") != 0) {
+		node = listfs_search_node(fs, (char*)path + 1, fs->header->root_dir);
+		if (node == -1) {
+			unlock_fs();
+			return -ENOENT;
+		}
+	}
+	bool found = listfs_get_aggregates(fs, node, aggregates);
+	unlock_fs();
+	return found ? 0 : -ENODATA;
+}
+
+static int _getxattr(const char *path, const char *name, char *value, size_t size) {
+	ListFS_Aggregates aggregates;
+	int result = find_aggregates(path, &aggregates);
+	return result ? result : get_aggregate_xattr(&aggregates, name, value, size);
+}
+
+static int _listxattr(const char *path, char *list, size_t size) {
+	ListFS_Aggregates aggregates;
+	int result = find_aggregates(path, &aggregates);
+	if (result == -ENODATA) return 0;
+	return result ? result : list_aggregate_xattrs(list, size);
+}
+
 static struct fuse_operations listfs_operations = {
 	.getattr = _getattr,
 	.readdir = _readdir,
@@ -242,152 +500,2629 @@ static struct fuse_operations listfs_operations = {
 	.read = _read,
 	.write = _write,
 	.truncate = _truncate,
+	.flush = _flush,
+	.fsync = _fsync,
+	.init = _init,
+	.destroy = _destroy,
+	.statfs = _statfs,
+	.setxattr = _setxattr,
+	.getxattr = _getxattr,
+	.listxattr = _listxattr
+};
+
+/* Read-only mount: lookups, attributes and file data come from immutable library caches without fs_mutex */
+
+static int _ro_getattr(const char *path, struct stat *stbuf) {
+	if (strcmp(path, "/") == 0) {
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+		return 0;
+	}
+	ListFS_NodeInfo *info = listfs_get_node_info(fs, listfs_lookup_node(fs, (char*)path + 1));
+	if (!info) {
+		return -ENOENT;
+	}
+	fill_stat(stbuf, info->header);
+	return 0;
+}
+
+static int _ro_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+	ListFS_BlockIndex node = fs->header->root_dir;
+	if (strcmp(path, "/") != 0) {
+		ListFS_NodeInfo *info = listfs_get_node_info(fs, listfs_lookup_node(fs, (char*)path + 1));
+		if (!info || !(info->header->flags & LISTFS_NODE_FLAG_DIRECTORY)) {
+			return -ENOENT;
+		}
+		node = info->header->data;
+	}
+	filler(buf, ".", NULL, 0);
+	filler(buf, "..", NULL, 0);
+	ReadDirState state;
+	state.filler = filler;
+	state.buf = buf;
+	listfs_foreach_node(fs, node, readdir_callback, &state);
+	return 0;
+}
+
+static int _ro_open(const char *path, struct fuse_file_info *fi) {
+	ListFS_NodeInfo *info = listfs_get_node_info(fs, listfs_lookup_node(fs, (char*)path + 1));
+	if (!info || (info->header->flags & LISTFS_NODE_FLAG_DIRECTORY)) {
+		return -ENOENT;
+	}
+	fi->fh = (size_t)info;
+	return 0;
+}
+
+static int _ro_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi) {
+	return listfs_node_read(fs, (void*)fi->fh, offset, buf, size);
+}
+
+int find_ro_aggregates(const char *path, ListFS_Aggregates *aggregates) {
+	if (!fs->ext_header || !(fs->ext_header->flags & LISTFS_EXT_FLAG_AGGREGATES)) return -ENODATA;
+	if (strcmp(path, "/") == 0) {
+		*aggregates = fs->ext_header->root_aggregates;
+		return 0;
+	}
+	ListFS_NodeInfo *info = listfs_get_node_info(fs, listfs_lookup_node(fs, (char*)path + 1));
+	if (!info) {
+		return -ENOENT;
+	}
+	if (!(info->header->flags & LISTFS_NODE_FLAG_DIRECTORY)) {
+		return -ENODATA;
+	}
+	*aggregates = info->header->aggregates;
+	return 0;
+}
+
+static int _ro_getxattr(const char *path, const char *name, char *value, size_t size) {
+	ListFS_Aggregates aggregates;
+	int result = find_ro_aggregates(path, &aggregates);
+	return result ? result : get_aggregate_xattr(&aggregates, name, value, size);
+}
+
+static int _ro_listxattr(const char *path, char *list, size_t size) {
+	ListFS_Aggregates aggregates;
+	int result = find_ro_aggregates(path, &aggregates);
+	if (result == -ENODATA) return 0;
+	return result ? result : list_aggregate_xattrs(list, size);
+}
+
+static struct fuse_operations listfs_ro_operations = {
+	.getattr = _ro_getattr,
+	.readdir = _ro_readdir,
+	.open = _ro_open,
+	.read = _ro_read,
+	.init = _init,
 	.destroy = _destroy,
-	.statfs = _statfs
+	.statfs = _statfs,
+	.getxattr = _ro_getxattr,
+	.listxattr = _ro_listxattr
 };
 
+bool fuse_read_only(int argc, char *argv[]) {
+	bool read_only = false;
+	int i;
+	for (i = 0; i < argc; i++) {
+		char *options;
+		if (strcmp(argv[i], "-o") == 0) {
+			if (i + 1 >= argc) break;
+			options = strdup(argv[++i]);
+		} else if (strncmp(argv[i], "-o", 2) == 0) {
+			options = strdup(argv[i] + 2);
+		} else {
+			continue;
+		}
+		char *option, *saveptr;
+		for (option = strtok_r(options, ",", &saveptr); option; option = strtok_r(NULL, ",", &saveptr)) {
+			if (strcmp(option, "ro") == 0) {
+				read_only = true;
+			} else if (strcmp(option, "rw") == 0) {
+				read_only = false;
+			}
+		}
+		free(options);
+	}
+	return read_only;
+}
+
 #endif
 
 void display_usage() {
 	printf("ListFS Tool. Version %i.%i\n", LISTFS_VERSION_MAJOR, LISTFS_VERSION_MINOR);
 	printf("Usage:\n");
-	printf("\tlistfs-tool create <file or device name> <file system size in blocks>\n\t\t<block size> [bootloader file name]\n");
+	printf("\tlistfs-tool create <file or device name> <file system size in blocks>\n\t\t<block size> [bootloader file name] [--journal=<blocks>]\n\t\t[--discard] [--aggregates]\n");
+	printf("\tlistfs-tool pack <host directory> <file or device name> <block size>\n\t\t[file system size in blocks] [bootloader file name] [--jobs=<count>] [--journal=<blocks>]\n\t\t[--compress] [--discard] [--aggregates]\n");
+	printf("\tlistfs-tool extract <file or device name> <host directory> [--jobs=<count>]\n");
+	printf("\tlistfs-tool export <file or device name> > <tar file>\n");
 	printf("\tlistfs-tool dump <file or device name>\n");
+	printf("\tlistfs-tool check <file or device name> [--repair] [--jobs=<count>]\n");
+	printf("\tlistfs-tool trim <file or device name>\n");
+	printf("\tlistfs-tool rm <file or device name> <path>\n");
+	printf("\tlistfs-tool clone <file or device name> <source path> <destination path>\n");
+	printf("\tlistfs-tool index <file or device name> [directory path]\n");
+	printf("\tlistfs-tool aggregate <file or device name>\n");
+	printf("\tlistfs-tool du <file or device name> [directory path]\n");
+	printf("\tlistfs-tool defrag <file or device name> [--dry-run]\n");
 #ifndef DISABLE_FUSE
-	printf("\tlistfs-tool mount <file or device name> <mount point> [fuse options]\n");
+	printf("\tlistfs-tool mount <file or device name> <mount point> [--async-unlink] [--discard] [--compress]\n\t\t[--index-dirs] [--stripe-width=<blocks>] [-o ro] [fuse options]\n");
 #endif
+	printf("\nSeveral comma-separated files or devices are striped together, %llu blocks per member in turn\n"
+		"by default (set with --stripe-width=<blocks> on create and pack, members keep it in their labels).\n",
+		stripe_width);
 	printf("\n");
 }
 
-void read_block_func(ListFS *fs, ListFS_BlockIndex index, void *buffer) {
-	fseek(device_file, index * fs->header->block_size + fs->header->base, SEEK_SET);
-	fread(buffer, fs->header->block_size, 1, device_file);
+void discard_range(int fd, bool is_block, uint64_t offset, uint64_t length) {
+	uint64_t range[2] = {offset, length};
+	if (is_block) {
+		ioctl(fd, BLKDISCARD, range);
+	} else {
+		fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, offset, length);
+	}
 }
 
-void write_block_func(ListFS *fs, ListFS_BlockIndex index, void *buffer) {
-	fseek(device_file, index * fs->header->block_size + fs->header->base, SEEK_SET);
-	fwrite(buffer, fs->header->block_size, 1, device_file);
+/*
+	Striping: block index is split into stripe units of stripe_width blocks, which are dealt to members in turn.
+	Every member has own I/O thread, so multi-block transfers, flushes and sequential read-ahead run in parallel.
+	Single block writes are queued to the member and not waited for, so runs of them (journal, bitmap, block
+	lists) spread over all members too. Reads of a member with queued requests go through its queue, so they
+	see the queued writes, flushes wait for everything queued before them.
+
+	Every member starts with a label of STRIPE_LABEL_SIZE bytes, stripe units follow it. The label keeps
+	the geometry the volume was created with, so members given in wrong order or from another volume are
+	refused and the width need not be repeated.
+*/
+
+#define STRIPE_READ 0
+#define STRIPE_WRITE 1
+#define STRIPE_FLUSH 2
+#define STRIPE_READAHEAD 3
+#define STRIPE_MAX_IOV 1024
+#define STRIPE_MAX_QUEUED 256
+#define STRIPE_LABEL_SIZE 4096
+#define STRIPE_LABEL_MAGIC 0x50525453
+
+typedef struct {
+	uint32_t magic;
+	uint32_t member;
+	uint32_t count;
+	uint32_t reserved;
+	uint64_t width;
+	uint64_t volume_id;
+} __attribute__((packed)) StripeLabel;
+
+typedef struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int pending;
+} StripeBatch;
+
+typedef struct StripeRequest {
+	struct StripeRequest *next;
+	int op;
+	off_t offset;
+	size_t length;
+	void *data;
+	int iov_count;
+	int iov_capacity;
+	StripeBatch *batch;
+	struct iovec iov[];
+} StripeRequest;
+
+typedef struct {
+	int fd;
+	bool is_block;
+	pthread_t thread;
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	pthread_cond_t done_cond;
+	StripeRequest *head;
+	StripeRequest *tail;
+	size_t queued;
+	bool stop;
+} StripeMember;
+
+StripeMember *stripe_members = NULL;
+int stripe_count = 0;
+bool stripe_running = false;
+pthread_mutex_t stripe_readahead_mutex = PTHREAD_MUTEX_INITIALIZER;
+ListFS_BlockIndex stripe_last_read = -1;
+ListFS_BlockIndex stripe_readahead_unit = -1;
+
+int stripe_map(ListFS *fs, ListFS_BlockIndex index, off_t *offset) {
+	ListFS_BlockIndex unit = index / stripe_width;
+	*offset = ((unit / stripe_count) * stripe_width + index % stripe_width) * fs->block_size + fs->header->base +
+		STRIPE_LABEL_SIZE;
+	return unit % stripe_count;
 }
 
-void log_func(ListFS *fs, char *fmt, va_list ap) {
-	vfprintf(log_file, fmt, ap);
+void stripe_execute(StripeMember *member, StripeRequest *request) {
+	switch (request->op) {
+		case STRIPE_READ: {
+			ssize_t done = preadv(member->fd, request->iov, request->iov_count, request->offset);
+			int i;
+			for (i = 0; i < request->iov_count; i++) {
+				/* Members may be shorter than volume, missing tail reads as zeroes */
+				size_t valid = (done > 0) ? ((done < request->iov[i].iov_len) ? done : request->iov[i].iov_len) : 0;
+				memset(request->iov[i].iov_base + valid, 0, request->iov[i].iov_len - valid);
+				done -= valid;
+			}
+			break;
+		}
+		case STRIPE_WRITE:
+			pwritev(member->fd, request->iov, request->iov_count, request->offset);
+			break;
+		case STRIPE_FLUSH:
+			fdatasync(member->fd);
+			break;
+		case STRIPE_READAHEAD:
+			readahead(member->fd, request->offset, request->length);
+			break;
+	}
 }
 
-char readme_text[] = "This is first file on your ListFS!\n";
+void stripe_complete(StripeMember *member, StripeRequest *request) {
+	StripeBatch *batch = request->batch;
+	free(request->data);
+	free(request);
+	pthread_mutex_lock(&member->mutex);
+	member->queued--;
+	pthread_cond_broadcast(&member->done_cond);
+	pthread_mutex_unlock(&member->mutex);
+	if (!batch) return;
+	pthread_mutex_lock(&batch->mutex);
+	batch->pending--;
+	if (!batch->pending) {
+		pthread_cond_signal(&batch->cond);
+	}
+	pthread_mutex_unlock(&batch->mutex);
+}
 
-void dump_block_list(ListFS_BlockIndex list_block, char *ident) {
-	if (list_block != -1) {
-		ListFS_BlockIndex *list = malloc(fs->header->block_size);
-		size_t block_list_size = fs->header->block_size / sizeof(ListFS_BlockIndex);
-		read_block_func(fs, list_block, list);
-		printf("%s\tBlock list %lli (next = %lli, prev = %lli):\n", ident, list_block, list[block_list_size - 1], list[0]);
-		size_t i;
-		for (i = 1; i < block_list_size - 1; i++) {
-			if (list[i] == -1) break;
-			printf("%s\t\tBlock %llu\n", ident, list[i]);
+void *stripe_thread_func(void *arg) {
+	StripeMember *member = arg;
+	pthread_mutex_lock(&member->mutex);
+	while (true) {
+		while (!member->head && !member->stop) {
+			pthread_cond_wait(&member->cond, &member->mutex);
 		}
-		if (list[block_list_size - 1] != -1) {
-			dump_block_list(list[block_list_size - 1], ident);
+		StripeRequest *request = member->head;
+		if (!request) break;
+		member->head = request->next;
+		if (!member->head) {
+			member->tail = NULL;
 		}
-		free(list);
+		pthread_mutex_unlock(&member->mutex);
+		stripe_execute(member, request);
+		stripe_complete(member, request);
+		pthread_mutex_lock(&member->mutex);
 	}
+	pthread_mutex_unlock(&member->mutex);
+	return NULL;
 }
 
-bool dump_node_callback(ListFS *fs, ListFS_BlockIndex node, ListFS_NodeHeader *header, void *data) {
-	char *ident = data;
-	printf("%sNode %llu (name = '%s', flags = %u, size = %llu, data = %lli)\n", ident, node, header->name, header->flags,
-		header->size, header->data);
-	if (header->flags & LISTFS_NODE_FLAG_DIRECTORY) {
-		char new_ident[strlen(ident) + 2];
-		strcpy(new_ident, ident);
-		new_ident[strlen(ident)] = '\t';
-		new_ident[strlen(ident) + 1] = 0;
-		listfs_foreach_node(fs, header->data, dump_node_callback, new_ident);
+void stripe_start() {
+	int i;
+	if (!stripe_count || stripe_running) return;
+	for (i = 0; i < stripe_count; i++) {
+		stripe_members[i].stop = false;
+		pthread_create(&stripe_members[i].thread, NULL, stripe_thread_func, &stripe_members[i]);
+	}
+	stripe_running = true;
+}
+
+/* Threads do not survive fork, so they must be stopped before FUSE daemonizes. Queued requests are done first. */
+void stripe_stop() {
+	int i;
+	if (!stripe_running) return;
+	for (i = 0; i < stripe_count; i++) {
+		pthread_mutex_lock(&stripe_members[i].mutex);
+		stripe_members[i].stop = true;
+		pthread_cond_signal(&stripe_members[i].cond);
+		pthread_mutex_unlock(&stripe_members[i].mutex);
+		pthread_join(stripe_members[i].thread, NULL);
+	}
+	stripe_running = false;
+}
+
+StripeRequest *stripe_request(int op, off_t offset, StripeBatch *batch, int iov_capacity) {
+	StripeRequest *request = malloc(sizeof(StripeRequest) + iov_capacity * sizeof(struct iovec));
+	request->next = NULL;
+	request->op = op;
+	request->offset = offset;
+	request->length = 0;
+	request->data = NULL;
+	request->iov_count = 0;
+	request->iov_capacity = iov_capacity;
+	request->batch = batch;
+	if (batch) {
+		batch->pending++;
+	}
+	return request;
+}
+
+void stripe_submit(StripeMember *member, StripeRequest *request) {
+	pthread_mutex_lock(&member->mutex);
+	member->queued++;
+	if (!stripe_running) {
+		pthread_mutex_unlock(&member->mutex);
+		stripe_execute(member, request);
+		stripe_complete(member, request);
+		return;
+	}
+	if (member->tail) {
+		member->tail->next = request;
 	} else {
-		dump_block_list(header->data, ident);
+		member->head = request;
 	}
-	return true;
+	member->tail = request;
+	pthread_cond_signal(&member->cond);
+	pthread_mutex_unlock(&member->mutex);
 }
 
-int main(int argc, char *argv[]) {
-	if (argc < 3) {
-		display_usage();
-		return 0;
+void stripe_wait(StripeBatch *batch) {
+	pthread_mutex_lock(&batch->mutex);
+	while (batch->pending) {
+		pthread_cond_wait(&batch->cond, &batch->mutex);
 	}
-	log_file = fopen("/tmp/listfs-tool.log", "w");
-	fs = listfs_init(read_block_func, write_block_func, log_func);
-	char *action = argv[1];
-	char *file_name = argv[2];
-	if (strcmp(action, "create") == 0) {
-		if (argc < 5) {
-			display_usage();
-			return 0;
+	pthread_mutex_unlock(&batch->mutex);
+	pthread_mutex_destroy(&batch->mutex);
+	pthread_cond_destroy(&batch->cond);
+}
+
+void stripe_batch_init(StripeBatch *batch) {
+	pthread_mutex_init(&batch->mutex, NULL);
+	pthread_cond_init(&batch->cond, NULL);
+	batch->pending = 0;
+}
+
+/* Split blocks to per-member requests, stripe units of one member are contiguous on it */
+void stripe_transfer(ListFS *fs, int op, ListFS_BlockIndex index, void *buffer, ListFS_BlockCount count) {
+	StripeBatch batch;
+	StripeRequest *requests[stripe_count];
+	/* Transfer touches every member at most this many times, plus partial units at both ends */
+	ListFS_BlockCount units = (count + stripe_width - 1) / stripe_width / stripe_count + 2;
+	int iov_capacity = (units < STRIPE_MAX_IOV) ? units : STRIPE_MAX_IOV;
+	int i;
+	stripe_batch_init(&batch);
+	for (i = 0; i < stripe_count; i++) {
+		requests[i] = NULL;
+	}
+	while (count) {
+		off_t offset;
+		int member = stripe_map(fs, index, &offset);
+		ListFS_BlockCount chunk = stripe_width - index % stripe_width;
+		if (chunk > count) {
+			chunk = count;
 		}
-		ListFS_BlockCount fs_size = atol(argv[3]);
-		int fs_block_size = atoi(argv[4]);
-		if (fs_size < 2) {
-			printf("FS size too small!\n");
-			return -1;
+		StripeRequest *request = requests[member];
+		if (request && ((request->offset + request->length != offset) || (request->iov_count == request->iov_capacity))) {
+			stripe_submit(&stripe_members[member], request);
+			request = NULL;
 		}
-		if (fs_block_size < LISTFS_MIN_BLOCK_SIZE) {
-			printf("Block size must be greater than %u bytes!\n", LISTFS_MIN_BLOCK_SIZE);
-			return -1;
+		if (!request) {
+			request = stripe_request(op, offset, &batch, iov_capacity);
+			requests[member] = request;
 		}
-		uint8_t *bootloader = NULL;
-		size_t bootloader_size = 0;
-		if (argc >= 6) {
-			char *bootloader_file_name = argv[5];
-			FILE *bootloader_file = fopen(bootloader_file_name, "r");
-			if (!bootloader_file) {
-				printf("Failed to open '%s'!\n", bootloader_file_name);
-				return -2;
-			}
-			while (feof(bootloader_file) == 0) {
-				size_t offset = bootloader_size;
-				bootloader_size += LISTFS_MIN_BLOCK_SIZE;
-				bootloader = realloc(bootloader, bootloader_size);
-				if (fread(bootloader + offset, LISTFS_MIN_BLOCK_SIZE, 1, bootloader_file) == 0) {
-					bootloader_size = offset;
-					break;
-				}
-			}
-			fclose(bootloader_file);
+		request->iov[request->iov_count].iov_base = buffer;
+		request->iov[request->iov_count].iov_len = chunk * fs->block_size;
+		request->iov_count++;
+		request->length += chunk * fs->block_size;
+		index += chunk;
+		buffer += chunk * fs->block_size;
+		count -= chunk;
+	}
+	for (i = 0; i < stripe_count; i++) {
+		if (requests[i]) {
+			stripe_submit(&stripe_members[i], requests[i]);
 		}
-		device_file = fopen(file_name, "w+");
-		listfs_create(fs, fs_size, fs_block_size, bootloader, bootloader_size);
-		ListFS_OpennedFile *file = listfs_open_file(fs, listfs_create_node(fs, "README", 0, -1));
-		listfs_file_write(file, readme_text, strlen(readme_text));
-		listfs_file_close(file);
-		listfs_close(fs);
-		free(bootloader);
-		return 0;
-#ifndef DISABLE_FUSE
-	} else if (strcmp(action, "mount") == 0) {
-		if (argc < 4) {
-			display_usage();
-			return 0;
+	}
+	stripe_wait(&batch);
+}
+
+/* Block is copied and queued, a member with too many queued requests makes the writer wait */
+void stripe_write_behind(ListFS *fs, ListFS_BlockIndex index, void *buffer) {
+	off_t offset;
+	StripeMember *member = &stripe_members[stripe_map(fs, index, &offset)];
+	pthread_mutex_lock(&member->mutex);
+	while (member->queued >= STRIPE_MAX_QUEUED) {
+		pthread_cond_wait(&member->done_cond, &member->mutex);
+	}
+	pthread_mutex_unlock(&member->mutex);
+	StripeRequest *request = stripe_request(STRIPE_WRITE, offset, NULL, 1);
+	request->data = malloc(fs->block_size);
+	memcpy(request->data, buffer, fs->block_size);
+	request->iov[0].iov_base = request->data;
+	request->iov[0].iov_len = fs->block_size;
+	request->iov_count = 1;
+	request->length = fs->block_size;
+	stripe_submit(member, request);
+}
+
+bool stripe_member_busy(int member) {
+	pthread_mutex_lock(&stripe_members[member].mutex);
+	bool busy = stripe_members[member].queued > 0;
+	pthread_mutex_unlock(&stripe_members[member].mutex);
+	return busy;
+}
+
+/* Sequential reads entering a new stripe unit prefetch the next full stripe on all members */
+void stripe_readahead(ListFS *fs, ListFS_BlockIndex index) {
+	pthread_mutex_lock(&stripe_readahead_mutex);
+	bool sequential = (index == stripe_last_read + 1);
+	stripe_last_read = index;
+	if (!sequential) {
+		stripe_readahead_unit = -1;
+	}
+	ListFS_BlockIndex unit = index / stripe_width;
+	ListFS_BlockIndex first = unit + 1, last = unit + stripe_count;
+	if ((stripe_readahead_unit != -1) && (stripe_readahead_unit >= first)) {
+		first = stripe_readahead_unit + 1;
+	}
+	if (!sequential || !stripe_running || (first > last)) {
+		pthread_mutex_unlock(&stripe_readahead_mutex);
+		return;
+	}
+	stripe_readahead_unit = last;
+	pthread_mutex_unlock(&stripe_readahead_mutex);
+	for (; first <= last; first++) {
+		off_t offset;
+		int member = stripe_map(fs, first * stripe_width, &offset);
+		StripeRequest *request = stripe_request(STRIPE_READAHEAD, offset, NULL, 0);
+		request->length = stripe_width * fs->block_size;
+		stripe_submit(&stripe_members[member], request);
+	}
+}
+
+void stripe_flush(ListFS *fs) {
+	StripeBatch batch;
+	int i;
+	stripe_batch_init(&batch);
+	for (i = 0; i < stripe_count; i++) {
+		stripe_submit(&stripe_members[i], stripe_request(STRIPE_FLUSH, 0, &batch, 0));
+	}
+	stripe_wait(&batch);
+}
+
+void stripe_discard(ListFS *fs, ListFS_BlockIndex index, ListFS_BlockCount count) {
+	while (count) {
+		off_t offset;
+		int member = stripe_map(fs, index, &offset);
+		ListFS_BlockCount chunk = stripe_width - index % stripe_width;
+		if (chunk > count) {
+			chunk = count;
 		}
-		device_file = fopen(file_name, "r+");
-		if (!listfs_open(fs)) {
-			fprintf(stderr, "Failed to open ListFS volume! Maybe this is not ListFS?\n");
+		discard_range(stripe_members[member].fd, stripe_members[member].is_block, offset, chunk * fs->block_size);
+		index += chunk;
+		count -= chunk;
+	}
+}
+
+/* New members get labels with the current width, existing ones must carry matching labels in given order */
+bool stripe_check_labels(char *file_names, bool create) {
+	StripeLabel *label = calloc(STRIPE_LABEL_SIZE, 1);
+	uint64_t volume_id = 0;
+	bool result = true;
+	int i;
+	if (create) {
+		struct timespec now;
+		clock_gettime(CLOCK_REALTIME, &now);
+		volume_id = ((uint64_t)now.tv_sec << 32) ^ now.tv_nsec ^ ((uint64_t)getpid() << 16);
+	}
+	for (i = 0; (i < stripe_count) && result; i++) {
+		if (create) {
+			label->magic = STRIPE_LABEL_MAGIC;
+			label->member = i;
+			label->count = stripe_count;
+			label->width = stripe_width;
+			label->volume_id = volume_id;
+			result = pwrite(stripe_members[i].fd, label, STRIPE_LABEL_SIZE, 0) == STRIPE_LABEL_SIZE;
+			if (!result) {
+				fprintf(stderr, "Failed to write stripe label of member %i!\n", i);
+			}
+			continue;
 		}
-		int i;
-		for (i = 3; i < argc; i++) {
-			argv[i - 2] = argv[i];
+		if ((pread(stripe_members[i].fd, label, sizeof(StripeLabel), 0) != sizeof(StripeLabel)) ||
+				(label->magic != STRIPE_LABEL_MAGIC)) {
+			fprintf(stderr, "Member %i of '%s' has no stripe label!\n", i, file_names);
+			result = false;
+		} else if (label->count != stripe_count) {
+			fprintf(stderr, "Volume was striped over %u members, %i given!\n", label->count, stripe_count);
+			result = false;
+		} else if (label->member != i) {
+			fprintf(stderr, "Member %i of '%s' is member %u of the volume, members must be given in order!\n",
+				i, file_names, label->member);
+			result = false;
+		} else if ((i > 0) && (label->volume_id != volume_id)) {
+			fprintf(stderr, "Member %i of '%s' belongs to another volume!\n", i, file_names);
+			result = false;
+		} else if ((i > 0) && (label->width != stripe_width)) {
+			fprintf(stderr, "Member %i of '%s' has stripe width %llu, expected %llu!\n", i, file_names,
+				label->width, stripe_width);
+			result = false;
 		}
-		return fuse_main(argc - 2, argv, &listfs_operations, NULL);
-#endif
-	} else if (strcmp(action, "dump") == 0) {
-		device_file = fopen(file_name, "r+");
-		if (!listfs_open(fs)) {
-			fprintf(stderr, "Failed to open ListFS volume! Maybe this is not ListFS?\n");
+		volume_id = label->volume_id;
+		stripe_width = label->width;
+	}
+	free(label);
+	return result;
+}
+
+bool open_stripe(char *file_names, int flags) {
+	char *names = strdup(file_names);
+	char *name, *saveptr;
+	device_is_block = true;
+	for (name = strtok_r(names, ",", &saveptr); name; name = strtok_r(NULL, ",", &saveptr)) {
+		int fd = open(name, flags, 0644);
+		if (fd == -1) {
+			fprintf(stderr, "Failed to open '%s'!\n", name);
+			free(names);
+			return false;
+		}
+		stripe_members = realloc(stripe_members, (stripe_count + 1) * sizeof(StripeMember));
+		StripeMember *member = &stripe_members[stripe_count++];
+		struct stat st;
+		member->fd = fd;
+		member->is_block = (fstat(fd, &st) == 0) && S_ISBLK(st.st_mode);
+		pthread_mutex_init(&member->mutex, NULL);
+		pthread_cond_init(&member->cond, NULL);
+		pthread_cond_init(&member->done_cond, NULL);
+		member->head = NULL;
+		member->tail = NULL;
+		member->queued = 0;
+		device_is_block = device_is_block && member->is_block;
+	}
+	free(names);
+	if (!stripe_count) {
+		fprintf(stderr, "No files or devices in '%s'!\n", file_names);
+		return false;
+	}
+	if (!stripe_check_labels(file_names, flags & O_TRUNC)) {
+		return false;
+	}
+	device_fd = stripe_members[0].fd;
+	stripe_start();
+	/* Queued writes must reach members before the tool exits */
+	atexit(stripe_stop);
+	return true;
+}
+
+bool open_device(char *file_name, int flags) {
+	if (strchr(file_name, ',')) {
+		return open_stripe(file_name, flags);
+	}
+	device_fd = open(file_name, flags, 0644);
+	if (device_fd == -1) {
+		fprintf(stderr, "Failed to open '%s'!\n", file_name);
+		return false;
+	}
+	struct stat st;
+	device_is_block = (fstat(device_fd, &st) == 0) && S_ISBLK(st.st_mode);
+	return true;
+}
+
+void read_block_func(ListFS *fs, ListFS_BlockIndex index, void *buffer) {
+	if (stripe_count) {
+		off_t offset;
+		int member = stripe_map(fs, index, &offset);
+		if (stripe_running && stripe_member_busy(member)) {
+			/* Queued writes of the member must land first */
+			stripe_transfer(fs, STRIPE_READ, index, buffer, 1);
+		} else if (pread(stripe_members[member].fd, buffer, fs->block_size, offset) != fs->block_size) {
+			/* Idle member is read in place, thread hand-off would only add latency */
+			memset(buffer, 0, fs->block_size);
+		}
+		stripe_readahead(fs, index);
+		return;
+	}
+	pread(device_fd, buffer, fs->block_size, index * fs->block_size + fs->header->base);
+}
+
+void read_blocks_func(ListFS *fs, ListFS_BlockIndex index, void *buffer, ListFS_BlockCount count) {
+	if (stripe_count) {
+		stripe_transfer(fs, STRIPE_READ, index, buffer, count);
+		return;
+	}
+	pread(device_fd, buffer, count * fs->block_size, index * fs->block_size + fs->header->base);
+}
+
+void write_block_func(ListFS *fs, ListFS_BlockIndex index, void *buffer) {
+	if (stripe_count && stripe_running) {
+		stripe_write_behind(fs, index, buffer);
+		return;
+	} else if (stripe_count) {
+		off_t offset;
+		int member = stripe_map(fs, index, &offset);
+		pwrite(stripe_members[member].fd, buffer, fs->block_size, offset);
+		return;
+	}
+	pwrite(device_fd, buffer, fs->block_size, index * fs->block_size + fs->header->base);
+}
+
+void write_blocks_func(ListFS *fs, ListFS_BlockIndex index, void *buffer, ListFS_BlockCount count) {
+	if (stripe_count) {
+		stripe_transfer(fs, STRIPE_WRITE, index, buffer, count);
+		return;
+	}
+	pwrite(device_fd, buffer, count * fs->block_size, index * fs->block_size + fs->header->base);
+}
+
+void flush_func(ListFS *fs) {
+	if (stripe_count) {
+		stripe_flush(fs);
+		return;
+	}
+	fdatasync(device_fd);
+}
+
+void discard_func(ListFS *fs, ListFS_BlockIndex index, ListFS_BlockCount count) {
+	if (stripe_count) {
+		stripe_discard(fs, index, count);
+		return;
+	}
+	discard_range(device_fd, device_is_block, index * fs->block_size + fs->header->base, count * fs->block_size);
+}
+
+bool format_device(ListFS_BlockCount size, uint32_t block_size, uint8_t *bootloader, size_t bootloader_size) {
+	/* Image files were just truncated, so they read as zeros, unlike block devices */
+	bool zeroed = !device_is_block;
+	size_t i;
+	for (i = 0; i < stripe_count; i++) {
+		zeroed = zeroed && !stripe_members[i].is_block;
+	}
+	if (discard) {
+		fs->discard_func = discard_func;
+	}
+	if (!listfs_format(fs, size, block_size, bootloader, bootloader_size, discard, zeroed)) {
+		fprintf(stderr, "Failed to create file system!\n");
+		return false;
+	}
+	return true;
+}
+
+void log_func(ListFS *fs, char *fmt, va_list ap) {
+	vfprintf(log_file, fmt, ap);
+}
+
+char readme_text[] = "This is first file on your ListFS!\n";
+
+/*
+	dump reads the whole tree in disk order with listfs_scan first, then prints it in tree order. Only the
+	fields it prints are kept for every node, block lists are counted during the scan and read again while
+	printing, so memory does not grow with the block size.
+*/
+
+typedef struct {
+	ListFS_BlockIndex node;
+	ListFS_BlockIndex next;
+	ListFS_BlockIndex data;
+	ListFS_BlockIndex index;
+	uint32_t flags;
+	uint64_t size;
+	ListFS_Aggregates aggregates;
+	char *name;
+} DumpNode;
+
+typedef struct {
+	ListFS_BlockIndex node;
+	uint64_t sequence;
+	ListFS_BlockIndex block;
+	ListFS_BlockCount blocks;
+	ListFS_BlockCount shared;
+} DumpList;
+
+DumpNode *dump_nodes = NULL;
+size_t dump_node_count = 0;
+DumpList *dump_lists = NULL;
+size_t dump_list_count = 0;
+
+bool dump_scan_node_callback(ListFS *fs, ListFS_BlockIndex node, ListFS_NodeHeader *header, void *data) {
+	if ((dump_node_count & (dump_node_count - 1)) == 0) {
+		dump_nodes = realloc(dump_nodes, (dump_node_count ? dump_node_count * 2 : 1) * sizeof(DumpNode));
+	}
+	DumpNode *entry = &dump_nodes[dump_node_count++];
+	entry->node = node;
+	entry->next = header->next;
+	entry->data = header->data;
+	entry->index = header->index;
+	entry->flags = header->flags;
+	entry->size = header->size;
+	entry->aggregates = header->aggregates;
+	entry->name = strndup(header->name, sizeof(header->name));
+	return true;
+}
+
+bool dump_scan_list_callback(ListFS *fs, ListFS_BlockIndex node, ListFS_BlockIndex block, ListFS_BlockIndex *list, void *data) {
+	size_t block_list_size = fs->block_size / sizeof(ListFS_BlockIndex);
+	if ((dump_list_count & (dump_list_count - 1)) == 0) {
+		dump_lists = realloc(dump_lists, (dump_list_count ? dump_list_count * 2 : 1) * sizeof(DumpList));
+	}
+	/* Lists of a file arrive in order, so sequence keeps it through sorting */
+	DumpList *entry = &dump_lists[dump_list_count];
+	entry->node = node;
+	entry->sequence = dump_list_count;
+	entry->block = block;
+	entry->blocks = 0;
+	entry->shared = 0;
+	size_t i;
+	for (i = 1; i < block_list_size - 1; i++) {
+		if (list[i] == -1) continue;
+		entry->blocks++;
+		if (listfs_get_refcount(fs, list[i])) {
+			entry->shared++;
+		}
+	}
+	dump_list_count++;
+	return true;
+}
+
+int dump_node_compare(const void *a, const void *b) {
+	ListFS_BlockIndex x = ((DumpNode*)a)->node, y = ((DumpNode*)b)->node;
+	return (x > y) - (x < y);
+}
+
+int dump_list_compare(const void *a, const void *b) {
+	const DumpList *x = a, *y = b;
+	if (x->node != y->node) {
+		return (x->node > y->node) - (x->node < y->node);
+	}
+	return (x->sequence > y->sequence) - (x->sequence < y->sequence);
+}
+
+DumpNode *find_dump_node(ListFS_BlockIndex node) {
+	DumpNode key;
+	key.node = node;
+	return bsearch(&key, dump_nodes, dump_node_count, sizeof(DumpNode), dump_node_compare);
+}
+
+DumpList *find_dump_lists(ListFS_BlockIndex node, size_t *count) {
+	size_t low = 0, high = dump_list_count;
+	while (low < high) {
+		size_t middle = (low + high) / 2;
+		if (dump_lists[middle].node < node) {
+			low = middle + 1;
+		} else {
+			high = middle;
+		}
+	}
+	*count = 0;
+	while ((low + *count < dump_list_count) && (dump_lists[low + *count].node == node)) {
+		(*count)++;
+	}
+	return &dump_lists[low];
+}
+
+void dump_block_lists(DumpList *lists, size_t count, char *ident) {
+	size_t block_list_size = fs->block_size / sizeof(ListFS_BlockIndex);
+	ListFS_BlockIndex *list = malloc(fs->block_size);
+	size_t i, j;
+	for (i = 0; i < count; i++) {
+		listfs_read_block(fs, lists[i].block, list);
+		printf("%s\tBlock list %lli (next = %lli, prev = %lli):\n", ident, lists[i].block, list[block_list_size - 1], list[0]);
+		for (j = 1; j < block_list_size - 1; j++) {
+			if (list[j] == -1) break;
+			printf("%s\t\tBlock %llu\n", ident, list[j]);
+		}
+	}
+	free(list);
+}
+
+void dump_count_blocks(DumpList *lists, size_t count, ListFS_BlockCount *blocks, ListFS_BlockCount *shared) {
+	size_t i;
+	*blocks = 0;
+	*shared = 0;
+	for (i = 0; i < count; i++) {
+		*blocks += lists[i].blocks;
+		*shared += lists[i].shared;
+	}
+}
+
+void dump_index(ListFS_BlockIndex index_block, char *ident) {
+	ListFS_IndexHeader *index = malloc(fs->block_size);
+	listfs_read_block(fs, index_block, index);
+	printf("%s\tIndex %llu (entries = %llu, depth = %u, table = %lli, table size = %llu)\n", ident, index_block,
+		index->count, index->depth, index->table_base, index->table_size);
+	free(index);
+}
+
+void dump_aggregates(ListFS_Aggregates *aggregates, char *ident) {
+	printf("%s\tAggregates: %llu bytes, %llu blocks, %llu entries\n", ident, aggregates->size, aggregates->blocks,
+		aggregates->entries);
+}
+
+void dump_chain(ListFS_BlockIndex node, char *ident) {
+	while (node != -1) {
+		DumpNode *entry = find_dump_node(node);
+		if (!entry) break;
+		printf("%sNode %llu (name = '%s', flags = %u, size = %llu, data = %lli)\n", ident, node, entry->name, entry->flags,
+			entry->size, entry->data);
+		size_t list_count;
+		DumpList *lists = find_dump_lists(node, &list_count);
+		ListFS_BlockCount blocks, shared;
+		dump_count_blocks(lists, list_count, &blocks, &shared);
+		if (entry->flags & LISTFS_NODE_FLAG_COMPRESSED) {
+			uint64_t stored = blocks * (uint64_t)fs->block_size;
+			printf("%s\tCompressed: %llu bytes stored, ratio %.2f\n", ident, stored, stored ? (double)entry->size / stored : 0.0);
+		}
+		if (shared) {
+			printf("%s\tShared blocks: %llu\n", ident, shared);
+		}
+		if (entry->flags & LISTFS_NODE_FLAG_INDEXED) {
+			dump_index(entry->index, ident);
+		}
+		if ((entry->flags & LISTFS_NODE_FLAG_DIRECTORY) && fs->ext_header && (fs->ext_header->flags & LISTFS_EXT_FLAG_AGGREGATES)) {
+			dump_aggregates(&entry->aggregates, ident);
+		}
+		if (entry->flags & LISTFS_NODE_FLAG_DIRECTORY) {
+			char new_ident[strlen(ident) + 2];
+			strcpy(new_ident, ident);
+			new_ident[strlen(ident)] = '\t';
+			new_ident[strlen(ident) + 1] = 0;
+			dump_chain(entry->data, new_ident);
+		} else {
+			dump_block_lists(lists, list_count, ident);
+		}
+		node = entry->next;
+	}
+}
+
+void dump_tree(void) {
+	listfs_scan(fs, fs->header->root_dir, dump_scan_node_callback, dump_scan_list_callback, NULL);
+	qsort(dump_nodes, dump_node_count, sizeof(DumpNode), dump_node_compare);
+	qsort(dump_lists, dump_list_count, sizeof(DumpList), dump_list_compare);
+	dump_chain(fs->header->root_dir, "\t");
+	size_t i;
+	for (i = 0; i < dump_node_count; i++) {
+		free(dump_nodes[i].name);
+	}
+	free(dump_lists);
+	free(dump_nodes);
+}
+
+typedef struct {
+	uint64_t files;
+	uint64_t fragmented_files;
+	uint64_t extents;
+	uint64_t directories;
+	uint64_t scattered_entries;
+	uint64_t relocated_files;
+	uint64_t relocated_entries;
+	uint64_t skipped;
+} DefragStats;
+
+typedef struct {
+	ListFS_BlockIndex node;
+	uint64_t sequence;
+	ListFS_BlockIndex first;
+	ListFS_BlockIndex last;
+	uint64_t breaks;
+} DefragListExtents;
+
+typedef struct {
+	DefragStats *stats;
+	DefragListExtents *lists;
+	size_t list_count;
+} DefragScoreState;
+
+typedef struct {
+	ListFS_BlockIndex last;
+	uint64_t extents;
+	ListFS_BlockCount blocks;
+} FileExtentState;
+
+bool file_extent_callback(ListFS *fs, ListFS_BlockIndex block, bool block_list, void *data) {
+	FileExtentState *state = data;
+	if (block != state->last + 1) {
+		state->extents++;
+	}
+	state->last = block;
+	state->blocks++;
+	return true;
+}
+
+void get_file_extents(ListFS_NodeHeader *header, FileExtentState *state) {
+	state->last = -2;
+	state->extents = 0;
+	state->blocks = 0;
+	listfs_foreach_block(fs, header->data, file_extent_callback, state);
+}
+
+bool defrag_score_node_callback(ListFS *fs, ListFS_BlockIndex node, ListFS_NodeHeader *header, void *data) {
+	DefragScoreState *state = data;
+	if ((header->next != -1) && (header->next != node + 1)) {
+		state->stats->scattered_entries++;
+	}
+	if (header->flags & LISTFS_NODE_FLAG_DIRECTORY) {
+		state->stats->directories++;
+	} else {
+		state->stats->files++;
+	}
+	return true;
+}
+
+bool defrag_score_list_callback(ListFS *fs, ListFS_BlockIndex node, ListFS_BlockIndex block, ListFS_BlockIndex *list, void *data) {
+	/* Block list comes first in its extent like in listfs_foreach_block order */
+	DefragScoreState *state = data;
+	if ((state->list_count & (state->list_count - 1)) == 0) {
+		state->lists = realloc(state->lists, (state->list_count ? state->list_count * 2 : 1) * sizeof(DefragListExtents));
+	}
+	DefragListExtents *extents = &state->lists[state->list_count];
+	extents->node = node;
+	extents->sequence = state->list_count;
+	extents->first = block;
+	extents->last = block;
+	extents->breaks = 0;
+	state->list_count++;
+	size_t block_list_size = fs->block_size / sizeof(ListFS_BlockIndex);
+	size_t i;
+	for (i = 1; i < block_list_size - 1; i++) {
+		if (list[i] == -1) continue;
+		if (list[i] != extents->last + 1) {
+			extents->breaks++;
+		}
+		extents->last = list[i];
+	}
+	return true;
+}
+
+int defrag_list_compare(const void *a, const void *b) {
+	const DefragListExtents *x = a, *y = b;
+	if (x->node != y->node) {
+		return (x->node > y->node) - (x->node < y->node);
+	}
+	return (x->sequence > y->sequence) - (x->sequence < y->sequence);
+}
+
+void defrag_score(DefragStats *stats) {
+	memset(stats, 0, sizeof(DefragStats));
+	DefragScoreState state;
+	state.stats = stats;
+	state.lists = NULL;
+	state.list_count = 0;
+	listfs_scan(fs, fs->header->root_dir, defrag_score_node_callback, defrag_score_list_callback, &state);
+	/* Lists of each file are joined back in order to count extents across their boundaries */
+	qsort(state.lists, state.list_count, sizeof(DefragListExtents), defrag_list_compare);
+	size_t i = 0;
+	while (i < state.list_count) {
+		ListFS_BlockIndex node = state.lists[i].node, last = -2;
+		uint64_t extents = 0;
+		for (; (i < state.list_count) && (state.lists[i].node == node); i++) {
+			if (state.lists[i].first != last + 1) {
+				extents++;
+			}
+			extents += state.lists[i].breaks;
+			last = state.lists[i].last;
+		}
+		stats->extents += extents;
+		if (extents > 1) {
+			stats->fragmented_files++;
+		}
+	}
+	free(state.lists);
+}
+
+void print_defrag_stats(char *title, DefragStats *stats) {
+	printf("%s:\n\tFiles: %llu (%llu fragmented, %llu extents)\n\tDirectories: %llu (%llu scattered entries)\n",
+		title, stats->files, stats->fragmented_files, stats->extents, stats->directories, stats->scattered_entries);
+}
+
+ListFS_BlockIndex first_child(ListFS_BlockIndex parent) {
+	if (parent == -1) {
+		return fs->header->root_dir;
+	}
+	ListFS_NodeHeader *header = listfs_borrow_node(fs, parent);
+	ListFS_BlockIndex first = header->data;
+	listfs_put_buffer(fs, header);
+	return first;
+}
+
+void defrag_directory(ListFS_BlockIndex parent, DefragStats *stats) {
+	ListFS_BlockIndex node = first_child(parent);
+	ListFS_BlockCount count = 0;
+	bool contiguous = true;
+	while (node != -1) {
+		ListFS_NodeHeader *header = listfs_borrow_node(fs, node);
+		if ((header->next != -1) && (header->next != node + 1)) {
+			contiguous = false;
+		}
+		node = header->next;
+		listfs_put_buffer(fs, header);
+		count++;
+	}
+	if (!contiguous) {
+		ListFS_BlockIndex target = listfs_find_free_run(fs, count, (parent != -1) ? parent + 1 : fs->header->map_base + fs->header->map_size);
+		if (target != -1) {
+			node = first_child(parent);
+			while (node != -1) {
+				ListFS_NodeHeader *header = listfs_borrow_node(fs, node);
+				ListFS_BlockIndex next = header->next;
+				listfs_put_buffer(fs, header);
+				listfs_relocate_node(fs, node, target);
+				stats->relocated_entries++;
+				target++;
+				node = next;
+			}
+		} else {
+			stats->skipped++;
+		}
+	}
+	node = first_child(parent);
+	while (node != -1) {
+		ListFS_NodeHeader *header = listfs_borrow_node(fs, node);
+		if (header->flags & LISTFS_NODE_FLAG_DIRECTORY) {
+			defrag_directory(node, stats);
+		} else {
+			FileExtentState extents;
+			get_file_extents(header, &extents);
+			if (extents.extents > 1) {
+				ListFS_BlockIndex target = listfs_find_free_run(fs, extents.blocks, node + 1);
+				/* Files sharing blocks with clones are refused and stay where they are */
+				if ((target != -1) && listfs_relocate_file(fs, node, target)) {
+					stats->relocated_files++;
+				} else {
+					stats->skipped++;
+				}
+			}
+		}
+		node = header->next;
+		listfs_put_buffer(fs, header);
+	}
+}
+
+int worker_count() {
+	if (jobs > 0) {
+		return jobs;
+	}
+	long count = sysconf(_SC_NPROCESSORS_ONLN);
+	return (count > 0) ? count : 1;
+}
+
+void run_workers(void *(*func)(void*), void *arg) {
+	int count = worker_count();
+	pthread_t threads[count];
+	int i;
+	for (i = 0; i < count; i++) {
+		pthread_create(&threads[i], NULL, func, arg);
+	}
+	for (i = 0; i < count; i++) {
+		pthread_join(threads[i], NULL);
+	}
+}
+
+bool load_bootloader(char *file_name, uint8_t **bootloader, size_t *bootloader_size) {
+	FILE *bootloader_file = fopen(file_name, "r");
+	if (!bootloader_file) {
+		printf("Failed to open '%s'!\n", file_name);
+		return false;
+	}
+	while (feof(bootloader_file) == 0) {
+		size_t offset = *bootloader_size;
+		*bootloader_size += LISTFS_MIN_BLOCK_SIZE;
+		*bootloader = realloc(*bootloader, *bootloader_size);
+		if (fread(*bootloader + offset, LISTFS_MIN_BLOCK_SIZE, 1, bootloader_file) == 0) {
+			*bootloader_size = offset;
+			break;
+		}
+	}
+	fclose(bootloader_file);
+	return true;
+}
+
+typedef struct {
+	char *path;
+	char name[256];
+	bool directory;
+	uint64_t size;
+	uint64_t time;
+	size_t first_child;
+	size_t child_count;
+	ListFS_BlockIndex node;
+	ListFS_BlockIndex data;
+} PackEntry;
+
+PackEntry *pack_entries = NULL;
+size_t pack_entry_count = 0;
+size_t pack_next_entry = 0;
+
+int pack_entry_compare(const void *a, const void *b) {
+	return strcmp(((const PackEntry*)a)->name, ((const PackEntry*)b)->name);
+}
+
+bool pack_scan(char *path, size_t *first_child, size_t *child_count) {
+	DIR *dir = opendir(path);
+	if (!dir) {
+		fprintf(stderr, "Failed to open '%s'!\n", path);
+		return false;
+	}
+	size_t first = pack_entry_count;
+	struct dirent *dir_entry;
+	while ((dir_entry = readdir(dir))) {
+		if ((strcmp(dir_entry->d_name, ".") == 0) || (strcmp(dir_entry->d_name, "..") == 0)) continue;
+		char *entry_path = malloc(strlen(path) + strlen(dir_entry->d_name) + 2);
+		sprintf(entry_path, "%s/%s", path, dir_entry->d_name);
+		struct stat st;
+		if ((strlen(dir_entry->d_name) > 255) || (lstat(entry_path, &st) != 0) || !(S_ISREG(st.st_mode) || S_ISDIR(st.st_mode))) {
+			fprintf(stderr, "Skipping '%s'\n", entry_path);
+			free(entry_path);
+			continue;
+		}
+		pack_entries = realloc(pack_entries, (pack_entry_count + 1) * sizeof(PackEntry));
+		PackEntry *entry = &pack_entries[pack_entry_count];
+		pack_entry_count++;
+		memset(entry, 0, sizeof(PackEntry));
+		entry->path = entry_path;
+		strcpy(entry->name, dir_entry->d_name);
+		entry->directory = S_ISDIR(st.st_mode);
+		entry->size = entry->directory ? 0 : st.st_size;
+		entry->time = st.st_mtime;
+	}
+	closedir(dir);
+	*first_child = first;
+	*child_count = pack_entry_count - first;
+	qsort(&pack_entries[first], *child_count, sizeof(PackEntry), pack_entry_compare);
+	size_t i;
+	for (i = first; i < first + *child_count; i++) {
+		if (pack_entries[i].directory) {
+			size_t sub_first, sub_count;
+			if (!pack_scan(pack_entries[i].path, &sub_first, &sub_count)) return false;
+			pack_entries[i].first_child = sub_first;
+			pack_entries[i].child_count = sub_count;
+		}
+	}
+	return true;
+}
+
+ListFS_BlockCount pack_file_blocks(uint64_t size, uint32_t block_size) {
+	ListFS_BlockCount data_blocks = (size + block_size - 1) / block_size;
+	ListFS_BlockCount block_list_size = block_size / sizeof(ListFS_BlockIndex) - 2;
+	return data_blocks + (data_blocks + block_list_size - 1) / block_list_size;
+}
+
+void pack_plan(size_t first, size_t count, uint32_t block_size, ListFS_BlockIndex *next_block) {
+	size_t i;
+	for (i = first; i < first + count; i++) {
+		pack_entries[i].node = *next_block;
+		(*next_block)++;
+	}
+	for (i = first; i < first + count; i++) {
+		if (pack_entries[i].directory) continue;
+		if (compress) {
+			pack_entries[i].data = -1;
+			continue;
+		}
+		pack_entries[i].data = pack_entries[i].size ? *next_block : -1;
+		*next_block += pack_file_blocks(pack_entries[i].size, block_size);
+	}
+	for (i = first; i < first + count; i++) {
+		if (pack_entries[i].directory) {
+			pack_plan(pack_entries[i].first_child, pack_entries[i].child_count, block_size, next_block);
+		}
+	}
+}
+
+void pack_write_nodes(size_t first, size_t count, ListFS_BlockIndex parent) {
+	if (count == 0) return;
+	uint8_t *buffer = calloc(count, fs->block_size);
+	size_t i;
+	for (i = first; i < first + count; i++) {
+		PackEntry *entry = &pack_entries[i];
+		ListFS_NodeHeader *header = (void*)(buffer + (i - first) * fs->block_size);
+		strcpy(header->name, entry->name);
+		header->parent = parent;
+		header->prev = (i > first) ? pack_entries[i - 1].node : -1;
+		header->next = (i + 1 < first + count) ? pack_entries[i + 1].node : -1;
+		if (entry->directory) {
+			header->data = entry->child_count ? pack_entries[entry->first_child].node : -1;
+		} else {
+			header->data = entry->data;
+		}
+		header->magic = LISTFS_NODE_MAGIC;
+		if (entry->directory) {
+			header->flags = LISTFS_NODE_FLAG_DIRECTORY;
+		} else {
+			header->flags = compress ? LISTFS_NODE_FLAG_COMPRESSED : 0;
+		}
+		header->size = compress ? 0 : entry->size;
+		header->create_time = entry->time;
+		header->modify_time = entry->time;
+		header->access_time = entry->time;
+	}
+	write_blocks_func(fs, pack_entries[first].node, buffer, count);
+	free(buffer);
+	for (i = first; i < first + count; i++) {
+		if (pack_entries[i].directory) {
+			pack_write_nodes(pack_entries[i].first_child, pack_entries[i].child_count, pack_entries[i].node);
+		}
+	}
+}
+
+#define PACK_STREAM_SIZE (1024 * 1024)
+
+size_t stream_buffer_size() {
+	size_t size = (fs->block_size < PACK_STREAM_SIZE) ? (PACK_STREAM_SIZE / fs->block_size * fs->block_size) : fs->block_size;
+	/* Compressed clusters are decoded next to their stored blocks */
+	size_t cluster_blocks = listfs_cluster_blocks(fs->block_size);
+	if (size < (2 * cluster_blocks - 1) * fs->block_size) {
+		size = (2 * cluster_blocks - 1) * fs->block_size;
+	}
+	return size;
+}
+
+typedef struct {
+	uint8_t *buffer;
+	size_t size;
+	size_t used;
+	ListFS_BlockIndex block;
+} PackStream;
+
+void pack_stream_flush(PackStream *stream) {
+	write_blocks_func(fs, stream->block, stream->buffer, stream->used / fs->block_size);
+	stream->block += stream->used / fs->block_size;
+	stream->used = 0;
+}
+
+void pack_write_file(PackEntry *entry, PackStream *stream) {
+	uint32_t block_size = fs->block_size;
+	size_t block_list_size = block_size / sizeof(ListFS_BlockIndex);
+	int fd = open(entry->path, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to open '%s'!\n", entry->path);
+	}
+	ListFS_BlockCount data_blocks = (entry->size + block_size - 1) / block_size;
+	ListFS_BlockIndex list_block = entry->data;
+	ListFS_BlockIndex prev_list = -1;
+	stream->used = 0;
+	stream->block = list_block;
+	while (data_blocks) {
+		ListFS_BlockCount count = (data_blocks < block_list_size - 2) ? data_blocks : (block_list_size - 2);
+		if (stream->used == stream->size) {
+			pack_stream_flush(stream);
+		}
+		ListFS_BlockIndex *list = (void*)(stream->buffer + stream->used);
+		memset(list, 0xFF, block_size);
+		list[0] = prev_list;
+		size_t i;
+		for (i = 0; i < count; i++) {
+			list[i + 1] = list_block + 1 + i;
+		}
+		if (data_blocks > count) {
+			list[block_list_size - 1] = list_block + 1 + count;
+		}
+		stream->used += block_size;
+		ListFS_BlockCount remaining = count;
+		while (remaining) {
+			if (stream->used == stream->size) {
+				pack_stream_flush(stream);
+			}
+			size_t length = (stream->size - stream->used) / block_size;
+			if (length > remaining) {
+				length = remaining;
+			}
+			length *= block_size;
+			size_t done = 0;
+			while (fd != -1 && done < length) {
+				ssize_t result = read(fd, stream->buffer + stream->used + done, length - done);
+				if (result <= 0) break;
+				done += result;
+			}
+			memset(stream->buffer + stream->used + done, 0, length - done);
+			stream->used += length;
+			remaining -= length / block_size;
+		}
+		prev_list = list_block;
+		list_block += 1 + count;
+		data_blocks -= count;
+	}
+	pack_stream_flush(stream);
+	if (fd != -1) {
+		close(fd);
+	}
+}
+
+ListFS_BlockCount pack_compressed_blocks(uint64_t size, uint32_t block_size) {
+	size_t cluster_blocks = listfs_cluster_blocks(block_size);
+	uint64_t cluster_size = (cluster_blocks - 1) * (uint64_t)block_size;
+	uint64_t tail = size % cluster_size;
+	ListFS_BlockCount data_blocks = size / cluster_size * cluster_blocks;
+	if (tail) {
+		data_blocks += (sizeof(uint32_t) + tail + block_size - 1) / block_size;
+	}
+	return pack_file_blocks(data_blocks * block_size, block_size);
+}
+
+void pack_write_compressed(PackEntry *entry, uint8_t *buffer, size_t buffer_size) {
+	int fd = open(entry->path, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to open '%s'!\n", entry->path);
+		return;
+	}
+	ListFS_OpennedFile *file = listfs_open_file(fs, entry->node);
+	ssize_t result;
+	while ((result = read(fd, buffer, buffer_size)) > 0) {
+		listfs_file_write(file, buffer, result);
+	}
+	listfs_file_close(file);
+	close(fd);
+}
+
+void pack_set_time(PackEntry *entry) {
+	ListFS_NodeHeader *header = malloc(fs->block_size);
+	read_block_func(fs, entry->node, header);
+	header->modify_time = entry->time;
+	header->access_time = entry->time;
+	write_block_func(fs, entry->node, header);
+	free(header);
+}
+
+void *pack_worker(void *arg) {
+	PackStream stream;
+	stream.size = stream_buffer_size();
+	stream.buffer = malloc(stream.size);
+	while (true) {
+		size_t i = __atomic_fetch_add(&pack_next_entry, 1, __ATOMIC_RELAXED);
+		if (i >= pack_entry_count) break;
+		if (pack_entries[i].directory || (pack_entries[i].size == 0)) continue;
+		pack_write_file(&pack_entries[i], &stream);
+	}
+	free(stream.buffer);
+	return NULL;
+}
+
+typedef struct {
+	ListFS_BlockIndex block;
+	ListFS_BlockCount count;
+	uint64_t offset;
+} FileExtent;
+
+typedef struct {
+	char *path;
+	bool directory;
+	bool compressed;
+	uint64_t size;
+	uint64_t time;
+	FileExtent *extents;
+	size_t extent_count;
+} ExtractEntry;
+
+ExtractEntry *extract_entries = NULL;
+size_t extract_entry_count = 0;
+size_t extract_next_entry = 0;
+char *extract_dir;
+
+void collect_extents(ExtractEntry *entry, ListFS_BlockIndex list) {
+	uint32_t block_size = fs->block_size;
+	size_t block_list_size = block_size / sizeof(ListFS_BlockIndex);
+	ListFS_BlockIndex *blocks = malloc(block_size);
+	uint64_t offset = 0;
+	uint64_t limit = entry->size;
+	if (entry->compressed) {
+		size_t cluster_blocks = listfs_cluster_blocks(block_size);
+		uint64_t cluster_size = (cluster_blocks - 1) * (uint64_t)block_size;
+		limit = (entry->size + cluster_size - 1) / cluster_size * cluster_blocks * block_size;
+	}
+	while ((list != -1) && (offset < limit)) {
+		listfs_read_block(fs, list, blocks);
+		size_t i;
+		for (i = 1; (i < block_list_size - 1) && (offset < limit); i++, offset += block_size) {
+			if (blocks[i] == -1) continue;
+			FileExtent *last = entry->extent_count ? &entry->extents[entry->extent_count - 1] : NULL;
+			if (last && (last->block + last->count == blocks[i]) && (last->offset + last->count * block_size == offset)) {
+				last->count++;
+				continue;
+			}
+			entry->extents = realloc(entry->extents, (entry->extent_count + 1) * sizeof(FileExtent));
+			last = &entry->extents[entry->extent_count];
+			entry->extent_count++;
+			last->block = blocks[i];
+			last->count = 1;
+			last->offset = offset;
+		}
+		list = blocks[block_list_size - 1];
+	}
+	free(blocks);
+}
+
+bool extract_node_callback(ListFS *fs, ListFS_BlockIndex node, ListFS_NodeHeader *header, void *data) {
+	char *parent_path = data;
+	extract_entries = realloc(extract_entries, (extract_entry_count + 1) * sizeof(ExtractEntry));
+	ExtractEntry *entry = &extract_entries[extract_entry_count];
+	extract_entry_count++;
+	memset(entry, 0, sizeof(ExtractEntry));
+	entry->path = malloc(strlen(parent_path) + strlen(header->name) + 2);
+	sprintf(entry->path, "%s%s%s", parent_path, parent_path[0] ? "/" : "", header->name);
+	entry->directory = (header->flags & LISTFS_NODE_FLAG_DIRECTORY) != 0;
+	entry->compressed = (header->flags & LISTFS_NODE_FLAG_COMPRESSED) != 0;
+	entry->size = entry->directory ? 0 : header->size;
+	entry->time = header->modify_time;
+	if (entry->directory) {
+		char *path = entry->path;
+		listfs_foreach_node(fs, header->data, extract_node_callback, path);
+	} else {
+		collect_extents(entry, header->data);
+	}
+	return true;
+}
+
+size_t read_extent(FileExtent *extent, ListFS_BlockCount skip, uint8_t *buffer, size_t length) {
+	uint32_t block_size = fs->block_size;
+	uint64_t remaining = (extent->count - skip) * (uint64_t)block_size;
+	if (length > remaining) {
+		length = remaining;
+	}
+	if (stripe_count) {
+		ListFS_BlockCount blocks = length / block_size;
+		stripe_transfer(fs, STRIPE_READ, extent->block + skip, buffer, blocks);
+		if (length % block_size) {
+			uint8_t *tail = malloc(block_size);
+			read_block_func(fs, extent->block + skip + blocks, tail);
+			memcpy(buffer + blocks * block_size, tail, length % block_size);
+			free(tail);
+		}
+		return length;
+	}
+	off_t position = (extent->block + skip) * block_size + fs->header->base;
+	size_t done = 0;
+	while (done < length) {
+		ssize_t result = pread(device_fd, buffer + done, length - done, position + done);
+		if (result <= 0) break;
+		done += result;
+	}
+	memset(buffer + done, 0, length - done);
+	return length;
+}
+
+bool read_slot(ExtractEntry *entry, uint64_t slot, uint8_t *buffer) {
+	uint32_t block_size = fs->block_size;
+	uint64_t offset = slot * block_size;
+	size_t low = 0, high = entry->extent_count;
+	while (low < high) {
+		size_t middle = (low + high) / 2;
+		FileExtent *extent = &entry->extents[middle];
+		if (offset < extent->offset) {
+			high = middle;
+		} else if (offset >= extent->offset + extent->count * (uint64_t)block_size) {
+			low = middle + 1;
+		} else {
+			read_extent(extent, (offset - extent->offset) / block_size, buffer, block_size);
+			return true;
+		}
+	}
+	return false;
+}
+
+uint8_t *read_cluster(ExtractEntry *entry, uint64_t index, uint8_t *buffer) {
+	uint32_t block_size = fs->block_size;
+	size_t cluster_blocks = listfs_cluster_blocks(block_size);
+	size_t cluster_size = (cluster_blocks - 1) * block_size;
+	uint8_t *cluster = buffer + cluster_blocks * block_size;
+	size_t length = 0;
+	if (read_slot(entry, index * cluster_blocks, buffer)) {
+		uint32_t stored_length;
+		memcpy(&stored_length, buffer, sizeof(stored_length));
+		size_t count = (sizeof(stored_length) + (stored_length & ~LISTFS_CLUSTER_STORED) + block_size - 1) / block_size;
+		size_t i;
+		for (i = 1; (i < count) && (i < cluster_blocks); i++) {
+			if (!read_slot(entry, index * cluster_blocks + i, buffer + i * block_size)) break;
+		}
+		length = (i == count) ? listfs_decode_cluster(block_size, buffer, cluster) : (size_t)-1;
+		if (length == (size_t)-1) {
+			fprintf(stderr, "Cluster %llu of '%s' is corrupted!\n", index, entry->path);
+			length = 0;
+		}
+	}
+	memset(cluster + length, 0, cluster_size - length);
+	return cluster;
+}
+
+void extract_file(ExtractEntry *entry, uint8_t *buffer, size_t buffer_size) {
+	uint32_t block_size = fs->block_size;
+	char path[strlen(extract_dir) + strlen(entry->path) + 2];
+	sprintf(path, "%s/%s", extract_dir, entry->path);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to create '%s'!\n", path);
+		return;
+	}
+	ftruncate(fd, entry->size);
+	size_t i;
+	if (entry->compressed) {
+		uint64_t cluster_size = (listfs_cluster_blocks(block_size) - 1) * (uint64_t)block_size;
+		uint64_t offset;
+		for (offset = 0; offset < entry->size; offset += cluster_size) {
+			uint8_t *cluster = read_cluster(entry, offset / cluster_size, buffer);
+			size_t length = (entry->size - offset < cluster_size) ? (entry->size - offset) : cluster_size;
+			if (pwrite(fd, cluster, length, offset) != length) {
+				fprintf(stderr, "Failed to write '%s'!\n", path);
+			}
+		}
+	}
+	for (i = 0; !entry->compressed && (i < entry->extent_count); i++) {
+		FileExtent *extent = &entry->extents[i];
+		ListFS_BlockCount done = 0;
+		while (done < extent->count) {
+			size_t length = read_extent(extent, done, buffer, buffer_size);
+			uint64_t offset = extent->offset + done * (uint64_t)block_size;
+			size_t write_length = (offset + length > entry->size) ? (entry->size - offset) : length;
+			if (pwrite(fd, buffer, write_length, offset) != write_length) {
+				fprintf(stderr, "Failed to write '%s'!\n", path);
+			}
+			done += length / block_size;
+		}
+	}
+	struct timespec times[2];
+	times[0].tv_sec = entry->time;
+	times[0].tv_nsec = 0;
+	times[1] = times[0];
+	futimens(fd, times);
+	close(fd);
+}
+
+void *extract_worker(void *arg) {
+	size_t buffer_size = stream_buffer_size();
+	uint8_t *buffer = malloc(buffer_size);
+	while (true) {
+		size_t i = __atomic_fetch_add(&extract_next_entry, 1, __ATOMIC_RELAXED);
+		if (i >= extract_entry_count) break;
+		if (extract_entries[i].directory) continue;
+		extract_file(&extract_entries[i], buffer, buffer_size);
+	}
+	free(buffer);
+	return NULL;
+}
+
+void set_directory_time(char *path, uint64_t time) {
+	struct timespec times[2];
+	times[0].tv_sec = time;
+	times[0].tv_nsec = 0;
+	times[1] = times[0];
+	utimensat(AT_FDCWD, path, times, 0);
+}
+
+/* Tar stream functions */
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_RECORD_SIZE (TAR_BLOCK_SIZE * 20)
+
+typedef struct {
+	char name[100];
+	char mode[8];
+	char uid[8];
+	char gid[8];
+	char size[12];
+	char mtime[12];
+	char checksum[8];
+	char type;
+	char link_name[100];
+	char magic[8];
+	char user_name[32];
+	char group_name[32];
+	char dev_major[8];
+	char dev_minor[8];
+	char padding[167];
+} TarHeader;
+
+uint64_t tar_written = 0;
+
+void tar_write(void *buffer, size_t length) {
+	size_t done = 0;
+	while (done < length) {
+		ssize_t result = write(STDOUT_FILENO, (uint8_t*)buffer + done, length - done);
+		if (result <= 0) {
+			fprintf(stderr, "Failed to write tar stream!\n");
+			exit(-5);
+		}
+		done += result;
+	}
+	tar_written += length;
+}
+
+void tar_pad() {
+	uint8_t zero[TAR_BLOCK_SIZE] = {0};
+	if (tar_written % TAR_BLOCK_SIZE) {
+		tar_write(zero, TAR_BLOCK_SIZE - tar_written % TAR_BLOCK_SIZE);
+	}
+}
+
+void tar_number(char *field, size_t length, uint64_t value) {
+	if (value < (1ULL << (3 * (length - 1)))) {
+		snprintf(field, length, "%0*llo", (int)(length - 1), (unsigned long long)value);
+	} else {
+		size_t i;
+		for (i = length - 1; i > 0; i--) {
+			field[i] = value & 0xFF;
+			value >>= 8;
+		}
+		field[0] = 0x80;
+	}
+}
+
+void tar_write_header(char *name, char type, uint64_t size, uint64_t time) {
+	TarHeader header;
+	memset(&header, 0, sizeof(header));
+	size_t name_length = strlen(name);
+	if (name_length > sizeof(header.name)) {
+		tar_write_header("././@LongLink", 'L', name_length + 1, 0);
+		tar_write(name, name_length + 1);
+		tar_pad();
+	}
+	memcpy(header.name, name, (name_length < sizeof(header.name)) ? name_length : sizeof(header.name));
+	tar_number(header.mode, sizeof(header.mode), (type == '5') ? 0755 : 0644);
+	tar_number(header.uid, sizeof(header.uid), 0);
+	tar_number(header.gid, sizeof(header.gid), 0);
+	tar_number(header.size, sizeof(header.size), size);
+	tar_number(header.mtime, sizeof(header.mtime), time);
+	header.type = type;
+	memcpy(header.magic, "ustar  ", 8);
+	memset(header.checksum, ' ', sizeof(header.checksum));
+	unsigned int checksum = 0;
+	size_t i;
+	for (i = 0; i < sizeof(header); i++) {
+		checksum += ((uint8_t*)&header)[i];
+	}
+	snprintf(header.checksum, sizeof(header.checksum), "%06o", checksum);
+	tar_write(&header, sizeof(header));
+}
+
+int export_entry_compare(const void *a, const void *b) {
+	const ExtractEntry *x = *(ExtractEntry**)a, *y = *(ExtractEntry**)b;
+	ListFS_BlockIndex x_block = x->extent_count ? x->extents[0].block : 0;
+	ListFS_BlockIndex y_block = y->extent_count ? y->extents[0].block : 0;
+	return (x_block > y_block) - (x_block < y_block);
+}
+
+void export_file(ExtractEntry *entry, uint8_t *buffer, size_t buffer_size) {
+	uint32_t block_size = fs->block_size;
+	tar_write_header(entry->path, '0', entry->size, entry->time);
+	uint64_t offset = 0;
+	size_t i;
+	if (entry->compressed) {
+		uint64_t cluster_size = (listfs_cluster_blocks(block_size) - 1) * (uint64_t)block_size;
+		for (offset = 0; offset < entry->size; offset += cluster_size) {
+			uint8_t *cluster = read_cluster(entry, offset / cluster_size, buffer);
+			tar_write(cluster, (entry->size - offset < cluster_size) ? (entry->size - offset) : cluster_size);
+		}
+		tar_pad();
+		return;
+	}
+	for (i = 0; i <= entry->extent_count; i++) {
+		FileExtent *extent = (i < entry->extent_count) ? &entry->extents[i] : NULL;
+		if ((i + 1 < entry->extent_count) && device_is_block && !stripe_count) {
+			posix_fadvise(device_fd, entry->extents[i + 1].block * block_size + fs->header->base,
+				entry->extents[i + 1].count * (uint64_t)block_size, POSIX_FADV_WILLNEED);
+		}
+		uint64_t hole_end = extent ? extent->offset : entry->size;
+		while (offset < hole_end) {
+			size_t length = (hole_end - offset < buffer_size) ? (hole_end - offset) : buffer_size;
+			memset(buffer, 0, length);
+			tar_write(buffer, length);
+			offset += length;
+		}
+		if (!extent) break;
+		ListFS_BlockCount done = 0;
+		while ((done < extent->count) && (offset < entry->size)) {
+			size_t length = read_extent(extent, done, buffer, buffer_size);
+			done += length / block_size;
+			if (offset + length > entry->size) {
+				length = entry->size - offset;
+			}
+			tar_write(buffer, length);
+			offset += length;
+		}
+	}
+	tar_pad();
+}
+
+/* Consistency check functions */
+
+typedef struct {
+	bool directory;
+	ListFS_BlockIndex block;
+	ListFS_BlockIndex parent;
+	uint64_t size;
+} CheckItem;
+
+typedef struct {
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	CheckItem *items;
+	size_t count;
+	size_t capacity;
+	size_t active;
+	uint8_t *reachable;
+	uint32_t *references;
+	uint64_t nodes;
+	uint64_t blocks;
+	uint64_t errors;
+	ListFS_BlockIndex *bad_indexes;
+	size_t bad_index_count;
+} CheckState;
+
+CheckState check_state = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+void check_error(const char *fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	pthread_mutex_lock(&check_state.mutex);
+	check_state.errors++;
+	vfprintf(stdout, fmt, args);
+	pthread_mutex_unlock(&check_state.mutex);
+	va_end(args);
+}
+
+void check_push(bool directory, ListFS_BlockIndex block, ListFS_BlockIndex parent, uint64_t size) {
+	pthread_mutex_lock(&check_state.mutex);
+	if (check_state.count == check_state.capacity) {
+		check_state.capacity = check_state.capacity ? check_state.capacity * 2 : 64;
+		check_state.items = realloc(check_state.items, check_state.capacity * sizeof(CheckItem));
+	}
+	CheckItem *item = &check_state.items[check_state.count];
+	check_state.count++;
+	item->directory = directory;
+	item->block = block;
+	item->parent = parent;
+	item->size = size;
+	pthread_cond_signal(&check_state.cond);
+	pthread_mutex_unlock(&check_state.mutex);
+}
+
+bool check_mark(ListFS_BlockIndex block, char *what, ListFS_BlockIndex owner) {
+	if ((block < fs->header->map_base + fs->header->map_size) || (block >= fs->header->size)) {
+		check_error("%s %llu of %llu is out of range\n", what, block, owner);
+		return false;
+	}
+	uint8_t bit = 1 << (block % 8);
+	if (__atomic_fetch_or(&check_state.reachable[block / 8], bit, __ATOMIC_RELAXED) & bit) {
+		check_error("%s %llu of %llu is referenced more than once\n", what, block, owner);
+		return false;
+	}
+	__atomic_fetch_add(&check_state.blocks, 1, __ATOMIC_RELAXED);
+	return true;
+}
+
+void check_file(ListFS_BlockIndex node, ListFS_BlockIndex list, uint64_t size) {
+	uint32_t block_size = fs->block_size;
+	size_t block_list_size = block_size / sizeof(ListFS_BlockIndex);
+	ListFS_BlockIndex *blocks = malloc(block_size);
+	ListFS_BlockIndex prev = -1;
+	uint64_t capacity = 0;
+	while (list != -1) {
+		if (!check_mark(list, "Block list", node)) break;
+		listfs_read_block(fs, list, blocks);
+		if (blocks[0] != prev) {
+			check_error("Block list %llu of %llu has prev = %llu, expected %llu\n", list, node, blocks[0], prev);
+		}
+		size_t i;
+		for (i = 1; i < block_list_size - 1; i++) {
+			if (blocks[i] == -1) continue;
+			if (check_state.references && listfs_get_refcount(fs, blocks[i])) {
+				/* Shared block is marked by its first owner, the rest are checked against the reference count */
+				if (__atomic_fetch_add(&check_state.references[blocks[i]], 1, __ATOMIC_RELAXED) > 0) continue;
+			}
+			check_mark(blocks[i], "Data block", node);
+		}
+		capacity += (block_list_size - 2) * (uint64_t)block_size;
+		prev = list;
+		list = blocks[block_list_size - 1];
+	}
+	if (capacity < size) {
+		check_error("File %llu is %llu bytes, but its block lists cover only %llu\n", node, size, capacity);
+	}
+	free(blocks);
+}
+
+int check_entry_compare(const void *a, const void *b) {
+	ListFS_BlockIndex x = ((const ListFS_IndexEntry*)a)->node, y = ((const ListFS_IndexEntry*)b)->node;
+	return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+int check_block_compare(const void *a, const void *b) {
+	ListFS_BlockIndex x = *(const ListFS_BlockIndex*)a, y = *(const ListFS_BlockIndex*)b;
+	return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+/* Every child of the directory must have exactly one index entry with the hash of its name */
+/* Directories whose index disagrees with their chain get a new index on repair */
+void check_bad_index(ListFS_BlockIndex dir) {
+	pthread_mutex_lock(&check_state.mutex);
+	check_state.bad_indexes = realloc(check_state.bad_indexes, (check_state.bad_index_count + 1) * sizeof(ListFS_BlockIndex));
+	check_state.bad_indexes[check_state.bad_index_count] = dir;
+	check_state.bad_index_count++;
+	pthread_mutex_unlock(&check_state.mutex);
+}
+
+void check_index(ListFS_BlockIndex dir, ListFS_BlockIndex index_block, ListFS_BlockIndex first) {
+	uint32_t block_size = fs->block_size;
+	if (!check_mark(index_block, "Index", dir)) {
+		check_bad_index(dir);
+		return;
+	}
+	ListFS_IndexHeader *index = malloc(block_size);
+	listfs_read_block(fs, index_block, index);
+	if ((index->magic != LISTFS_INDEX_MAGIC) || (index->depth > LISTFS_INDEX_MAX_DEPTH)) {
+		check_error("Index %llu of %lli has bad magic %08X or depth %u\n", index_block, dir, index->magic, index->depth);
+		check_bad_index(dir);
+		free(index);
+		return;
+	}
+	uint64_t slots = 1ULL << index->depth, mask = slots - 1, i;
+	bool table_inline = (index->table_base == -1);
+	if ((table_inline && (sizeof(ListFS_IndexHeader) + slots * sizeof(ListFS_BlockIndex) > block_size)) ||
+			(!table_inline && (index->table_size * block_size < slots * sizeof(ListFS_BlockIndex)))) {
+		check_error("Index %llu of %lli has table of %llu blocks for depth %u\n", index_block, dir, index->table_size, index->depth);
+		check_bad_index(dir);
+		free(index);
+		return;
+	}
+	ListFS_BlockIndex *table = malloc(table_inline ? (slots * sizeof(ListFS_BlockIndex)) : (index->table_size * block_size));
+	if (table_inline) {
+		memcpy(table, index->buckets, slots * sizeof(ListFS_BlockIndex));
+	} else {
+		for (i = 0; i < index->table_size; i++) {
+			if (check_mark(index->table_base + i, "Index table block", dir)) {
+				listfs_read_block(fs, index->table_base + i, (uint8_t*)table + i * block_size);
+			}
+		}
+	}
+	ListFS_BlockIndex *buckets = malloc(slots * sizeof(ListFS_BlockIndex));
+	memcpy(buckets, table, slots * sizeof(ListFS_BlockIndex));
+	qsort(buckets, slots, sizeof(ListFS_BlockIndex), check_block_compare);
+	size_t capacity = (block_size - sizeof(ListFS_IndexBucket)) / sizeof(ListFS_IndexEntry);
+	ListFS_IndexEntry *entries = NULL;
+	size_t entry_count = 0;
+	bool valid = true;
+	ListFS_IndexBucket *bucket = malloc(block_size);
+	uint64_t j;
+	for (i = 0; i < slots; i = j) {
+		for (j = i + 1; (j < slots) && (buckets[j] == buckets[i]); j++);
+		if (!check_mark(buckets[i], "Index bucket", dir)) {
+			valid = false;
+			continue;
+		}
+		listfs_read_block(fs, buckets[i], bucket);
+		if ((bucket->magic != LISTFS_BUCKET_MAGIC) || (bucket->depth > index->depth) || (bucket->count > capacity) ||
+				((j - i) != (slots >> bucket->depth))) {
+			check_error("Index bucket %llu of %lli is corrupted\n", buckets[i], dir);
+			valid = false;
+			continue;
+		}
+		entries = realloc(entries, (entry_count + bucket->count) * sizeof(ListFS_IndexEntry));
+		size_t k;
+		for (k = 0; k < bucket->count; k++) {
+			if (table[bucket->entries[k].hash & mask] != buckets[i]) {
+				check_error("Index bucket %llu of %lli holds entry of node %llu with foreign hash\n", buckets[i], dir,
+					bucket->entries[k].node);
+				valid = false;
+			}
+			entries[entry_count++] = bucket->entries[k];
+		}
+	}
+	free(bucket);
+	free(buckets);
+	free(table);
+	qsort(entries, entry_count, sizeof(ListFS_IndexEntry), check_entry_compare);
+	ListFS_NodeHeader *header = malloc(block_size);
+	uint64_t children = 0;
+	while ((first != -1) && (first < fs->header->size)) {
+		listfs_read_block(fs, first, header);
+		if (header->magic != LISTFS_NODE_MAGIC) break;
+		ListFS_IndexEntry key = {listfs_name_hash(header->name), first};
+		ListFS_IndexEntry *entry = bsearch(&key, entries, entry_count, sizeof(ListFS_IndexEntry), check_entry_compare);
+		if (!entry || (entry->hash != key.hash)) {
+			check_error("Node %llu is missing from index %llu of %lli\n", first, index_block, dir);
+			valid = false;
+		}
+		children++;
+		first = header->next;
+	}
+	if ((children != entry_count) || (index->count != entry_count)) {
+		check_error("Index %llu of %lli has %llu entries (%llu counted), but directory has %llu nodes\n", index_block, dir,
+			(uint64_t)entry_count, index->count, children);
+		valid = false;
+	}
+	if (!valid) {
+		check_bad_index(dir);
+	}
+	free(header);
+	free(entries);
+	free(index);
+}
+
+void check_directory(ListFS_BlockIndex node, ListFS_BlockIndex parent) {
+	ListFS_NodeHeader *header = malloc(fs->block_size);
+	ListFS_BlockIndex prev = -1;
+	while (node != -1) {
+		if (!check_mark(node, "Node", (parent != -1) ? parent : node)) break;
+		listfs_read_block(fs, node, header);
+		if (header->magic != LISTFS_NODE_MAGIC) {
+			check_error("Node %llu has bad magic %08X\n", node, header->magic);
+			break;
+		}
+		__atomic_fetch_add(&check_state.nodes, 1, __ATOMIC_RELAXED);
+		if (header->prev != prev) {
+			check_error("Node %llu has prev = %llu, expected %llu\n", node, header->prev, prev);
+		}
+		if (header->parent != parent) {
+			check_error("Node %llu has parent = %llu, expected %llu\n", node, header->parent, parent);
+		}
+		if ((header->flags & LISTFS_NODE_FLAG_DIRECTORY) && (header->flags & LISTFS_NODE_FLAG_INDEXED)) {
+			check_index(node, header->index, header->data);
+		}
+		if (header->data != -1) {
+			/* Compressed files are sparse, so their block lists need not cover the size */
+			check_push(header->flags & LISTFS_NODE_FLAG_DIRECTORY, header->data, node,
+				(header->flags & LISTFS_NODE_FLAG_COMPRESSED) ? 0 : header->size);
+		}
+		prev = node;
+		node = header->next;
+	}
+	free(header);
+}
+
+/* Sums the node list the way the library does, comparing the result with aggregates of every directory */
+bool check_aggregates(ListFS_BlockIndex node, ListFS_Aggregates *sum) {
+	ListFS_NodeHeader *header = malloc(fs->block_size);
+	bool valid = true;
+	memset(sum, 0, sizeof(ListFS_Aggregates));
+	while (node != -1) {
+		listfs_read_block(fs, node, header);
+		if (header->flags & LISTFS_NODE_FLAG_DIRECTORY) {
+			ListFS_Aggregates children;
+			valid = check_aggregates(header->data, &children) && valid;
+			if (memcmp(&children, &header->aggregates, sizeof(ListFS_Aggregates))) {
+				check_error("Directory %llu has aggregates of %llu bytes, %llu blocks, %llu entries, expected %llu, %llu, %llu\n",
+					node, header->aggregates.size, header->aggregates.blocks, header->aggregates.entries,
+					children.size, children.blocks, children.entries);
+				valid = false;
+			}
+			sum->size += children.size;
+			sum->blocks += children.blocks + 1;
+			sum->entries += children.entries + 1;
+		} else {
+			sum->size += header->size;
+			sum->blocks += (header->size + fs->block_size - 1) / fs->block_size + 1;
+			sum->entries++;
+		}
+		node = header->next;
+	}
+	free(header);
+	return valid;
+}
+
+void *check_worker(void *arg) {
+	pthread_mutex_lock(&check_state.mutex);
+	while (true) {
+		while ((check_state.count == 0) && (check_state.active > 0)) {
+			pthread_cond_wait(&check_state.cond, &check_state.mutex);
+		}
+		if (check_state.count == 0) break;
+		check_state.count--;
+		CheckItem item = check_state.items[check_state.count];
+		check_state.active++;
+		pthread_mutex_unlock(&check_state.mutex);
+		if (item.directory) {
+			check_directory(item.block, item.parent);
+		} else {
+			check_file(item.parent, item.block, item.size);
+		}
+		pthread_mutex_lock(&check_state.mutex);
+		check_state.active--;
+		if ((check_state.count == 0) && (check_state.active == 0)) {
+			pthread_cond_broadcast(&check_state.cond);
+		}
+	}
+	pthread_mutex_unlock(&check_state.mutex);
+	return NULL;
+}
+
+bool check_filesystem(bool repair) {
+	size_t map_bytes = (fs->header->size + 7) / 8;
+	check_state.reachable = calloc(map_bytes, 1);
+	ListFS_BlockIndex i;
+	for (i = 0; i < fs->header->map_base + fs->header->map_size; i++) {
+		check_state.reachable[i / 8] |= 1 << (i % 8);
+	}
+	check_state.blocks = i;
+	if (fs->ext_header) {
+		ListFS_BlockIndex end = fs->ext_header->journal_size ? (fs->ext_header->journal_base + fs->ext_header->journal_size) : 0;
+		check_mark(i, "Extended header", 0);
+		for (i = fs->ext_header->journal_base; i < end; i++) {
+			check_mark(i, "Journal block", 0);
+		}
+	}
+	if (fs->refcount_chunks) {
+		for (i = 0; i < fs->ext_header->refcount_size; i++) {
+			check_mark(fs->ext_header->refcount_base + i, "Reference count block", 0);
+		}
+		size_t chunk_count = (fs->header->size + fs->block_size / 2 - 1) / (fs->block_size / 2);
+		for (i = 0; i < chunk_count; i++) {
+			if (fs->refcount_chunks[i] != -1) {
+				check_mark(fs->refcount_chunks[i], "Reference count chunk", 0);
+			}
+		}
+		check_state.references = calloc(fs->header->size, sizeof(uint32_t));
+	}
+	if (fs->ext_header && (fs->ext_header->flags & LISTFS_EXT_FLAG_ROOT_INDEX)) {
+		check_index(-1, fs->ext_header->root_index, fs->header->root_dir);
+	}
+	if (fs->header->root_dir != -1) {
+		check_push(true, fs->header->root_dir, -1, 0);
+	}
+	if (fs->ext_header && (fs->ext_header->flags & LISTFS_EXT_FLAG_ORPHANS)) {
+		/* Orphans are chained like a directory of their own until they are reclaimed */
+		check_push(true, fs->ext_header->orphans, -1, 0);
+	}
+	run_workers(check_worker, NULL);
+	bool aggregates_valid = true;
+	/* Aggregates are only summed over a sound tree, lists with loops would never end */
+	if (fs->ext_header && (fs->ext_header->flags & LISTFS_EXT_FLAG_AGGREGATES) && !check_state.errors) {
+		ListFS_Aggregates sum;
+		aggregates_valid = check_aggregates(fs->header->root_dir, &sum);
+		ListFS_Aggregates *root = &fs->ext_header->root_aggregates;
+		if (memcmp(&sum, root, sizeof(ListFS_Aggregates))) {
+			check_error("Volume has aggregates of %llu bytes, %llu blocks, %llu entries, expected %llu, %llu, %llu\n",
+				root->size, root->blocks, root->entries, sum.size, sum.blocks, sum.entries);
+			aggregates_valid = false;
+		}
+	}
+	ListFS_BlockCount leaked = 0, missing = 0;
+	for (i = 0; i < fs->header->size; i++) {
+		bool used = (fs->map[i / 8] >> (i % 8)) & 1;
+		bool reachable = (check_state.reachable[i / 8] >> (i % 8)) & 1;
+		if (used && !reachable) {
+			leaked++;
+		} else if (!used && reachable) {
+			missing++;
+		}
+	}
+	if (check_state.references) {
+		for (i = 0; i < fs->header->size; i++) {
+			uint16_t count = listfs_get_refcount(fs, i);
+			if (count && (check_state.references[i] != count + 1)) {
+				check_error("Block %llu is referenced %u times, but its reference count is %u\n", i,
+					check_state.references[i], count + 1);
+			}
+		}
+		free(check_state.references);
+	}
+	printf("Checked %llu nodes, %llu blocks in use\n", check_state.nodes, check_state.blocks);
+	if (leaked) {
+		printf("%llu blocks are marked used but unreachable\n", leaked);
+	}
+	if (missing) {
+		printf("%llu blocks are in use but marked free\n", missing);
+	}
+	if (fs->header->used_blocks != check_state.blocks) {
+		printf("Used blocks count is %llu, expected %llu\n", fs->header->used_blocks, check_state.blocks);
+	}
+	bool map_valid = !leaked && !missing && (fs->header->used_blocks == check_state.blocks);
+	if (!map_valid && repair) {
+		size_t k;
+		for (k = 0; k < map_bytes; k++) {
+			if (fs->map[k] != check_state.reachable[k]) {
+				listfs_mark_map_dirty(fs, k * 8, 8);
+			}
+		}
+		memcpy(fs->map, check_state.reachable, map_bytes);
+		fs->header->used_blocks = check_state.blocks;
+		printf("Bitmap and used blocks count rebuilt\n");
+	}
+	if (!aggregates_valid && repair && listfs_build_aggregates(fs)) {
+		printf("Aggregates rebuilt\n");
+	}
+	size_t rebuilt = 0;
+	for (i = 0; repair && (i < check_state.bad_index_count); i++) {
+		if (listfs_rebuild_index(fs, check_state.bad_indexes[i])) {
+			rebuilt++;
+		}
+	}
+	free(check_state.bad_indexes);
+	free(check_state.reachable);
+	free(check_state.items);
+	bool valid = map_valid && !check_state.errors;
+	if (rebuilt) {
+		printf("Indexes of %llu directories rebuilt\n", (uint64_t)rebuilt);
+		/* Blocks of a damaged index aren't freed on rebuild, a second pass takes them back */
+		check_state.reachable = NULL;
+		check_state.references = NULL;
+		check_state.items = NULL;
+		check_state.count = check_state.capacity = 0;
+		check_state.nodes = check_state.blocks = check_state.errors = 0;
+		check_state.bad_indexes = NULL;
+		check_state.bad_index_count = 0;
+		check_filesystem(repair);
+	}
+	return valid;
+}
+
+int main(int argc, char *argv[]) {
+	int i, j = 1;
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--async-unlink") == 0) {
+			async_unlink = true;
+		} else if (strcmp(argv[i], "--discard") == 0) {
+			discard = true;
+		} else if (strcmp(argv[i], "--dry-run") == 0) {
+			dry_run = true;
+		} else if (strcmp(argv[i], "--repair") == 0) {
+			repair = true;
+		} else if (strcmp(argv[i], "--compress") == 0) {
+			compress = true;
+		} else if (strcmp(argv[i], "--index-dirs") == 0) {
+			index_dirs = true;
+		} else if (strcmp(argv[i], "--aggregates") == 0) {
+			aggregates = true;
+		} else if (strncmp(argv[i], "--journal=", 10) == 0) {
+			journal_size = atol(argv[i] + 10);
+		} else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+			jobs = atoi(argv[i] + 7);
+		} else if (strncmp(argv[i], "--stripe-width=", 15) == 0) {
+			stripe_width = atol(argv[i] + 15);
+			if (!stripe_width) {
+				printf("Stripe width must be at least one block!\n");
+				return -1;
+			}
+		} else {
+			argv[j] = argv[i];
+			j++;
+		}
+	}
+	argc = j;
+	if (argc < 3) {
+		display_usage();
+		return 0;
+	}
+	log_file = fopen("/tmp/listfs-tool.log", "w");
+	fs = listfs_init(read_block_func, write_block_func, log_func);
+	fs->write_blocks_func = write_blocks_func;
+	fs->read_blocks_func = read_blocks_func;
+	fs->flush_func = flush_func;
+	char *action = argv[1];
+	char *file_name = argv[2];
+	if (strcmp(action, "create") == 0) {
+		if (argc < 5) {
+			display_usage();
+			return 0;
+		}
+		ListFS_BlockCount fs_size = atol(argv[3]);
+		int fs_block_size = atoi(argv[4]);
+		if (fs_size < 2) {
+			printf("FS size too small!\n");
+			return -1;
+		}
+		if (!listfs_valid_block_size(fs_block_size)) {
+			printf("Block size must be from %u to %u bytes, sizes above %u bytes must be powers of two!\n",
+				LISTFS_MIN_BLOCK_SIZE, LISTFS_MAX_BLOCK_SIZE, UINT16_MAX);
+			return -1;
+		}
+		uint8_t *bootloader = NULL;
+		size_t bootloader_size = 0;
+		if ((argc >= 6) && !load_bootloader(argv[5], &bootloader, &bootloader_size)) {
+			return -2;
+		}
+		if (!open_device(file_name, O_RDWR | O_CREAT | O_TRUNC)) {
+			return -2;
+		}
+		if (!device_is_block && !stripe_count && (ftruncate(device_fd, fs_size * fs_block_size) < 0)) {
+			fprintf(stderr, "Failed to resize '%s' to %llu bytes!\n", file_name, fs_size * fs_block_size);
+			return -2;
+		}
+		if (!format_device(fs_size, fs_block_size, bootloader, bootloader_size)) {
+			return -2;
+		}
+		if (journal_size && !listfs_create_journal(fs, journal_size)) {
+			fprintf(stderr, "Failed to create journal of %llu blocks!\n", journal_size);
+		}
+		if (aggregates) {
+			listfs_build_aggregates(fs);
+		}
+		ListFS_OpennedFile *file = listfs_open_file(fs, listfs_create_node(fs, "README", 0, -1));
+		listfs_file_write(file, readme_text, strlen(readme_text));
+		listfs_file_close(file);
+		listfs_close(fs);
+		free(bootloader);
+		return 0;
+	} else if (strcmp(action, "pack") == 0) {
+		if (argc < 5) {
+			display_usage();
+			return 0;
+		}
+		char *host_dir = argv[2];
+		file_name = argv[3];
+		int fs_block_size = atoi(argv[4]);
+		ListFS_BlockCount fs_size = (argc >= 6) ? atol(argv[5]) : 0;
+		if (!listfs_valid_block_size(fs_block_size)) {
+			printf("Block size must be from %u to %u bytes, sizes above %u bytes must be powers of two!\n",
+				LISTFS_MIN_BLOCK_SIZE, LISTFS_MAX_BLOCK_SIZE, UINT16_MAX);
+			return -1;
+		}
+		uint8_t *bootloader = NULL;
+		size_t bootloader_size = 0;
+		if ((argc >= 7) && !load_bootloader(argv[6], &bootloader, &bootloader_size)) {
+			return -2;
+		}
+		size_t root_first, root_count;
+		if (!pack_scan(host_dir, &root_first, &root_count)) {
+			return -2;
+		}
+		ListFS_BlockIndex needed = 0;
+		pack_plan(root_first, root_count, fs_block_size, &needed);
+		ListFS_BlockCount reserved = (bootloader_size ? bootloader_size : sizeof(ListFS_Header)) / fs_block_size + 2 + journal_size;
+		if (compress) {
+			/* Compressed files are written through the library, so reserve room for them stored uncompressed */
+			size_t k;
+			for (k = 0; k < pack_entry_count; k++) {
+				if (!pack_entries[k].directory) {
+					reserved += pack_compressed_blocks(pack_entries[k].size, fs_block_size);
+				}
+			}
+		}
+		ListFS_BlockCount min_size = needed + reserved, prev_size = 0;
+		while (min_size != prev_size) {
+			prev_size = min_size;
+			min_size = needed + reserved + (prev_size / 8 + fs_block_size) / fs_block_size;
+		}
+		if (fs_size < min_size) {
+			fs_size = min_size;
+		}
+		if (!open_device(file_name, O_RDWR | O_CREAT | O_TRUNC)) {
+			return -2;
+		}
+		if (!device_is_block && !stripe_count && (ftruncate(device_fd, fs_size * fs_block_size) < 0)) {
+			fprintf(stderr, "Failed to resize '%s' to %llu bytes!\n", file_name, fs_size * fs_block_size);
+			return -2;
+		}
+		if (!format_device(fs_size, fs_block_size, bootloader, bootloader_size)) {
+			return -2;
+		}
+		if (journal_size && !listfs_create_journal(fs, journal_size)) {
+			fprintf(stderr, "Failed to create journal of %llu blocks!\n", journal_size);
+		}
+		ListFS_BlockIndex start = listfs_alloc_run(fs, needed, 0);
+		if ((needed > 0) && (start == -1)) {
+			fprintf(stderr, "Not enough contiguous space for %llu blocks!\n", needed);
+			return -3;
+		}
+		pack_plan(root_first, root_count, fs_block_size, &start);
+		fs->header->root_dir = root_count ? pack_entries[root_first].node : -1;
+		pack_write_nodes(root_first, root_count, -1);
+		if (compress) {
+			uint8_t *buffer = malloc(PACK_STREAM_SIZE);
+			size_t k;
+			for (k = 0; k < pack_entry_count; k++) {
+				if (!pack_entries[k].directory && pack_entries[k].size) {
+					pack_write_compressed(&pack_entries[k], buffer, PACK_STREAM_SIZE);
+				}
+			}
+			free(buffer);
+			listfs_commit(fs, true);
+			for (k = 0; k < pack_entry_count; k++) {
+				if (!pack_entries[k].directory && pack_entries[k].size) {
+					pack_set_time(&pack_entries[k]);
+				}
+			}
+		} else {
+			run_workers(pack_worker, NULL);
+		}
+		if (aggregates) {
+			listfs_build_aggregates(fs);
+		}
+		listfs_close(fs);
+		printf("Packed %u entries into %llu blocks\n", pack_entry_count, fs_size);
+		free(bootloader);
+		return 0;
+#ifndef DISABLE_FUSE
+	} else if (strcmp(action, "mount") == 0) {
+		if (argc < 4) {
+			display_usage();
+			return 0;
+		}
+		fs->read_only = fuse_read_only(argc - 3, argv + 3);
+		if (!open_device(file_name, fs->read_only ? O_RDONLY : O_RDWR)) {
+			return -2;
+		}
+		if (!listfs_open(fs)) {
+			fprintf(stderr, "Failed to open ListFS volume! Maybe this is not ListFS?\n");
+		}
+		if (discard) {
+			fs->discard_func = discard_func;
+		}
+		for (i = 3; i < argc; i++) {
+			argv[i - 2] = argv[i];
+		}
+		stripe_stop();
+		return fuse_main(argc - 2, argv, fs->read_only ? &listfs_ro_operations : &listfs_operations, NULL);
+#endif
+	} else if (strcmp(action, "dump") == 0) {
+		fs->read_only = true;
+		if (!open_device(file_name, O_RDONLY)) {
+			return -2;
+		}
+		if (!listfs_open(fs) || !listfs_load_map(fs)) {
+			fprintf(stderr, "Failed to open ListFS volume! Maybe this is not ListFS?\n");
+			return -3;
+		}
+		printf("ListFS information:\n\tVersion: %i.%i\n\tBase: %llu\n\tSize: %llu\n\tBitmap base: %llu\n\tBitmap size: %llu\n"
+			"\tBlock size: %u\n\tUsed blocks count: %llu\n",
+			fs->header->version >> 8, fs->header->version & 0xFF, fs->header->base, fs->header->size,
+			fs->header->map_base, fs->header->map_size, fs->block_size, fs->header->used_blocks);
+		if (fs->ext_header && fs->ext_header->journal_size) {
+			printf("\tJournal: %llu blocks at %llu (sequence %llu)\n", fs->ext_header->journal_size,
+				fs->ext_header->journal_base, fs->ext_header->journal_sequence);
+		}
+		if (fs->refcount_chunks) {
+			ListFS_BlockCount shared = 0, chunks = 0;
+			ListFS_BlockIndex i;
+			for (i = 0; i < fs->header->size; i++) {
+				if (listfs_get_refcount(fs, i)) {
+					shared++;
+				}
+				if ((i % (fs->block_size / 2) == 0) && (fs->refcount_chunks[i / (fs->block_size / 2)] != -1)) {
+					chunks++;
+				}
+			}
+			printf("\tReference counts: %llu blocks at %llu, %llu chunks (%llu blocks shared)\n",
+				fs->ext_header->refcount_size, fs->ext_header->refcount_base, chunks, shared);
+		}
+		if (fs->ext_header && (fs->ext_header->flags & LISTFS_EXT_FLAG_ROOT_INDEX)) {
+			dump_index(fs->ext_header->root_index, "");
+		}
+		if (fs->ext_header && (fs->ext_header->flags & LISTFS_EXT_FLAG_AGGREGATES)) {
+			dump_aggregates(&fs->ext_header->root_aggregates, "");
+		}
+		printf("Nodes:\n");
+		dump_tree();
+		listfs_close(fs);
+	} else if ((strcmp(action, "extract") == 0) || (strcmp(action, "export") == 0)) {
+		bool export = (strcmp(action, "export") == 0);
+		if (!export && (argc < 4)) {
+			display_usage();
+			return 0;
+		}
+		/* Journal is replayed in memory only, the device is opened read-only */
+		fs->read_only = true;
+		if (!open_device(file_name, O_RDONLY)) {
+			return -2;
+		}
+		if (!listfs_open(fs)) {
+			fprintf(stderr, "Failed to open ListFS volume! Maybe this is not ListFS?\n");
+			return -3;
+		}
+		posix_fadvise(device_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		listfs_foreach_node(fs, fs->header->root_dir, extract_node_callback, "");
+		size_t i;
+		if (export) {
+			ExtractEntry **files = malloc(extract_entry_count * sizeof(ExtractEntry*));
+			size_t file_count = 0;
+			for (i = 0; i < extract_entry_count; i++) {
+				ExtractEntry *entry = &extract_entries[i];
+				if (entry->directory) {
+					char name[strlen(entry->path) + 2];
+					sprintf(name, "%s/", entry->path);
+					tar_write_header(name, '5', 0, entry->time);
+				} else {
+					files[file_count++] = entry;
+				}
+			}
+			qsort(files, file_count, sizeof(ExtractEntry*), export_entry_compare);
+			size_t buffer_size = stream_buffer_size();
+			uint8_t *buffer = malloc(buffer_size);
+			for (i = 0; i < file_count; i++) {
+				export_file(files[i], buffer, buffer_size);
+			}
+			memset(buffer, 0, TAR_BLOCK_SIZE * 2);
+			tar_write(buffer, TAR_BLOCK_SIZE * 2);
+			if (tar_written % TAR_RECORD_SIZE) {
+				size_t length = TAR_RECORD_SIZE - tar_written % TAR_RECORD_SIZE;
+				memset(buffer, 0, length);
+				tar_write(buffer, length);
+			}
+			free(buffer);
+			free(files);
+		} else {
+			extract_dir = argv[3];
+			mkdir(extract_dir, 0755);
+			for (i = 0; i < extract_entry_count; i++) {
+				if (extract_entries[i].directory) {
+					char path[strlen(extract_dir) + strlen(extract_entries[i].path) + 2];
+					sprintf(path, "%s/%s", extract_dir, extract_entries[i].path);
+					if ((mkdir(path, 0755) != 0) && (errno != EEXIST)) {
+						fprintf(stderr, "Failed to create '%s'!\n", path);
+					}
+				}
+			}
+			run_workers(extract_worker, NULL);
+			for (i = extract_entry_count; i > 0; i--) {
+				if (extract_entries[i - 1].directory) {
+					char path[strlen(extract_dir) + strlen(extract_entries[i - 1].path) + 2];
+					sprintf(path, "%s/%s", extract_dir, extract_entries[i - 1].path);
+					set_directory_time(path, extract_entries[i - 1].time);
+				}
+			}
+		}
+		listfs_close(fs);
+	} else if (strcmp(action, "check") == 0) {
+		/* Without --repair the journal is replayed in memory only, the device is never written */
+		fs->read_only = !repair;
+		if (!open_device(file_name, repair ? O_RDWR : O_RDONLY)) {
+			return -2;
+		}
+		if (!listfs_open(fs) || !listfs_load_map(fs)) {
+			fprintf(stderr, "Failed to open ListFS volume! Maybe this is not ListFS?\n");
+			return -3;
+		}
+		bool clean = check_filesystem(repair);
+		listfs_close(fs);
+		if (!clean) {
+			return 1;
+		}
+	} else if (strcmp(action, "trim") == 0) {
+		if (!open_device(file_name, O_RDWR)) {
+			return -2;
+		}
+		if (!listfs_open(fs)) {
+			fprintf(stderr, "Failed to open ListFS volume! Maybe this is not ListFS?\n");
+			return -3;
+		}
+		fs->discard_func = discard_func;
+		printf("Discarded %llu free blocks\n", listfs_trim(fs));
+		listfs_close(fs);
+	} else if (strcmp(action, "rm") == 0) {
+		if (argc < 4) {
+			display_usage();
+			return 0;
+		}
+		if (!open_device(file_name, O_RDWR)) {
+			return -2;
+		}
+		if (!listfs_open(fs)) {
+			fprintf(stderr, "Failed to open ListFS volume! Maybe this is not ListFS?\n");
+			return -3;
+		}
+		char *path = argv[3];
+		while (path[0] == '/') path++;
+		ListFS_BlockIndex node = listfs_search_node(fs, path, fs->header->root_dir);
+		if (node == -1) {
+			fprintf(stderr, "'%s' not found!\n", argv[3]);
+			listfs_close(fs);
+			return -4;
+		}
+		listfs_delete_tree(fs, node);
+		listfs_close(fs);
+	} else if (strcmp(action, "clone") == 0) {
+		if (argc < 5) {
+			display_usage();
+			return 0;
+		}
+		if (!open_device(file_name, O_RDWR)) {
+			return -2;
+		}
+		if (!listfs_open(fs)) {
+			fprintf(stderr, "Failed to open ListFS volume! Maybe this is not ListFS?\n");
+			return -3;
+		}
+		char *path = argv[3];
+		while (path[0] == '/') path++;
+		ListFS_BlockIndex node = listfs_search_node(fs, path, fs->header->root_dir);
+		if (node == -1) {
+			fprintf(stderr, "'%s' not found!\n", argv[3]);
+			listfs_close(fs);
+			return -4;
+		}
+		path = argv[4];
+		while (path[0] == '/') path++;
+		char *_path = strdup(path);
+		char *parent_name = dirname(_path);
+		char *name = strrchr(path, '/') ? (strrchr(path, '/') + 1) : path;
+		ListFS_BlockIndex parent = -1;
+		if (strcmp(parent_name, ".") != 0) {
+			parent = listfs_search_node(fs, parent_name, fs->header->root_dir);
+			if (parent == -1) {
+				fprintf(stderr, "'%s' not found!\n", parent_name);
+				free(_path);
+				listfs_close(fs);
+				return -4;
+			}
+		}
+		free(_path);
+		if (listfs_search_node(fs, path, fs->header->root_dir) != -1) {
+			fprintf(stderr, "'%s' already exists!\n", argv[4]);
+			listfs_close(fs);
+			return -4;
+		}
+		if (listfs_clone_file(fs, node, parent, name) == -1) {
+			fprintf(stderr, "Failed to clone '%s'!\n", argv[3]);
+			listfs_close(fs);
+			return -5;
+		}
+		listfs_close(fs);
+	} else if (strcmp(action, "index") == 0) {
+		if (!open_device(file_name, O_RDWR)) {
+			return -2;
+		}
+		if (!listfs_open(fs)) {
+			fprintf(stderr, "Failed to open ListFS volume! Maybe this is not ListFS?\n");
+			return -3;
+		}
+		ListFS_BlockIndex node = -1;
+		if (argc >= 4) {
+			char *path = argv[3];
+			while (path[0] == '/') path++;
+			if (path[0]) {
+				node = listfs_search_node(fs, path, fs->header->root_dir);
+				if (node == -1) {
+					fprintf(stderr, "'%s' not found!\n", argv[3]);
+					listfs_close(fs);
+					return -4;
+				}
+			}
+		}
+		if (!listfs_index_directory(fs, node)) {
+			fprintf(stderr, "Failed to index '%s'!\n", (argc >= 4) ? argv[3] : "/");
+			listfs_close(fs);
+			return -5;
+		}
+		listfs_close(fs);
+	} else if (strcmp(action, "aggregate") == 0) {
+		if (!open_device(file_name, O_RDWR)) {
+			return -2;
+		}
+		if (!listfs_open(fs)) {
+			fprintf(stderr, "Failed to open ListFS volume! Maybe this is not ListFS?\n");
+			return -3;
+		}
+		if (!listfs_build_aggregates(fs)) {
+			fprintf(stderr, "Failed to build aggregates!\n");
+			listfs_close(fs);
+			return -5;
+		}
+		listfs_close(fs);
+	} else if (strcmp(action, "du") == 0) {
+		fs->read_only = true;
+		if (!open_device(file_name, O_RDONLY)) {
+			return -2;
+		}
+		if (!listfs_open(fs)) {
+			fprintf(stderr, "Failed to open ListFS volume! Maybe this is not ListFS?\n");
+			return -3;
+		}
+		ListFS_BlockIndex node = -1;
+		char *path = (argc >= 4) ? argv[3] : "/";
+		while (path[0] == '/') path++;
+		if (path[0]) {
+			node = listfs_search_node(fs, path, fs->header->root_dir);
+			if (node == -1) {
+				fprintf(stderr, "'%s' not found!\n", argv[3]);
+				listfs_close(fs);
+				return -4;
+			}
+		}
+		ListFS_Aggregates result;
+		if (!listfs_get_aggregates(fs, node, &result)) {
+			fprintf(stderr, "No aggregates for '%s', it must be a directory of volume with aggregates (see 'aggregate')!\n",
+				(argc >= 4) ? argv[3] : "/");
+			listfs_close(fs);
+			return -5;
+		}
+		printf("%llu bytes, %llu blocks, %llu entries\n", result.size, result.blocks, result.entries);
+		listfs_close(fs);
+	} else if (strcmp(action, "defrag") == 0) {
+		fs->read_only = dry_run;
+		if (!open_device(file_name, dry_run ? O_RDONLY : O_RDWR)) {
+			return -2;
+		}
+		if (!listfs_open(fs)) {
+			fprintf(stderr, "Failed to open ListFS volume! Maybe this is not ListFS?\n");
+			return -3;
+		}
+		DefragStats stats;
+		defrag_score(&stats);
+		print_defrag_stats("Fragmentation before", &stats);
+		if (!dry_run) {
+			defrag_directory(-1, &stats);
+			printf("Relocated %llu files and %llu directory entries (%llu skipped for lack of contiguous free space or sharing blocks with clones)\n",
+				stats.relocated_files, stats.relocated_entries, stats.skipped);
+			defrag_score(&stats);
+			print_defrag_stats("Fragmentation after", &stats);
 		}
-		printf("ListFS information:\n\tVersion: %i.%i\n\tBase: %llu\n\tSize: %llu\n\tBitmap base: %llu\n\tBitmap size: %llu\n"
-			"\tBlock size: %u\n\tUsed blocks count: %llu\n",
-			fs->header->version >> 8, fs->header->version & 0xFF, fs->header->base, fs->header->size,
-			fs->header->map_base, fs->header->map_size, fs->header->block_size, fs->header->used_blocks);
-		printf("Nodes:\n");
-		listfs_foreach_node(fs, fs->header->root_dir, dump_node_callback, "\t");
 		listfs_close(fs);
 	} else {
 		printf("Unknown action: %s!\n", action);
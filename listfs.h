@@ -4,10 +4,13 @@
 #include <stdint.h>
 
 #define LISTFS_VERSION_MAJOR 1
-#define LISTFS_VERSION_MINOR 0
+#define LISTFS_VERSION_MINOR 2
 
 #define LISTFS_MAGIC 0x5453494C
+/* Volumes with block size stored as log2 have different magic, so readers before 1.2 refuse them */
+#define LISTFS_LARGE_MAGIC 0x4253494C
 #define LISTFS_MIN_BLOCK_SIZE 512
+#define LISTFS_MAX_BLOCK_SIZE (1024 * 1024)
 
 typedef uint64_t ListFS_BlockIndex;
 typedef uint64_t ListFS_BlockCount;
@@ -25,8 +28,52 @@ typedef struct {
 	ListFS_BlockCount used_blocks;
 } __attribute__((packed)) ListFS_Header;
 
+#define LISTFS_EXT_MAGIC 0x48545845
+#define LISTFS_EXT_FLAG_REFCOUNTS 1
+#define LISTFS_EXT_FLAG_ROOT_INDEX 2
+#define LISTFS_EXT_FLAG_AGGREGATES 4
+#define LISTFS_EXT_FLAG_ORPHANS 8
+#define LISTFS_EXT_FLAG_MOUNTED 16
+
+typedef struct {
+	uint64_t size;
+	uint64_t blocks;
+	uint64_t entries;
+} __attribute__((packed)) ListFS_Aggregates;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t flags;
+	ListFS_BlockIndex journal_base;
+	ListFS_BlockCount journal_size;
+	uint64_t journal_sequence;
+	ListFS_BlockIndex refcount_base;
+	ListFS_BlockCount refcount_size;
+	ListFS_BlockIndex root_index;
+	ListFS_Aggregates root_aggregates;
+	ListFS_BlockIndex orphans;
+} __attribute__((packed)) ListFS_ExtHeader;
+
+#define LISTFS_JOURNAL_MAGIC 0x4C4E524A
+#define LISTFS_JOURNAL_DESCRIPTOR 1
+#define LISTFS_JOURNAL_COMMIT 2
+
+typedef struct {
+	uint32_t magic;
+	uint32_t type;
+	uint64_t sequence;
+	uint64_t count;
+	uint64_t checksum;
+	ListFS_BlockIndex blocks[];
+} __attribute__((packed)) ListFS_JournalBlock;
+
 #define LISTFS_NODE_MAGIC 0x45444F4E
 #define LISTFS_NODE_FLAG_DIRECTORY 1
+#define LISTFS_NODE_FLAG_COMPRESSED 2
+#define LISTFS_NODE_FLAG_INDEXED 4
+
+#define LISTFS_CLUSTER_SIZE 65536
+#define LISTFS_CLUSTER_STORED 0x80000000
 
 typedef struct {
 	uint8_t name[256];
@@ -40,6 +87,33 @@ typedef struct {
 	uint64_t create_time;
 	uint64_t modify_time;
 	uint64_t access_time;
+	ListFS_BlockIndex index;
+	ListFS_Aggregates aggregates;
 } __attribute__((packed)) ListFS_NodeHeader;
 
+#define LISTFS_INDEX_MAGIC 0x58444E49
+#define LISTFS_BUCKET_MAGIC 0x544B4342
+#define LISTFS_INDEX_MAX_DEPTH 24
+
+typedef struct {
+	uint32_t magic;
+	uint32_t depth;
+	uint64_t count;
+	ListFS_BlockIndex table_base;
+	ListFS_BlockCount table_size;
+	ListFS_BlockIndex buckets[];
+} __attribute__((packed)) ListFS_IndexHeader;
+
+typedef struct {
+	uint64_t hash;
+	ListFS_BlockIndex node;
+} __attribute__((packed)) ListFS_IndexEntry;
+
+typedef struct {
+	uint32_t magic;
+	uint32_t depth;
+	uint64_t count;
+	ListFS_IndexEntry entries[];
+} __attribute__((packed)) ListFS_IndexBucket;
+
 #endif
\ No newline at end of file